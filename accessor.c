@@ -0,0 +1,348 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "accessor.h"
+#include "objdump.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+
+// The ELF and symbol code reads the same headers and tables of a process over and over, each time with
+// a system call. A memory accessor keeps /proc/pid/mem open and remembers the pages it has read from
+// read-only file mappings, which don't change unless someone writes to them through us, so repeated
+// walks of them are a memcpy. While an accessor is open for a process, process_read and process_readv
+// go through it and process_write invalidates what it overwrites. Since the process can map and unmap
+// files at any time, the owner of the accessor invalidates it whenever the process may have run.
+
+#define ACCESSOR_CACHE_SLOTS 1024	/// Pages the cache holds at most; it is direct-mapped.
+#define ACCESSOR_CACHE_MAX_PAGES 4	/// Pages a read may span and still go through the cache.
+
+/**
+ * A page held by the cache.
+ *
+ */
+typedef struct CachedPage
+{
+	uintptr_t addr;			/// Address of the page, 0 if the slot is empty.
+	char* data;			/// The page's bytes, allocated on first use of the slot.
+} CachedPage;
+
+/**
+ *  A memory accessor for one process.
+ */
+struct MemoryAccessor
+{
+	int process;				/// The process the accessor reads from.
+	int fd;					/// /proc/pid/mem, or -1 if it could not be opened.
+	int page_size;
+	MemoryRegion* regions;			/// Mappings of the process as of the last invalidation.
+	int num_regions;			/// Number of entries in regions.
+	CachedPage pages[ACCESSOR_CACHE_SLOTS];	/// The page cache.
+	uint64_t hits;				/// Pages found in the cache.
+	uint64_t misses;			/// Cacheable pages that had to be read.
+	struct MemoryAccessor* next;		/// Next accessor in the list of open accessors.
+};
+
+static MemoryAccessor* accessors = NULL;
+static int num_accessors = 0;
+static pthread_mutex_t accessors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void load_regions(MemoryAccessor* accessor)
+{
+	free(accessor->regions);
+	accessor->regions = NULL;
+	accessor->num_regions = find_memory_regions(accessor->process, &accessor->regions);
+	if(accessor->num_regions < 0)
+	{
+		accessor->regions = NULL;
+		accessor->num_regions = 0;
+	}
+}
+
+/**
+ *  Open an accessor for a process. process_read and process_readv use it from now on.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	A handle to the accessor. If one is already open for the process, that one is returned.
+ *
+ */
+MemoryAccessor* open_memory_accessor(int process)
+{
+	MemoryAccessor* accessor = find_memory_accessor(process);
+	if(accessor)
+		return accessor;
+
+	char name[PATH_MAX];
+	snprintf(name, sizeof(name), "/proc/%d/mem", process);
+
+	accessor = (MemoryAccessor*) calloc(1, sizeof(MemoryAccessor));
+	accessor->process = process;
+	accessor->fd = open(name, O_RDONLY | O_CLOEXEC);
+
+	accessor->page_size = sysconf(_SC_PAGE_SIZE);
+	load_regions(accessor);
+
+	pthread_mutex_lock(&accessors_lock);
+	accessor->next = accessors;
+	accessors = accessor;
+	__atomic_store_n(&num_accessors, num_accessors + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&accessors_lock);
+
+	return accessor;
+}
+
+/**
+ *  Close an accessor and free its cache.
+ *
+ *  @param[in] accessor
+ *  	The accessor returned by open_memory_accessor.
+ *
+ */
+void close_memory_accessor(MemoryAccessor* accessor)
+{
+	pthread_mutex_lock(&accessors_lock);
+	MemoryAccessor** cur;
+	for(cur = &accessors; *cur; cur = &(*cur)->next)
+	{
+		if(*cur == accessor)
+		{
+			*cur = accessor->next;
+			__atomic_store_n(&num_accessors, num_accessors - 1, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&accessors_lock);
+
+	int i;
+	for(i = 0; i < ACCESSOR_CACHE_SLOTS; i++)
+		free(accessor->pages[i].data);
+
+	if(accessor->fd != -1)
+		close(accessor->fd);
+
+	free(accessor->regions);
+	free(accessor);
+}
+
+/**
+ *  Find the accessor open for a process.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	The accessor, or NULL if there is none.
+ *
+ */
+MemoryAccessor* find_memory_accessor(int process)
+{
+	// skip the lock in the common case of there being no accessors at all; process_read asks on every read
+	if(__atomic_load_n(&num_accessors, __ATOMIC_ACQUIRE) == 0)
+		return NULL;
+
+	pthread_mutex_lock(&accessors_lock);
+	MemoryAccessor* accessor;
+	for(accessor = accessors; accessor; accessor = accessor->next)
+	{
+		if(accessor->process == process)
+			break;
+	}
+	pthread_mutex_unlock(&accessors_lock);
+
+	return accessor;
+}
+
+/**
+ *  Only private read-only file mappings are cached: code, read-only data and ELF headers.
+ *
+ */
+static int page_cacheable(MemoryAccessor* accessor, uintptr_t page)
+{
+	int low = 0;
+	int high = accessor->num_regions - 1;
+	while(low <= high)
+	{
+		int mid = (low + high) / 2;
+		MemoryRegion* region = &accessor->regions[mid];
+		if(page < region->start)
+			high = mid - 1;
+		else if(page >= region->end)
+			low = mid + 1;
+		else
+			return region->path[0] == '/' && region->permissions[0] == 'r'
+				&& region->permissions[1] != 'w' && region->permissions[3] == 'p';
+	}
+
+	return 0;
+}
+
+static CachedPage* page_slot(MemoryAccessor* accessor, uintptr_t page)
+{
+	return &accessor->pages[(page / accessor->page_size) & (ACCESSOR_CACHE_SLOTS - 1)];
+}
+
+/**
+ *  Reads bytes from a process through the accessor's cache only, reading and caching the pages they are
+ *  on if need be. Reads of more than a few pages are left to the caller: a page at a time they would be
+ *  slower than one read, and would push the headers and tables that get read over and over out of the cache.
+ *
+ *  @param[in] accessor
+ *  	The accessor.
+ *
+ *  @param[out] buf
+ *  	The buffer to read the bytes into.
+ *
+ *  @param[in] count
+ *  	Number of bytes to read.
+ *
+ *  @param[in] addr
+ *  	Address to read from.
+ *
+ *  @return
+ *  	1 if the bytes were read, 0 if they span too many pages, are not all in cacheable pages or could not
+ *  	be read.
+ *
+ */
+int accessor_read_cached(MemoryAccessor* accessor, void* buf, size_t count, uintptr_t addr)
+{
+	if(accessor->fd == -1 || count == 0)
+		return 0;
+
+	uintptr_t first = addr & ~((uintptr_t) accessor->page_size - 1);
+	if(addr + count - first > (uintptr_t) ACCESSOR_CACHE_MAX_PAGES * accessor->page_size)
+		return 0;
+
+	uintptr_t page;
+	for(page = first; page < addr + count; page += accessor->page_size)
+	{
+		if(!page_cacheable(accessor, page))
+			return 0;
+	}
+
+	char* out = (char*) buf;
+	for(page = first; page < addr + count; page += accessor->page_size)
+	{
+		CachedPage* slot = page_slot(accessor, page);
+		if(slot->addr == page)
+		{
+			++accessor->hits;
+		}
+		else
+		{
+			++accessor->misses;
+
+			if(!slot->data)
+				slot->data = (char*) malloc(accessor->page_size);
+
+			slot->addr = 0;
+			if(pread(accessor->fd, slot->data, accessor->page_size, page) != accessor->page_size)
+				return 0;
+
+			slot->addr = page;
+		}
+
+		uintptr_t start = page > addr ? page : addr;
+		uintptr_t end = page + accessor->page_size < addr + count ? page + accessor->page_size : addr + count;
+		memcpy(out + (start - addr), slot->data + (start - page), end - start);
+	}
+
+	return 1;
+}
+
+/**
+ *  Reads bytes from a process, from the cache if they are in cacheable pages and from the accessor's
+ *  /proc/pid/mem otherwise.
+ *
+ *  @param[in] accessor
+ *  	The accessor.
+ *
+ *  @param[out] buf
+ *  	The buffer to read the bytes into.
+ *
+ *  @param[in] count
+ *  	Number of bytes to read.
+ *
+ *  @param[in] addr
+ *  	Address to read from.
+ *
+ *  @return
+ *  	1 if all the bytes were read, 0 otherwise.
+ *
+ */
+int accessor_read(MemoryAccessor* accessor, void* buf, size_t count, uintptr_t addr)
+{
+	if(accessor_read_cached(accessor, buf, count, addr))
+		return 1;
+
+	return accessor->fd != -1 && pread(accessor->fd, buf, count, addr) == count;
+}
+
+/**
+ *  Drop cached pages overlapping a range, because the process's memory there changed.
+ *
+ *  @param[in] accessor
+ *  	The accessor.
+ *
+ *  @param[in] addr
+ *  	Start of the range.
+ *
+ *  @param[in] count
+ *  	Size of the range in bytes.
+ *
+ */
+void accessor_invalidate(MemoryAccessor* accessor, uintptr_t addr, size_t count)
+{
+	if(count == 0)
+		return;
+
+	uintptr_t page = addr & ~((uintptr_t) accessor->page_size - 1);
+	for(; page < addr + count; page += accessor->page_size)
+	{
+		CachedPage* slot = page_slot(accessor, page);
+		if(slot->addr == page)
+			slot->addr = 0;
+	}
+}
+
+/**
+ *  Drop every cached page and read the process's mappings again. This is needed whenever the process
+ *  may have mapped or unmapped files since the accessor last looked.
+ *
+ *  @param[in] accessor
+ *  	The accessor.
+ *
+ */
+void accessor_invalidate_all(MemoryAccessor* accessor)
+{
+	int i;
+	for(i = 0; i < ACCESSOR_CACHE_SLOTS; i++)
+		accessor->pages[i].addr = 0;
+
+	load_regions(accessor);
+}
+
+/**
+ *  Returns the number of page reads the accessor's cache satisfied.
+ *
+ */
+uint64_t accessor_hits(MemoryAccessor* accessor)
+{
+	return accessor->hits;
+}
+
+/**
+ *  Returns the number of cacheable pages the accessor had to read from the process.
+ *
+ */
+uint64_t accessor_misses(MemoryAccessor* accessor)
+{
+	return accessor->misses;
+}
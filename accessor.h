@@ -0,0 +1,20 @@
+#ifndef ACCESSOR_H
+#define ACCESSOR_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct MemoryAccessor;
+typedef struct MemoryAccessor MemoryAccessor;
+
+MemoryAccessor* open_memory_accessor(int process);
+void close_memory_accessor(MemoryAccessor* accessor);
+MemoryAccessor* find_memory_accessor(int process);
+int accessor_read(MemoryAccessor* accessor, void* buf, size_t count, uintptr_t addr);
+int accessor_read_cached(MemoryAccessor* accessor, void* buf, size_t count, uintptr_t addr);
+void accessor_invalidate(MemoryAccessor* accessor, uintptr_t addr, size_t count);
+void accessor_invalidate_all(MemoryAccessor* accessor);
+uint64_t accessor_hits(MemoryAccessor* accessor);
+uint64_t accessor_misses(MemoryAccessor* accessor);
+
+#endif
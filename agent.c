@@ -0,0 +1,699 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "agent.h"
+#include "process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Every ptrace based operation stops the target, even if only briefly. Once lcitk_agent.so is loaded
+// into the target, its service thread executes requests the controller puts in a shared memory ring,
+// so calls, reads and writes no longer stop the target at all.
+
+#define AGENT_SPIN_COUNT 20000
+#define AGENT_WAIT_MS 50
+
+/**
+ *  A connection to the agent inside one target process.
+ */
+struct AgentConnection
+{
+	int process;				/// The process the agent runs in.
+	AgentRing* ring;			/// The shared ring.
+	uint32_t next_slot;			/// Where to start looking for a free slot.
+	uint64_t timeout;			/// Nanoseconds agent_wait waits for a request, 0 for no limit.
+	struct AgentConnection* next;		/// Next connection in the list of open connections.
+};
+
+static AgentConnection* connections = NULL;
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long futex(volatile uint32_t* addr, int op, uint32_t val, const struct timespec* timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/**
+ *  Returns the name of the POSIX shared memory object the agent of a process uses for its ring.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[out] name
+ *  	Buffer for the name.
+ *
+ *  @param[in] size
+ *  	Size of the buffer.
+ *
+ */
+void agent_ring_name(int process, char* name, size_t size)
+{
+	snprintf(name, size, "/lcitk-agent.%d", process);
+}
+
+/**
+ *  Connect to the agent already loaded into a process.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	A connection handle, or NULL if the process has no (compatible) agent loaded.
+ *
+ */
+AgentConnection* agent_connect(int process)
+{
+	AgentConnection* conn = find_agent_connection(process);
+	if(conn)
+		return conn;
+
+	char name[PATH_MAX];
+	agent_ring_name(process, name, sizeof(name));
+
+	int fd = shm_open(name, O_RDWR, 0);
+	if(fd == -1)
+		return NULL;
+
+	// anybody can create an object by that name, so only trust one the process's owner made for itself
+	char proc[PATH_MAX];
+	snprintf(proc, sizeof(proc), "/proc/%d", process);
+	struct stat owner;
+	struct stat st;
+	if(stat(proc, &owner) == -1 || fstat(fd, &st) == -1 || st.st_uid != owner.st_uid || (st.st_mode & 077)
+			|| st.st_size < sizeof(AgentRing))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	AgentRing* ring = (AgentRing*) mmap(NULL, sizeof(AgentRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(ring == MAP_FAILED)
+		return NULL;
+
+	if(ring->magic != AGENT_MAGIC || ring->version != AGENT_VERSION)
+	{
+		munmap(ring, sizeof(AgentRing));
+		return NULL;
+	}
+
+	conn = (AgentConnection*) malloc(sizeof(AgentConnection));
+	conn->process = process;
+	conn->ring = ring;
+	conn->next_slot = 0;
+	conn->timeout = AGENT_DEFAULT_TIMEOUT;
+	pthread_mutex_lock(&connections_lock);
+	conn->next = connections;
+	connections = conn;
+	pthread_mutex_unlock(&connections_lock);
+
+	return conn;
+}
+
+/**
+ *  Connect to the agent of a process, loading the agent into the process first if necessary.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] filename
+ *  	Path of lcitk_agent.so.
+ *
+ *  @return
+ *  	A connection handle, or NULL if the agent could not be loaded.
+ *
+ */
+AgentConnection* inject_agent(int process, const char* filename)
+{
+	AgentConnection* conn = agent_connect(process);
+	if(conn)
+		return conn;
+
+	if(!inject_so(process, filename))
+		return NULL;
+
+	return agent_connect(process);
+}
+
+/**
+ *  Close a connection to an agent. The agent keeps running in its process.
+ *
+ *  @param[in] conn
+ *  	The connection to close. It is freed by this call.
+ *
+ */
+void agent_disconnect(AgentConnection* conn)
+{
+	pthread_mutex_lock(&connections_lock);
+	AgentConnection** cur;
+	for(cur = &connections; *cur; cur = &(*cur)->next)
+	{
+		if(*cur == conn)
+		{
+			*cur = conn->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&connections_lock);
+
+	munmap(conn->ring, sizeof(AgentRing));
+	free(conn);
+}
+
+/**
+ *  Find an open agent connection for a process.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	The connection, or NULL if there is none.
+ *
+ */
+AgentConnection* find_agent_connection(int process)
+{
+	pthread_mutex_lock(&connections_lock);
+	AgentConnection* conn;
+	for(conn = connections; conn; conn = conn->next)
+	{
+		if(conn->process == process)
+			break;
+	}
+	pthread_mutex_unlock(&connections_lock);
+
+	return conn;
+}
+
+/**
+ *  Limit how long agent_wait waits for a request. An agent whose service thread is stuck, say on a lock
+ *  held by a thread we have stopped, would otherwise hang the controller.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[in] timeout
+ *  	Nanoseconds to wait, or 0 for no limit. New connections use AGENT_DEFAULT_TIMEOUT.
+ *
+ */
+void agent_set_timeout(AgentConnection* conn, uint64_t timeout)
+{
+	conn->timeout = timeout;
+}
+
+/**
+ *  Submit a request to an agent without waiting for it to complete. Up to AGENT_RING_SLOTS requests
+ *  may be in flight at a time; further submissions wait for a slot to free up, for as long as
+ *  agent_wait would wait for a request.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[in] op
+ *  	One of the AGENT_OP_ operations.
+ *
+ *  @param[in] function
+ *  	The function or address the operation applies to.
+ *
+ *  @param[in] numargs
+ *  	Number of arguments in args, at most AGENT_MAX_ARGS.
+ *
+ *  @param[in] args
+ *  	The arguments of the operation.
+ *
+ *  @param[in] data
+ *  	Data to send along with the request, or NULL.
+ *
+ *  @param[in] length
+ *  	Number of bytes of data the operation uses, at most AGENT_SLOT_DATA.
+ *
+ *  @return
+ *  	A ticket to pass to agent_wait, or -1 with errno set to EINVAL if the request is invalid, ESRCH if
+ *  	the process went away or ETIMEDOUT if no slot freed up within the connection's timeout.
+ *
+ */
+int agent_submit(AgentConnection* conn, int op, uint64_t function, int numargs, const uintptr_t* args,
+		const void* data, size_t length)
+{
+	AgentRing* ring = conn->ring;
+
+	if(numargs > AGENT_MAX_ARGS || length > AGENT_SLOT_DATA)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	// claim a free slot. Slots of requests that timed out stay taken until the agent gets to them,
+	// so a hung agent can fill the ring; don't wait on it longer than on a request.
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int slot_index;
+	while(1)
+	{
+		int i;
+		for(i = 0; i < AGENT_RING_SLOTS; i++)
+		{
+			slot_index = (conn->next_slot + i) % AGENT_RING_SLOTS;
+			uint32_t expected = AGENT_SLOT_FREE;
+			if(__atomic_compare_exchange_n(&ring->slots[slot_index].state, &expected, AGENT_SLOT_CLAIMED,
+						0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				break;
+		}
+
+		if(i < AGENT_RING_SLOTS)
+			break;
+
+		// ring is full
+		if(kill(conn->process, 0) == -1 && errno == ESRCH)
+			return -1;
+
+		if(conn->timeout)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			uint64_t elapsed = (now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+			if(elapsed >= conn->timeout)
+			{
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+
+		sched_yield();
+	}
+
+	conn->next_slot = (slot_index + 1) % AGENT_RING_SLOTS;
+
+	AgentSlot* slot = &ring->slots[slot_index];
+	slot->op = op;
+	slot->function = function;
+	slot->length = length;
+	slot->numargs = numargs;
+	if(numargs)
+		memcpy(slot->args, args, sizeof(uint64_t) * numargs);
+
+	if(data)
+		memcpy(slot->data, data, length);
+
+	__atomic_store_n(&slot->state, AGENT_SLOT_SUBMITTED, __ATOMIC_RELEASE);
+
+	// ring the doorbell, waking the agent if it went to sleep
+	__atomic_add_fetch(&ring->doorbell, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+		futex(&ring->doorbell, FUTEX_WAKE, 1, NULL);
+
+	return slot_index;
+}
+
+/**
+ *  Give up on a request: take it back if the agent hasn't started it, or leave it for the agent to free
+ *  if it is running.
+ *
+ *  @return
+ *  	1 if the request turned out to be done already, in which case the slot is still ours, 0 otherwise.
+ *
+ */
+static int abandon_slot(AgentSlot* slot)
+{
+	uint32_t expected = AGENT_SLOT_SUBMITTED;
+	if(__atomic_compare_exchange_n(&slot->state, &expected, AGENT_SLOT_FREE,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		return 0;
+
+	expected = AGENT_SLOT_RUNNING;
+	if(__atomic_compare_exchange_n(&slot->state, &expected, AGENT_SLOT_ABANDONED,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		return 0;
+
+	return expected == AGENT_SLOT_DONE;
+}
+
+/**
+ *  Wait for a request submitted to an agent to complete.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[in] ticket
+ *  	The ticket returned by agent_submit.
+ *
+ *  @param[out] data
+ *  	If not NULL, receives up to length bytes of the data the agent returned.
+ *
+ *  @param[in] length
+ *  	Size of data.
+ *
+ *  @param[out] error
+ *  	If not NULL, set to the errno the agent reported, ESRCH if the process went away or ETIMEDOUT if
+ *  	the request didn't complete within the connection's timeout.
+ *
+ *  @return
+ *  	The result of the operation, or -1 if the process went away or the request timed out. A request
+ *  	that timed out may still run later; its slot is freed once it has.
+ *
+ */
+int64_t agent_wait(AgentConnection* conn, int ticket, void* data, size_t length, int* error)
+{
+	AgentRing* ring = conn->ring;
+	AgentSlot* slot = &ring->slots[ticket];
+
+	// most requests complete within microseconds, so spin for a bit before sleeping. On a single CPU
+	// spinning would only keep the agent from running.
+	static int spin_count = -1;
+	if(spin_count == -1)
+		spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? AGENT_SPIN_COUNT : 0;
+
+	int i;
+	for(i = 0; i < spin_count; i++)
+	{
+		if(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == AGENT_SLOT_DONE)
+			break;
+
+		__builtin_ia32_pause();
+	}
+
+	if(i == spin_count)
+	{
+		struct timespec timeout = { 0, AGENT_WAIT_MS * 1000000 };
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		__atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		while(1)
+		{
+			uint32_t completions = __atomic_load_n(&ring->completions, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == AGENT_SLOT_DONE)
+				break;
+
+			futex(&ring->completions, FUTEX_WAIT, completions, &timeout);
+
+			int failure = 0;
+			if(kill(conn->process, 0) == -1 && errno == ESRCH)
+			{
+				failure = ESRCH;
+			}
+			else if(conn->timeout)
+			{
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				uint64_t elapsed = (now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+				if(elapsed >= conn->timeout)
+					failure = ETIMEDOUT;
+			}
+
+			if(!failure)
+				continue;
+
+			if(failure == ETIMEDOUT && abandon_slot(slot))
+				break;
+
+			__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+			if(error)
+				*error = failure;
+
+			errno = failure;
+			return -1;
+		}
+		__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+
+	int64_t result = slot->result;
+
+	if(error)
+		*error = slot->error;
+
+	if(data)
+	{
+		if(length > slot->length)
+			length = slot->length;
+
+		memcpy(data, slot->data, length);
+	}
+
+	__atomic_store_n(&slot->state, AGENT_SLOT_FREE, __ATOMIC_RELEASE);
+
+	return result;
+}
+
+/**
+ *  Call a AMD64 ABI function with all INTEGER class arguments through an agent, without stopping the process.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ * 
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function, at most AGENT_MAX_ARGS.
+ *
+ *  @return
+ *  	Either the function return value or -1 on error.
+ *
+ */
+uintptr_t agent_call_function(AgentConnection* conn, void* function, int numargs, ...)
+{
+	uintptr_t args[AGENT_MAX_ARGS];
+
+	if(numargs > AGENT_MAX_ARGS)
+		return -1;
+
+	int i;
+	va_list ap;
+	va_start(ap, numargs);
+	for(i = 0; i < numargs; i++)
+	{
+		args[i] = va_arg(ap, uintptr_t);
+	}
+	va_end(ap);
+
+	return agent_call_function_with_args(conn, function, numargs, args);
+}
+
+/**
+ *  Call a AMD64 ABI function with all INTEGER class arguments through an agent, without stopping the process.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ * 
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function, at most AGENT_MAX_ARGS.
+ *
+ *  @param[in] args
+ *  	Array of numargs arguments.
+ *
+ *  @return
+ *  	Either the function return value or -1 on error.
+ *
+ */
+uintptr_t agent_call_function_with_args(AgentConnection* conn, void* function, int numargs, uintptr_t* args)
+{
+	int ticket = agent_submit(conn, AGENT_OP_CALL, (uintptr_t) function, numargs, args, NULL, 0);
+	if(ticket == -1)
+		return -1;
+
+	return agent_wait(conn, ticket, NULL, 0, NULL);
+}
+
+/**
+ *  Reads bytes from the address space of a process through its agent. Unreadable memory is reported
+ *  rather than crashing the agent.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[out] buf
+ *  	The buffer to read the bytes into.
+ *
+ *  @param[in] count
+ *  	Number of bytes to read.
+ *
+ *  @param[in] addr
+ *  	Address to read from.
+ *
+ *  @return
+ *  	Number of bytes read, or -1 if nothing could be read.
+ *
+ */
+ssize_t agent_read(AgentConnection* conn, void* buf, size_t count, uintptr_t addr)
+{
+	int tickets[AGENT_RING_SLOTS];
+	size_t done = 0;
+
+	// split the read into slot sized pieces, keeping as many in flight as the ring allows
+	while(done < count)
+	{
+		int n = 0;
+		size_t offset = done;
+		while(offset < count && n < AGENT_RING_SLOTS)
+		{
+			size_t len = count - offset;
+			if(len > AGENT_SLOT_DATA)
+				len = AGENT_SLOT_DATA;
+
+			int ticket = agent_submit(conn, AGENT_OP_READ, addr + offset, 0, NULL, NULL, len);
+			if(ticket == -1)
+				break;
+
+			tickets[n++] = ticket;
+			offset += len;
+		}
+
+		// a submission that failed ends the read after the pieces in front of it
+		int submit_failed = (offset < count && n < AGENT_RING_SLOTS);
+
+		int i;
+		int short_read = 0;
+		int failed = 0;
+		for(i = 0; i < n; i++)
+		{
+			// once the agent stopped answering, waiting on the rest would only take as long again each
+			if(failed)
+			{
+				if(abandon_slot(&conn->ring->slots[tickets[i]]))
+					__atomic_store_n(&conn->ring->slots[tickets[i]].state, AGENT_SLOT_FREE, __ATOMIC_RELEASE);
+
+				continue;
+			}
+
+			// pieces after a short read only need their slots back
+			if(short_read)
+			{
+				agent_wait(conn, tickets[i], NULL, 0, NULL);
+				continue;
+			}
+
+			size_t len = count - done;
+			if(len > AGENT_SLOT_DATA)
+				len = AGENT_SLOT_DATA;
+
+			int error;
+			int64_t ret = agent_wait(conn, tickets[i], buf + done, len, &error);
+			if(ret == -1 && (error == ETIMEDOUT || error == ESRCH))
+				failed = 1;
+
+			if(ret > 0)
+				done += ret;
+
+			if(ret != len)
+				short_read = 1;
+		}
+
+		if(short_read || submit_failed)
+			break;
+	}
+
+	if(done == 0 && count != 0)
+		return -1;
+
+	return done;
+}
+
+/**
+ *  Write bytes to the address space of a process through its agent. Memory protection is respected.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[in] buf
+ *  	The buffer to write the bytes from.
+ *
+ *  @param[in] count
+ *  	Number of bytes to write.
+ *
+ *  @param[in] addr
+ *  	Address to write.
+ *
+ *  @return
+ *  	Number of bytes written, or -1 if nothing could be written.
+ *
+ */
+ssize_t agent_write(AgentConnection* conn, const void* buf, size_t count, uintptr_t addr)
+{
+	size_t done = 0;
+
+	while(done < count)
+	{
+		size_t len = count - done;
+		if(len > AGENT_SLOT_DATA)
+			len = AGENT_SLOT_DATA;
+
+		int ticket = agent_submit(conn, AGENT_OP_WRITE, addr + done, 0, NULL, buf + done, len);
+		if(ticket == -1)
+			break;
+
+		int64_t ret = agent_wait(conn, ticket, NULL, 0, NULL);
+		if(ret > 0)
+			done += ret;
+
+		if(ret != len)
+			break;
+	}
+
+	if(done == 0 && count != 0)
+		return -1;
+
+	return done;
+}
+
+/**
+ *  Interpose an AMD64 ABI function in a process through its agent. See interpose_by_address64.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[in] dst
+ *  	The address of the function to redirect calls to the target function to.
+ *
+ *  @param[in] address
+ *  	The address of the function.
+ *
+ *  @return
+ *  	The address of the trampoline within the process, or NULL if the function could not be interposed.
+ *
+ */
+void* agent_interpose(AgentConnection* conn, void* dst, void* address)
+{
+	uintptr_t args[] = { (uintptr_t) dst };
+	int ticket = agent_submit(conn, AGENT_OP_INTERPOSE, (uintptr_t) address, 1, args, NULL, 0);
+	if(ticket == -1)
+		return NULL;
+
+	return (void*) (uintptr_t) agent_wait(conn, ticket, NULL, 0, NULL);
+}
+
+/**
+ *  Remove an interposition made by agent_interpose.
+ *
+ *  @param[in] conn
+ *  	The agent connection.
+ *
+ *  @param[in] trampoline
+ *  	The trampoline returned by agent_interpose.
+ *
+ */
+void agent_uninterpose(AgentConnection* conn, void* trampoline)
+{
+	int ticket = agent_submit(conn, AGENT_OP_UNINTERPOSE, (uintptr_t) trampoline, 0, NULL, NULL, 0);
+	if(ticket != -1)
+		agent_wait(conn, ticket, NULL, 0, NULL);
+}
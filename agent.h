@@ -0,0 +1,86 @@
+#ifndef AGENT_H
+#define AGENT_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Shared memory layout of the request ring between the controller and lcitk_agent.so, which runs a
+// service thread inside the target. Both sides must be built from the same version of this header.
+
+#define AGENT_MAGIC 0x4c434954
+#define AGENT_VERSION 2
+#define AGENT_RING_SLOTS 64
+#define AGENT_SLOT_DATA 4096
+#define AGENT_MAX_ARGS 8
+
+#define AGENT_SLOT_FREE 0		/// Slot can be claimed by the controller.
+#define AGENT_SLOT_CLAIMED 1		/// Controller is filling in a request.
+#define AGENT_SLOT_SUBMITTED 2		/// Request is waiting for the agent.
+#define AGENT_SLOT_DONE 3		/// Agent has filled in the response.
+#define AGENT_SLOT_RUNNING 4		/// Agent is executing the request.
+#define AGENT_SLOT_ABANDONED 5		/// Controller gave up waiting; the agent frees the slot when done.
+
+#define AGENT_DEFAULT_TIMEOUT 10000000000ULL	/// Nanoseconds agent_wait waits by default, 10 s.
+
+#define AGENT_OP_CALL 1			/// Call function with args, result is the return value.
+#define AGENT_OP_READ 2			/// Read length bytes at address into data, result is bytes read.
+#define AGENT_OP_WRITE 3		/// Write length bytes of data to address, result is bytes written.
+#define AGENT_OP_INTERPOSE 4		/// Interpose function with args[0], result is the trampoline.
+#define AGENT_OP_UNINTERPOSE 5		/// Remove the interposition whose trampoline is function.
+
+/**
+ * One request/response slot of the agent ring.
+ *
+ */
+typedef struct AgentSlot
+{
+	volatile uint32_t state;		/// One of the AGENT_SLOT_ states.
+	uint32_t op;				/// One of the AGENT_OP_ operations.
+	uint64_t function;			/// Function or address the operation applies to.
+	uint64_t length;			/// Number of bytes of data used by the operation.
+	uint64_t numargs;			/// Number of arguments in args.
+	uint64_t args[AGENT_MAX_ARGS];		/// Arguments of the operation.
+	int64_t result;				/// Result of the operation.
+	int32_t error;				/// errno after the operation, 0 on success.
+	char data[AGENT_SLOT_DATA];		/// Inline data for reads and writes.
+} AgentSlot;
+
+/**
+ * The shared memory region of an agent.
+ *
+ */
+typedef struct AgentRing
+{
+	uint32_t magic;				/// AGENT_MAGIC once the agent has initialized the ring.
+	uint32_t version;			/// AGENT_VERSION of the agent.
+	volatile uint32_t doorbell;		/// Futex bumped by the controller on every submission.
+	volatile uint32_t sleeping;		/// Non-zero while the agent is waiting on the doorbell.
+	volatile uint32_t completions;		/// Futex bumped by the agent on every completion.
+	volatile uint32_t waiters;		/// Number of controller threads waiting on completions.
+	AgentSlot slots[AGENT_RING_SLOTS];
+} AgentRing;
+
+struct AgentConnection;
+typedef struct AgentConnection AgentConnection;
+
+void agent_ring_name(int process, char* name, size_t size);
+
+AgentConnection* agent_connect(int process);
+AgentConnection* inject_agent(int process, const char* filename);
+void agent_disconnect(AgentConnection* conn);
+AgentConnection* find_agent_connection(int process);
+void agent_set_timeout(AgentConnection* conn, uint64_t timeout);
+
+int agent_submit(AgentConnection* conn, int op, uint64_t function, int numargs, const uintptr_t* args,
+		const void* data, size_t length);
+int64_t agent_wait(AgentConnection* conn, int ticket, void* data, size_t length, int* error);
+
+uintptr_t agent_call_function(AgentConnection* conn, void* function, int numargs, ...);
+uintptr_t agent_call_function_with_args(AgentConnection* conn, void* function, int numargs, uintptr_t* args);
+ssize_t agent_read(AgentConnection* conn, void* buf, size_t count, uintptr_t addr);
+ssize_t agent_write(AgentConnection* conn, const void* buf, size_t count, uintptr_t addr);
+void* agent_interpose(AgentConnection* conn, void* dst, void* address);
+void agent_uninterpose(AgentConnection* conn, void* trampoline);
+
+#endif
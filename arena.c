@@ -0,0 +1,280 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "arena.h"
+#include "process.h"
+#include "window.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Passing a string or a buffer to a remote function used to mean a remote mmap before the call and a
+// remote munmap after it. A scratch arena maps memory in the target once and then hands out pieces
+// of it from our side, so the only cost left per argument is writing its bytes.
+
+#define SCRATCH_ALIGN 16
+
+/**
+ * A region of memory mapped inside the target process.
+ *
+ */
+typedef struct ScratchChunk
+{
+	uintptr_t start;		/// Address of the chunk in the target process.
+	size_t size;			/// Size of the chunk in bytes.
+	int owned;			/// Whether the arena mapped the chunk and so has to unmap it.
+} ScratchChunk;
+
+/**
+ *  Scratch arenas bump-allocate controller-managed memory inside a target process.
+ */
+struct ScratchArena
+{
+	int process;			/// The process the arena allocates memory in.
+	size_t chunk_size;		/// Minimum size of each chunk mapped into the target.
+	ScratchChunk* chunks;		/// Chunks mapped into the target so far.
+	int num_chunks;			/// Number of entries in chunks.
+	int cur_chunk;			/// Chunk allocations are currently made from.
+	size_t cur_offset;		/// Offset of the next free byte in the current chunk.
+};
+
+/**
+ *  Create a new scratch arena for a process. No memory is mapped in the target until the first allocation.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] size
+ *  	The size of the region to map in the target. Allocations bigger than this get a region of their own.
+ *
+ *  @return
+ *  	A handle to the arena.
+ *
+ */
+ScratchArena* new_scratch_arena(int process, size_t size)
+{
+	int page_size = sysconf(_SC_PAGE_SIZE);
+
+	ScratchArena* arena = (ScratchArena*) malloc(sizeof(ScratchArena));
+	arena->process = process;
+	arena->chunk_size = (size + page_size - 1) & ~(page_size - 1);
+	arena->chunks = NULL;
+	arena->num_chunks = 0;
+	arena->cur_chunk = 0;
+	arena->cur_offset = 0;
+	return arena;
+}
+
+/**
+ *  Unmap all memory of an arena from its target process and free the arena.
+ *
+ *  @param[in] arena
+ *  	The arena to be freed.
+ *
+ *  @param[in] session
+ *  	A session attached to the arena's process, or NULL to open one if the arena has memory mapped.
+ *
+ */
+void free_scratch_arena(ScratchArena* arena, ProcessSession* session)
+{
+	scratch_release(arena, session);
+	free(arena);
+}
+
+/**
+ *  Map a new chunk into the target process.
+ *
+ *  @return
+ *  	The index of the new chunk, or -1 if it could not be mapped.
+ *
+ */
+static int map_chunk(ScratchArena* arena, ProcessSession* session, size_t size)
+{
+	int page_size = sysconf(_SC_PAGE_SIZE);
+
+	if(size < arena->chunk_size)
+		size = arena->chunk_size;
+
+	size = (size + page_size - 1) & ~(page_size - 1);
+
+	// data only; nothing we put in scratch memory is meant to run
+#ifdef SYS_mmap2
+	long start = session_syscall(session, SYS_mmap2,
+			6, 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+	long start = session_syscall(session, SYS_mmap,
+			6, 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+
+	if((start < 0 && start > -4096) || start == 0)
+		return -1;
+
+	arena->chunks = (ScratchChunk*) realloc(arena->chunks, sizeof(ScratchChunk) * (arena->num_chunks + 1));
+	arena->chunks[arena->num_chunks].start = start;
+	arena->chunks[arena->num_chunks].size = size;
+	arena->chunks[arena->num_chunks].owned = 1;
+
+	return arena->num_chunks++;
+}
+
+/**
+ *  Allocate memory inside the target process. Memory stays valid until the arena is reset or released.
+ *
+ *  @param[in] arena
+ *  	The arena to allocate from.
+ *
+ *  @param[in] session
+ *  	A session attached to the arena's process. It is only used if the arena needs to map more memory.
+ *
+ *  @param[in] size
+ *  	Number of bytes to allocate.
+ *
+ *  @return
+ *  	The address of the allocation within the target process, or 0 if there was an error.
+ *
+ */
+uintptr_t scratch_alloc(ScratchArena* arena, ProcessSession* session, size_t size)
+{
+	size = (size + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+
+	// find a chunk with enough room left, starting from the current one. Chunks after the current
+	// one are left over from before the last reset and are empty.
+	while(arena->cur_chunk < arena->num_chunks)
+	{
+		ScratchChunk* chunk = &arena->chunks[arena->cur_chunk];
+		if(chunk->size - arena->cur_offset >= size)
+		{
+			uintptr_t ret = chunk->start + arena->cur_offset;
+			arena->cur_offset += size;
+			return ret;
+		}
+
+		++arena->cur_chunk;
+		arena->cur_offset = 0;
+	}
+
+	// none left, map another one
+	int chunk = map_chunk(arena, session, size);
+	if(chunk == -1)
+	{
+		// stay on the last chunk we have so smaller allocations can still be satisfied
+		if(arena->num_chunks > 0)
+		{
+			arena->cur_chunk = arena->num_chunks - 1;
+			arena->cur_offset = arena->chunks[arena->cur_chunk].size;
+		}
+
+		return 0;
+	}
+
+	arena->cur_chunk = chunk;
+	arena->cur_offset = size;
+	return arena->chunks[chunk].start;
+}
+
+/**
+ *  Allocate memory inside the target process and copy a buffer into it.
+ *
+ *  @param[in] arena
+ *  	The arena to allocate from.
+ *
+ *  @param[in] session
+ *  	A session attached to the arena's process.
+ *
+ *  @param[in] data
+ *  	The bytes to copy into the target process.
+ *
+ *  @param[in] size
+ *  	Number of bytes in data.
+ *
+ *  @return
+ *  	The address of the copy within the target process, or 0 if there was an error.
+ *
+ */
+uintptr_t scratch_push(ScratchArena* arena, ProcessSession* session, const void* data, size_t size)
+{
+	uintptr_t ret = scratch_alloc(arena, session, size);
+	if(!ret)
+		return 0;
+
+	if(session_write(session, data, size, ret) != size)
+		return 0;
+
+	return ret;
+}
+
+/**
+ *  Make all memory of an arena available for allocation again, without unmapping anything from the target.
+ *
+ *  @param[in] arena
+ *  	The arena to reset.
+ *
+ */
+void scratch_reset(ScratchArena* arena)
+{
+	arena->cur_chunk = 0;
+	arena->cur_offset = 0;
+}
+
+/**
+ *  Make an arena allocate from a shared window before anything else, so pushing data into the target
+ *  is a memcpy. The window is not unmapped by the arena and must stay open until the arena is released.
+ *  This resets the arena.
+ *
+ *  @param[in] arena
+ *  	The arena to add the window to.
+ *
+ *  @param[in] window
+ *  	A window open in the arena's process.
+ *
+ */
+void scratch_add_window(ScratchArena* arena, SharedWindow* window)
+{
+	arena->chunks = (ScratchChunk*) realloc(arena->chunks, sizeof(ScratchChunk) * (arena->num_chunks + 1));
+	memmove(&arena->chunks[1], &arena->chunks[0], sizeof(ScratchChunk) * arena->num_chunks);
+	arena->chunks[0].start = window_remote(window);
+	arena->chunks[0].size = window_size(window);
+	arena->chunks[0].owned = 0;
+	++arena->num_chunks;
+	scratch_reset(arena);
+}
+
+/**
+ *  Unmap all memory of an arena from the target process. The arena can still be used afterwards, and will
+ *  map memory again as needed. Windows added to it are forgotten but stay open.
+ *
+ *  @param[in] arena
+ *  	The arena to release.
+ *
+ *  @param[in] session
+ *  	A session attached to the arena's process, or NULL to open one if the arena has memory mapped.
+ *
+ */
+void scratch_release(ScratchArena* arena, ProcessSession* session)
+{
+	if(arena->num_chunks == 0)
+		return;
+
+	ProcessSession* own_session = NULL;
+	if(!session)
+		session = own_session = open_process_session(arena->process);
+
+	if(session)
+	{
+		int i;
+		for(i = 0; i < arena->num_chunks; i++)
+			if(arena->chunks[i].owned)
+				session_syscall(session, SYS_munmap, 2, arena->chunks[i].start, arena->chunks[i].size);
+	}
+
+	if(own_session)
+		close_process_session(own_session);
+
+	free(arena->chunks);
+	arena->chunks = NULL;
+	arena->num_chunks = 0;
+	scratch_reset(arena);
+}
@@ -0,0 +1,20 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "process.h"
+#include "window.h"
+
+struct ScratchArena;
+typedef struct ScratchArena ScratchArena;
+
+ScratchArena* new_scratch_arena(int process, size_t size);
+void free_scratch_arena(ScratchArena* arena, ProcessSession* session);
+uintptr_t scratch_alloc(ScratchArena* arena, ProcessSession* session, size_t size);
+uintptr_t scratch_push(ScratchArena* arena, ProcessSession* session, const void* data, size_t size);
+void scratch_add_window(ScratchArena* arena, SharedWindow* window);
+void scratch_reset(ScratchArena* arena);
+void scratch_release(ScratchArena* arena, ProcessSession* session);
+
+#endif
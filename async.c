@@ -0,0 +1,586 @@
+#define _GNU_SOURCE
+
+#include "async.h"
+#include "process.h"
+#include "objdump.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+
+// The engine sleeps in epoll until something may have happened to one of its targets. A ptrace stop is
+// announced to the tracer with SIGCHLD, which the engine takes through a signalfd; a pidfd per target
+// catches the target going away. pidfds only become readable when a process exits, so they can't stand
+// in for the signal. SIGCHLD is process-wide, so another thread that doesn't block it may take it first:
+// the engine also looks at every target every ENGINE_POLL_INTERVAL milliseconds, whatever it heard.
+
+#define ENGINE_POLL_INTERVAL 50
+#define ENGINE_MAX_EVENTS 64
+
+/**
+ * One asynchronous operation.
+ *
+ */
+struct AsyncCall
+{
+	CallEngine* engine;
+	ProcessSession* session;		/// Session the call runs in, NULL for reads.
+	int process;				/// Main thread of the target.
+	int pidfd;				/// pidfd of the target in the engine's epoll set, or -1.
+	int done;				/// Whether the operation has finished.
+	int notified;				/// Whether the callback has been run.
+	CallStatus status;			/// How it ended.
+	uintptr_t result;			/// Function return value or bytes read; -1 if the call failed.
+	uint64_t time;				/// Nanoseconds the operation took.
+	AsyncCallback callback;
+	void* context;
+	AsyncCall* next;
+	AsyncCall* prev;
+};
+
+/**
+ * An event loop driving remote calls in any number of processes from one thread.
+ *
+ */
+struct CallEngine
+{
+	int epoll_fd;
+	int signal_fd;				/// SIGCHLD, for ptrace stops.
+	sigset_t old_mask;			/// Signal mask of the thread before SIGCHLD was blocked.
+	uint64_t call_timeout;			/// Nanoseconds a call may run before it is cancelled, 0 for no limit.
+	AsyncCall* calls;			/// Every call not yet freed, most recent first.
+	int outstanding;			/// Calls whose callback has not been run yet.
+};
+
+static int open_pidfd(int process)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, process, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ *  Creates an engine for asynchronous remote calls. It must be used, and freed, by the thread that creates
+ *  it, which must also be the thread that opened the sessions it is given. SIGCHLD is blocked in that
+ *  thread while the engine exists.
+ *
+ *  @return
+ *  	The engine, or NULL on error.
+ *
+ */
+CallEngine* new_call_engine()
+{
+	CallEngine* engine = (CallEngine*) malloc(sizeof(CallEngine));
+	engine->calls = NULL;
+	engine->outstanding = 0;
+	engine->call_timeout = 0;
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &mask, &engine->old_mask);
+
+	engine->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(engine->signal_fd == -1 || engine->epoll_fd == -1)
+	{
+		fprintf(stderr, "Error: cannot create call engine: %s\n", strerror(errno));
+		free_call_engine(engine);
+		return NULL;
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->signal_fd, &event);
+
+	return engine;
+}
+
+/**
+ *  Frees an engine and every call made with it. Calls still running are cancelled first.
+ *
+ *  @param[in] engine
+ *  	The engine.
+ *
+ */
+void free_call_engine(CallEngine* engine)
+{
+	while(engine->calls)
+		free_async_call(engine->calls);
+
+	if(engine->epoll_fd != -1)
+		close(engine->epoll_fd);
+
+	if(engine->signal_fd != -1)
+		close(engine->signal_fd);
+
+	pthread_sigmask(SIG_SETMASK, &engine->old_mask, NULL);
+
+	free(engine);
+}
+
+/**
+ *  Limits how long each call made by an engine may run. A call that takes longer is cancelled the way
+ *  session_set_call_timeout describes, and completes with CALL_TIMED_OUT.
+ *
+ *  @param[in] engine
+ *  	The engine.
+ *
+ *  @param[in] timeout
+ *  	The limit in nanoseconds, or 0 for none, which is the default.
+ *
+ */
+void engine_set_call_timeout(CallEngine* engine, uint64_t timeout)
+{
+	engine->call_timeout = timeout;
+}
+
+static AsyncCall* new_async_call(CallEngine* engine, ProcessSession* session, int process,
+		AsyncCallback callback, void* context)
+{
+	AsyncCall* call = (AsyncCall*) malloc(sizeof(AsyncCall));
+	call->engine = engine;
+	call->session = session;
+	call->process = process;
+	call->pidfd = -1;
+	call->done = 0;
+	call->notified = 0;
+	call->status = CALL_FAILED;
+	call->result = -1;
+	call->time = 0;
+	call->callback = callback;
+	call->context = context;
+
+	call->prev = NULL;
+	call->next = engine->calls;
+	if(engine->calls)
+		engine->calls->prev = call;
+
+	engine->calls = call;
+	++engine->outstanding;
+
+	return call;
+}
+
+static void complete_call(AsyncCall* call, uintptr_t result)
+{
+	call->done = 1;
+	call->result = result;
+
+	if(call->session)
+	{
+		call->status = session_last_call_status(call->session);
+		call->time = session_last_call_time(call->session);
+	}
+
+	if(call->pidfd != -1)
+	{
+		epoll_ctl(call->engine->epoll_fd, EPOLL_CTL_DEL, call->pidfd, NULL);
+		close(call->pidfd);
+		call->pidfd = -1;
+	}
+}
+
+static void notify_call(AsyncCall* call)
+{
+	call->notified = 1;
+	--call->engine->outstanding;
+
+	if(call->callback)
+		call->callback(call, call->context);
+}
+
+/**
+ *  Starts calling a function in a process attached to a session. The session must have been opened by
+ *  the engine's thread, and may only have one call running at a time.
+ *
+ *  @param[in] engine
+ *  	The engine.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ *
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @param[in] args
+ *  	Array of numargs arguments.
+ *
+ *  @param[in] callback
+ *  	Function run by engine_run once the call is done, or NULL.
+ *
+ *  @param[in] context
+ *  	Passed to the callback.
+ *
+ *  @return
+ *  	A handle for the call. It belongs to the engine, but may be freed with free_async_call once it is done.
+ *  	A call that could not be started is done right away, with CALL_FAILED.
+ *
+ */
+AsyncCall* engine_call_function(CallEngine* engine, ProcessSession* session, void* function, int numargs,
+		uintptr_t* args, AsyncCallback callback, void* context)
+{
+	int process = session_process(session);
+	AsyncCall* call = new_async_call(engine, session, process, callback, context);
+
+	if(session_begin_call(session, function, numargs, args) == -1)
+	{
+		complete_call(call, -1);
+		call->status = CALL_FAILED;
+		return call;
+	}
+
+	call->pidfd = open_pidfd(process);
+	if(call->pidfd != -1)
+	{
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = call;
+		epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, call->pidfd, &event);
+	}
+
+	return call;
+}
+
+/**
+ *  Starts loading a shared object file into a process attached to a session. The call's result is the
+ *  handle dlopen returned.
+ *
+ *  @param[in] engine
+ *  	The engine.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] calls
+ *  	The process's library functions, found with find_library_calls before the session was opened.
+ *
+ *  @param[in] filename
+ *  	The path of the .so file.
+ *
+ *  @param[in] callback
+ *  	Function run by engine_run once the library is loaded, or NULL.
+ *
+ *  @param[in] context
+ *  	Passed to the callback.
+ *
+ *  @return
+ *  	A handle for the call, as for engine_call_function.
+ *
+ */
+AsyncCall* engine_inject_so(CallEngine* engine, ProcessSession* session, const LibraryCalls* calls,
+		const char* filename, AsyncCallback callback, void* context)
+{
+	int process = session_process(session);
+
+	char resolved_path[PATH_MAX];
+	char* path = realpath(filename, resolved_path);
+
+	uintptr_t path_string = 0;
+	if(path && calls->dlopen)
+		path_string = scratch_push(session_scratch(session), session, path, strlen(path) + 1);
+
+	if(!path_string)
+	{
+		AsyncCall* call = new_async_call(engine, session, process, callback, context);
+		complete_call(call, 0);
+		call->status = CALL_FAILED;
+		return call;
+	}
+
+	uintptr_t args[2] = { path_string, RTLD_NOW | calls->mode_flags };
+	return engine_call_function(engine, session, calls->dlopen, 2, args, callback, context);
+}
+
+/**
+ *  Reads bytes from the address space of a target process. Reads don't need the target's help, so this
+ *  one is done straight away; the callback is run by engine_run like any other. The call's result is the
+ *  number of bytes read, and it ends with CALL_FAILED if that is not all of them.
+ *
+ *  @param[in] engine
+ *  	The engine.
+ *
+ *  @param[in] process
+ *  	The process PID to read from.
+ *
+ *  @param[out] buf
+ *  	The buffer to read the bytes into.
+ *
+ *  @param[in] count
+ *  	Number of bytes to read.
+ *
+ *  @param[in] addr
+ *  	Address to read from.
+ *
+ *  @param[in] callback
+ *  	Function run by engine_run, or NULL.
+ *
+ *  @param[in] context
+ *  	Passed to the callback.
+ *
+ *  @return
+ *  	A handle for the read.
+ *
+ */
+AsyncCall* engine_read(CallEngine* engine, int process, void* buf, size_t count, uintptr_t addr,
+		AsyncCallback callback, void* context)
+{
+	AsyncCall* call = new_async_call(engine, NULL, process, callback, context);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	RemoteIOVec vec = { addr, count, buf, 0 };
+	process_readv(process, &vec, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	call->time = (end.tv_sec - start.tv_sec) * 1000000000ULL + (end.tv_nsec - start.tv_nsec);
+
+	complete_call(call, vec.result == -1 ? 0 : vec.result);
+	call->status = vec.result == (ssize_t) count ? CALL_OK : CALL_FAILED;
+
+	return call;
+}
+
+/**
+ *  Collects whatever has happened to the targets of running calls.
+ *
+ */
+static void poll_calls(CallEngine* engine)
+{
+	AsyncCall* call;
+	for(call = engine->calls; call; call = call->next)
+	{
+		if(call->done || !call->session)
+			continue;
+
+		int status;
+		int waited;
+		uintptr_t result;
+		while((waited = waitpid(session_thread(call->session), &status, __WALL | WNOHANG)) > 0)
+		{
+			if(session_finish_call(call->session, status, &result))
+			{
+				complete_call(call, result);
+				break;
+			}
+		}
+
+		if(call->done)
+			continue;
+
+		// the target was reaped by someone else, or was never ours; finish it the way an exit would
+		if(waited == -1 && errno == ECHILD)
+		{
+			session_finish_call(call->session, 0, &result);
+			complete_call(call, -1);
+			continue;
+		}
+
+		if(engine->call_timeout && session_call_running_time(call->session) >= engine->call_timeout)
+		{
+			session_cancel_call(call->session);
+			complete_call(call, -1);
+		}
+	}
+}
+
+/**
+ *  Returns how long engine_run may sleep before it has to look at the calls again, in milliseconds.
+ *
+ */
+static int next_wakeup(CallEngine* engine)
+{
+	int wait = ENGINE_POLL_INTERVAL;
+	if(!engine->call_timeout)
+		return wait;
+
+	AsyncCall* call;
+	for(call = engine->calls; call; call = call->next)
+	{
+		if(call->done || !call->session)
+			continue;
+
+		uint64_t running = session_call_running_time(call->session);
+		int remaining = running >= engine->call_timeout ? 0
+			: (int) ((engine->call_timeout - running + 999999) / 1000000);
+
+		if(remaining < wait)
+			wait = remaining;
+	}
+
+	return wait;
+}
+
+/**
+ *  Runs the engine: waits for calls to finish and runs their callbacks as they do, so the calls in all the
+ *  targets run at the same time.
+ *
+ *  @param[in] engine
+ *  	The engine.
+ *
+ *  @param[in] timeout
+ *  	Milliseconds to run for at most, or -1 to run until every call is done. With 0, the calls are looked at
+ *  	once, without waiting.
+ *
+ *  @return
+ *  	The number of calls whose callback has not run yet, 0 once they all have.
+ *
+ */
+int engine_run(CallEngine* engine, int timeout)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while(1)
+	{
+		poll_calls(engine);
+
+		// run the callbacks of everything that is done. A callback may start more calls, which go on the
+		// front of the list, or free its own call, so the list is walked from the back.
+		AsyncCall* call = engine->calls;
+		while(call && call->next)
+			call = call->next;
+
+		while(call)
+		{
+			AsyncCall* prev = call->prev;
+			if(call->done && !call->notified)
+				notify_call(call);
+
+			call = prev;
+		}
+
+		if(engine->outstanding == 0)
+			return 0;
+
+		int wait = next_wakeup(engine);
+		if(timeout >= 0)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+			if(elapsed >= timeout)
+				return engine->outstanding;
+
+			if(timeout - elapsed < wait)
+				wait = timeout - elapsed;
+		}
+
+		struct epoll_event events[ENGINE_MAX_EVENTS];
+		int num_events = epoll_wait(engine->epoll_fd, events, ENGINE_MAX_EVENTS, wait);
+		if(num_events == -1 && errno != EINTR)
+			return -1;
+
+		// the signals only wake us up; which targets stopped comes from waitpid
+		struct signalfd_siginfo info;
+		while(read(engine->signal_fd, &info, sizeof(info)) == sizeof(info))
+			;
+	}
+}
+
+/**
+ *  Returns the number of calls made with an engine whose callback has not been run yet.
+ *
+ */
+int engine_outstanding(CallEngine* engine)
+{
+	return engine->outstanding;
+}
+
+/**
+ *  Frees a call. If it is still running, it is cancelled first.
+ *
+ *  @param[in] call
+ *  	The call handle.
+ *
+ */
+void free_async_call(AsyncCall* call)
+{
+	CallEngine* engine = call->engine;
+
+	if(!call->done && call->session)
+		session_cancel_call(call->session);
+
+	if(!call->done)
+		complete_call(call, -1);
+
+	if(!call->notified)
+		--engine->outstanding;
+
+	if(call->prev)
+		call->prev->next = call->next;
+	else
+		engine->calls = call->next;
+
+	if(call->next)
+		call->next->prev = call->prev;
+
+	free(call);
+}
+
+/**
+ *  Returns whether a call has finished.
+ *
+ */
+int async_call_done(AsyncCall* call)
+{
+	return call->done;
+}
+
+/**
+ *  Returns the result of a finished call: the function's return value, or the number of bytes read.
+ *  -1 if the call failed.
+ *
+ */
+uintptr_t async_call_result(AsyncCall* call)
+{
+	return call->result;
+}
+
+/**
+ *  Returns how a finished call ended.
+ *
+ */
+CallStatus async_call_status(AsyncCall* call)
+{
+	return call->status;
+}
+
+/**
+ *  Returns how long a finished call took in the target, in nanoseconds.
+ *
+ */
+uint64_t async_call_time(AsyncCall* call)
+{
+	return call->time;
+}
+
+/**
+ *  Returns the session a call was made in, or NULL for reads.
+ *
+ */
+ProcessSession* async_call_session(AsyncCall* call)
+{
+	return call->session;
+}
@@ -0,0 +1,34 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "process.h"
+
+struct CallEngine;
+typedef struct CallEngine CallEngine;
+
+struct AsyncCall;
+typedef struct AsyncCall AsyncCall;
+
+typedef void (*AsyncCallback)(AsyncCall* call, void* context);
+
+CallEngine* new_call_engine();
+void free_call_engine(CallEngine* engine);
+void engine_set_call_timeout(CallEngine* engine, uint64_t timeout);
+AsyncCall* engine_call_function(CallEngine* engine, ProcessSession* session, void* function, int numargs,
+		uintptr_t* args, AsyncCallback callback, void* context);
+AsyncCall* engine_inject_so(CallEngine* engine, ProcessSession* session, const LibraryCalls* calls,
+		const char* filename, AsyncCallback callback, void* context);
+AsyncCall* engine_read(CallEngine* engine, int process, void* buf, size_t count, uintptr_t addr,
+		AsyncCallback callback, void* context);
+int engine_run(CallEngine* engine, int timeout);
+int engine_outstanding(CallEngine* engine);
+void free_async_call(AsyncCall* call);
+int async_call_done(AsyncCall* call);
+uintptr_t async_call_result(AsyncCall* call);
+CallStatus async_call_status(AsyncCall* call);
+uint64_t async_call_time(AsyncCall* call);
+ProcessSession* async_call_session(AsyncCall* call);
+
+#endif
@@ -0,0 +1,438 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "callplan.h"
+#include "process.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// A call plan is a list of remote function calls that are run back to back by a small stub we generate
+// and place in the target, so the whole list costs one register save, one resume and one trap instead
+// of one of each per call. Arguments can either be constants or the return value of an earlier call.
+// The stub gets a read-only, executable mapping of its own for the length of the run; the result slots
+// are plain scratch memory.
+
+/**
+ * One argument of a planned call.
+ *
+ */
+typedef struct PlannedArg
+{
+	uintptr_t value;		/// The argument value, if source is -1.
+	int source;			/// Index of an earlier call whose return value is the argument, or -1.
+} PlannedArg;
+
+/**
+ * One planned call.
+ *
+ */
+typedef struct PlannedCall
+{
+	void* function;			/// Address of the function in the target process.
+	int numargs;			/// Number of arguments.
+	PlannedArg* args;		/// The arguments.
+} PlannedCall;
+
+/**
+ *  Call plans hold an ordered list of function calls to be run in a target process in one go.
+ */
+struct CallPlan
+{
+	PlannedCall* calls;
+	int num_calls;
+};
+
+/**
+ * Growable buffer the stub's machine code is assembled into.
+ *
+ */
+typedef struct CodeBuffer
+{
+	unsigned char* code;
+	size_t size;
+} CodeBuffer;
+
+// register numbers as used in x86-64 instruction encodings
+#define REG_RAX 0
+#define REG_RCX 1
+#define REG_RDX 2
+#define REG_RSI 6
+#define REG_RDI 7
+#define REG_R8 8
+#define REG_R9 9
+#define REG_R11 11
+
+static const int arg_registers[] = { REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9 };
+
+static void emit(CodeBuffer* buf, const void* bytes, size_t count)
+{
+	buf->code = (unsigned char*) realloc(buf->code, buf->size + count);
+	memcpy(buf->code + buf->size, bytes, count);
+	buf->size += count;
+}
+
+static void emit_byte(CodeBuffer* buf, unsigned char byte)
+{
+	emit(buf, &byte, 1);
+}
+
+// movabs $imm, %reg
+static void emit_mov_imm(CodeBuffer* buf, int reg, uint64_t imm)
+{
+	emit_byte(buf, 0x48 | (reg >= 8 ? 0x01 : 0));
+	emit_byte(buf, 0xb8 + (reg & 7));
+	emit(buf, &imm, sizeof(imm));
+}
+
+// mov (%r11), %reg
+static void emit_load_r11(CodeBuffer* buf, int reg)
+{
+	emit_byte(buf, 0x49 | (reg >= 8 ? 0x04 : 0));
+	emit_byte(buf, 0x8b);
+	emit_byte(buf, ((reg & 7) << 3) | (REG_R11 & 7));
+}
+
+// load an argument into a register, either a constant or from a result slot
+static void emit_arg(CodeBuffer* buf, int reg, PlannedArg* arg, uintptr_t results)
+{
+	if(arg->source == -1)
+	{
+		emit_mov_imm(buf, reg, arg->value);
+	}
+	else
+	{
+		emit_mov_imm(buf, REG_R11, results + (arg->source * sizeof(uint64_t)));
+		emit_load_r11(buf, reg);
+	}
+}
+
+/**
+ *  Assemble the stub for a call plan.
+ *
+ *  @param[in] plan
+ *  	The plan.
+ *
+ *  @param[in] results
+ *  	Address in the target process of the result slots, followed by the progress counter.
+ *
+ *  @param[out] buf
+ *  	The assembled code.
+ *
+ */
+static void assemble_call_plan(CallPlan* plan, uintptr_t results, CodeBuffer* buf)
+{
+	uintptr_t progress = results + (plan->num_calls * sizeof(uint64_t));
+	int i, j;
+
+	for(i = 0; i < plan->num_calls; i++)
+	{
+		PlannedCall* call = &plan->calls[i];
+		uint32_t index = i;
+
+		// record which call we're in, so a fault can be attributed to it
+		emit_mov_imm(buf, REG_R11, progress);
+		emit(buf, "\x49\xc7\x03", 3);			// movq $index, (%r11)
+		emit(buf, &index, sizeof(index));
+
+		// stack arguments are pushed in reverse order, keeping the stack 16 byte aligned at the call
+		int stackargs = call->numargs > 6 ? call->numargs - 6 : 0;
+		uint32_t stack_adjust = (stackargs + (stackargs & 1)) * sizeof(uint64_t);
+
+		if(stackargs & 1)
+			emit(buf, "\x48\x83\xec\x08", 4);	// sub $8, %rsp
+
+		for(j = call->numargs - 1; j >= 6; j--)
+		{
+			PlannedArg* arg = &call->args[j];
+			if(arg->source == -1)
+			{
+				emit_mov_imm(buf, REG_R11, arg->value);
+				emit(buf, "\x41\x53", 2);		// push %r11
+			}
+			else
+			{
+				emit_mov_imm(buf, REG_R11, results + (arg->source * sizeof(uint64_t)));
+				emit(buf, "\x41\xff\x33", 3);		// pushq (%r11)
+			}
+		}
+
+		for(j = 0; j < call->numargs && j < 6; j++)
+			emit_arg(buf, arg_registers[j], &call->args[j], results);
+
+		// no vector arguments, for variable argument functions
+		emit(buf, "\x31\xc0", 2);				// xor %eax, %eax
+
+		emit_mov_imm(buf, REG_R11, (uintptr_t) call->function);
+		emit(buf, "\x41\xff\xd3", 3);				// call *%r11
+
+		if(stack_adjust)
+		{
+			emit(buf, "\x48\x81\xc4", 3);			// add $stack_adjust, %rsp
+			emit(buf, &stack_adjust, sizeof(stack_adjust));
+		}
+
+		// save the return value
+		emit_mov_imm(buf, REG_R11, results + (i * sizeof(uint64_t)));
+		emit(buf, "\x49\x89\x03", 3);				// mov %rax, (%r11)
+	}
+
+	// mark completion and stop
+	{
+		uint32_t index = plan->num_calls;
+		emit_mov_imm(buf, REG_R11, progress);
+		emit(buf, "\x49\xc7\x03", 3);			// movq $num_calls, (%r11)
+		emit(buf, &index, sizeof(index));
+	}
+
+	emit_byte(buf, 0xcc);						// int3
+}
+
+/**
+ *  Create a new, empty call plan.
+ *
+ *  @return
+ *  	A handle to the call plan.
+ *
+ */
+CallPlan* new_call_plan()
+{
+	CallPlan* plan = (CallPlan*) malloc(sizeof(CallPlan));
+	plan->calls = NULL;
+	plan->num_calls = 0;
+	return plan;
+}
+
+/**
+ *  Frees a call plan.
+ *
+ *  @param[in] plan
+ *  	The plan to be freed.
+ *
+ */
+void free_call_plan(CallPlan* plan)
+{
+	int i;
+	for(i = 0; i < plan->num_calls; i++)
+		free(plan->calls[i].args);
+
+	free(plan->calls);
+	free(plan);
+}
+
+/**
+ *  Append a call of a AMD64 ABI function with all INTEGER class arguments to a call plan.
+ *
+ *  @param[in] plan
+ *  	The plan to add to.
+ *
+ *  @param[in] function
+ *  	The address of the function to call within the target process.
+ *
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @return
+ *  	The index of the call within the plan.
+ *
+ */
+int call_plan_add(CallPlan* plan, void* function, int numargs, ...)
+{
+	uintptr_t* args = (uintptr_t*) malloc(sizeof(uintptr_t) * numargs);
+
+	int i;
+	va_list ap;
+	va_start(ap, numargs);
+	for(i = 0; i < numargs; i++)
+	{
+		args[i] = va_arg(ap, uintptr_t);
+	}
+	va_end(ap);
+
+	int ret = call_plan_add_with_args(plan, function, numargs, args);
+	free(args);
+
+	return ret;
+}
+
+/**
+ *  Append a call of a AMD64 ABI function with all INTEGER class arguments to a call plan.
+ *
+ *  @param[in] plan
+ *  	The plan to add to.
+ *
+ *  @param[in] function
+ *  	The address of the function to call within the target process.
+ *
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @param[in] args
+ *  	Array of numargs arguments.
+ *
+ *  @return
+ *  	The index of the call within the plan.
+ *
+ */
+int call_plan_add_with_args(CallPlan* plan, void* function, int numargs, uintptr_t* args)
+{
+	plan->calls = (PlannedCall*) realloc(plan->calls, sizeof(PlannedCall) * (plan->num_calls + 1));
+
+	PlannedCall* call = &plan->calls[plan->num_calls];
+	call->function = function;
+	call->numargs = numargs;
+	call->args = (PlannedArg*) malloc(sizeof(PlannedArg) * numargs);
+
+	int i;
+	for(i = 0; i < numargs; i++)
+	{
+		call->args[i].value = args[i];
+		call->args[i].source = -1;
+	}
+
+	return plan->num_calls++;
+}
+
+/**
+ *  Make an argument of a planned call the return value of an earlier call in the same plan.
+ *
+ *  @param[in] plan
+ *  	The plan.
+ *
+ *  @param[in] call
+ *  	Index of the call whose argument is to be set.
+ *
+ *  @param[in] arg
+ *  	Index of the argument to set.
+ *
+ *  @param[in] source
+ *  	Index of the call whose return value is to be used. It must come before call.
+ *
+ *  @return
+ *  	1 on success, 0 if any of the indexes are invalid.
+ *
+ */
+int call_plan_use_result(CallPlan* plan, int call, int arg, int source)
+{
+	if(call < 0 || call >= plan->num_calls)
+		return 0;
+
+	if(arg < 0 || arg >= plan->calls[call].numargs)
+		return 0;
+
+	if(source < 0 || source >= call)
+		return 0;
+
+	plan->calls[call].args[arg].source = source;
+	return 1;
+}
+
+/**
+ *  Returns the number of calls in a plan.
+ *
+ *  @param[in] plan
+ *  	The plan.
+ *
+ */
+int call_plan_size(CallPlan* plan)
+{
+	return plan->num_calls;
+}
+
+/**
+ *  Run all calls of a plan in a process attached to a session, with a single resume of the process.
+ *
+ *  @param[in] session
+ *  	The session handle. The result slots are placed in the session's scratch arena, the stub in memory
+ *  	mapped for it and unmapped again afterwards.
+ *
+ *  @param[in] plan
+ *  	The plan to run.
+ *
+ *  @param[out] results
+ *  	If not NULL, an array with room for one return value per call in the plan. Only the results of
+ *  	calls before the faulting one are valid if a call faulted.
+ *
+ *  @param[out] faulted
+ *  	If not NULL, set to the index of the call that faulted, or -1 if every call returned.
+ *
+ *  @return
+ *  	1 if the plan was run (even if a call faulted), 0 if it could not be run at all.
+ *
+ */
+int run_call_plan(ProcessSession* session, CallPlan* plan, uintptr_t* results, int* faulted)
+{
+#if __WORDSIZE == 64
+	ScratchArena* arena = session_scratch(session);
+	size_t slots_size = (plan->num_calls + 1) * sizeof(uint64_t);
+
+	if(faulted)
+		*faulted = -1;
+
+	if(plan->num_calls == 0)
+		return 1;
+
+	uintptr_t slots = scratch_alloc(arena, session, slots_size);
+	if(!slots)
+		return 0;
+
+	CodeBuffer buf = { NULL, 0 };
+	assemble_call_plan(plan, slots, &buf);
+
+	int page_size = sysconf(_SC_PAGE_SIZE);
+	size_t stub_size = (buf.size + page_size - 1) & ~(page_size - 1);
+
+	// never writable from inside the target; process_write gets the code in through /proc/pid/mem
+#ifdef SYS_mmap2
+	long stub = session_syscall(session, SYS_mmap2,
+			6, 0, stub_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+	long stub = session_syscall(session, SYS_mmap,
+			6, 0, stub_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+
+	if((stub < 0 && stub > -4096) || stub == 0)
+	{
+		free(buf.code);
+		return 0;
+	}
+
+	int fault = -1;
+	if(session_write(session, buf.code, buf.size, stub) == (ssize_t) buf.size)
+		fault = session_execute(session, stub, NULL);
+
+	free(buf.code);
+
+	// even a plan that timed out is done with the stub: cancelling put the thread's registers back
+	session_syscall(session, SYS_munmap, 2, stub, stub_size);
+
+	if(fault == -1)
+		return 0;
+
+	uint64_t* local_slots = (uint64_t*) malloc(slots_size);
+	session_read(session, local_slots, slots_size, slots);
+
+	if(results)
+		memcpy(results, local_slots, plan->num_calls * sizeof(uint64_t));
+
+	if(fault != 0)
+	{
+		fprintf(stderr, "Error: signal %d in call %d of call plan!\n",
+				fault, (int) local_slots[plan->num_calls]);
+
+		if(faulted)
+			*faulted = local_slots[plan->num_calls];
+	}
+
+	free(local_slots);
+
+	return 1;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,18 @@
+#ifndef CALLPLAN_H
+#define CALLPLAN_H
+
+#include <stdint.h>
+#include "process.h"
+
+struct CallPlan;
+typedef struct CallPlan CallPlan;
+
+CallPlan* new_call_plan();
+void free_call_plan(CallPlan* plan);
+int call_plan_add(CallPlan* plan, void* function, int numargs, ...);
+int call_plan_add_with_args(CallPlan* plan, void* function, int numargs, uintptr_t* args);
+int call_plan_use_result(CallPlan* plan, int call, int arg, int source);
+int call_plan_size(CallPlan* plan);
+int run_call_plan(ProcessSession* session, CallPlan* plan, uintptr_t* results, int* faulted);
+
+#endif
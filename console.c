@@ -14,6 +14,15 @@
 #include "objdump.h"
 #include "process.h"
 #include "symtab.h"
+#include "arena.h"
+#include "window.h"
+#include "agent.h"
+#include "scan.h"
+#include "core.h"
+#include "accessor.h"
+#include "tls.h"
+#include "monitor.h"
+#include "numa.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -23,16 +32,29 @@
 #include <setjmp.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 jmp_buf abort_readline;
 
 int done = 0;
 
+// Thread calls are made on (0 for the main thread) and how it is picked, set with #thread.
+int call_thread = 0;
+int call_thread_flags = 0;
+
 // forward declarations
 char* tokenizer(char** state);
 char* handle_escape(char* str);
-void process_command(int process, void* target_mmap, void* target_munmap, char* expanded);
+void process_command(int process, ScratchArena* arena, char* expanded);
+void search_command(int process, char* expanded);
+void tls_command(int process, char* expanded);
+void top_command(int process, char* expanded);
+void stack_command(int process, SymtabCache* cache, char* expanded);
+void numa_command(int process, SymtabCache* cache, char* expanded);
+void migrate_command(int process, char* expanded);
 
 void interrupt_handler(int signum)
 {
@@ -43,25 +65,39 @@ void interrupt_handler(int signum)
 
 int main(int argc, const char* const argv[])
 {
-	if(argc < 2)
+	// -o: observe only, never stop the process or run anything in it
+	int arg = 1;
+	if(argc > 2 && strcmp(argv[1], "-o") == 0)
+	{
+		set_process_policy(POLICY_OBSERVE_ONLY);
+		arg = 2;
+	}
+
+	if(argc < arg + 1)
 	{
-		printf("Usage: %s ([<user>/]exec_name | pid)\n", argv[0]);
+		printf("Usage: %s [-o] ([<user>/]exec_name | pid)\n", argv[0]);
 		return 0;
 	}
 
-	int process = resolve_process(argv[1]);
+	int process = resolve_process(argv[arg]);
 
 	if(process == 0)
 	{
-		printf("Could not find process: %s\n", argv[1]);
+		printf("Could not find process: %s\n", argv[arg]);
 		return 0;
 	}
 
 	printf("Target process: %d\n", process);
 	printf("Type '#quit' to exit this program, #process <process specifier> to change processes.\n\n");
 
-	void* target_mmap = find_libc_function(process, "mmap");
-	void* target_munmap = find_libc_function(process, "munmap");
+	// String arguments are passed through memory mapped once into the target and reused by every command.
+	ScratchArena* arena = new_scratch_arena(process, 64 * 1024);
+
+	// Memory shared with the target, once #window opens some. Arguments pushed into it cost a memcpy.
+	SharedWindow* window = NULL;
+
+	// Keeps the process's memory open and its code and headers cached while a command runs.
+	MemoryAccessor* accessor = open_memory_accessor(process);
 
 	SymtabCache* cache = new_symtab_cache();
 
@@ -104,6 +140,10 @@ int main(int argc, const char* const argv[])
 
 			add_history(expanded);
 
+			// the process ran since the last command and may have mapped or unmapped files, or exec'd
+			accessor_invalidate_all(accessor);
+			refresh_shared_windows(process);
+
 			if(strcmp(expanded, "#quit") == 0)
 				done = 1;
 			else if(strncmp(expanded, "#process ", sizeof("#process ") - 1) == 0)
@@ -111,7 +151,16 @@ int main(int argc, const char* const argv[])
 				int p = resolve_process(expanded + sizeof("#process ") - 1);
 				if(p != 0)
 				{
+					free_scratch_arena(arena, NULL);
+					if(window)
+						close_shared_window(window, NULL);
+
+					window = NULL;
+					close_memory_accessor(accessor);
+					accessor = open_memory_accessor(p);
+					arena = new_scratch_arena(p, 64 * 1024);
 					process = p;
+					call_thread = 0;
 					printf("New target process: %d\n", p);
 				}
 				else
@@ -119,11 +168,79 @@ int main(int argc, const char* const argv[])
 					printf("Could not find process: %s\n", expanded + sizeof("#process ") - 1);
 				}
 			}
+			else if(strncmp(expanded, "#agent ", sizeof("#agent ") - 1) == 0)
+			{
+				// Load the resident agent so further commands don't stop the process
+				if(inject_agent(process, expanded + sizeof("#agent ") - 1))
+					printf("Agent active in process %d, calls no longer stop it.\n", process);
+				else
+					printf("Could not load agent %s\n", expanded + sizeof("#agent ") - 1);
+			}
+			else if(strncmp(expanded, "#window ", sizeof("#window ") - 1) == 0)
+			{
+				size_t size = strtoull(expanded + sizeof("#window ") - 1, NULL, 0);
+				ProcessSession* session = window ? NULL : open_process_session(process);
+				if(window)
+					printf("Window already open at 0x%lx (%lu bytes)\n",
+							(unsigned long) window_remote(window), (unsigned long) window_size(window));
+				else if(session && size > 0 && (window = open_shared_window(session, size)))
+				{
+					scratch_add_window(arena, window);
+					printf("Window open at 0x%lx (%lu bytes)\n",
+							(unsigned long) window_remote(window), (unsigned long) window_size(window));
+				}
+				else
+					printf("Could not open window in process %d\n", process);
+
+				if(session)
+					close_process_session(session);
+			}
+			else if(strncmp(expanded, "#thread ", sizeof("#thread ") - 1) == 0)
+			{
+				// Which thread to borrow for calls: a thread ID, "idle" for one blocked in a system call, or "main"
+				const char* which = expanded + sizeof("#thread ") - 1;
+				call_thread = 0;
+				call_thread_flags = 0;
+				if(strcmp(which, "idle") == 0)
+				{
+					call_thread_flags = SESSION_IDLE_THREAD;
+					printf("Calls are made on an idle thread, currently %d.\n", find_idle_thread(process));
+				}
+				else if(strcmp(which, "main") != 0)
+				{
+					call_thread = atoi(which);
+					printf("Calls are made on thread %d.\n", call_thread);
+				}
+				else
+				{
+					printf("Calls are made on the main thread.\n");
+				}
+			}
+			else if(strcmp(expanded, "#cache") == 0)
+			{
+				printf("Memory cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+						accessor_hits(accessor), accessor_misses(accessor));
+			}
+			else if(strncmp(expanded, "#core ", sizeof("#core ") - 1) == 0)
+			{
+				// Dump a forked copy of the process so it only stops for as long as the fork takes
+				uint64_t pause_time;
+				const char* path = expanded + sizeof("#core ") - 1;
+				if(dump_core(process, path, CORE_FORK, &pause_time))
+					printf("Wrote %s, process stopped for %.3f ms\n", path, pause_time / 1000000.0);
+				else
+					printf("Could not dump process %d\n", process);
+			}
 			else if(strncmp(expanded, "#whatis ", sizeof("#whatis ") - 1) == 0)
 			{
 				void* address = (void*) (uintptr_t) strtoll(expanded + sizeof("#whatis ") - 1, NULL, 0);
 				void* symbol_address;
+
+				// looking up a symbol has no business stopping the process
+				int policy = process_policy();
+				set_process_policy(policy | POLICY_OBSERVE_ONLY);
 				const char* name = find_symbol_for_address(cache, process, address, &symbol_address);
+				set_process_policy(policy);
 				if(name)
 				{
 					printf("Found %s at %p for %p\n", name, symbol_address, address);
@@ -133,9 +250,33 @@ int main(int argc, const char* const argv[])
 					printf("Could not find symbol for address %p\n", address);
 				}
 			}
+			else if(strncmp(expanded, "#search ", sizeof("#search ") - 1) == 0)
+			{
+				search_command(process, expanded + sizeof("#search ") - 1);
+			}
+			else if(strncmp(expanded, "#tls ", sizeof("#tls ") - 1) == 0)
+			{
+				tls_command(process, expanded + sizeof("#tls ") - 1);
+			}
+			else if(strcmp(expanded, "#top") == 0 || strncmp(expanded, "#top ", sizeof("#top ") - 1) == 0)
+			{
+				top_command(process, expanded + sizeof("#top") - 1);
+			}
+			else if(strncmp(expanded, "#stack ", sizeof("#stack ") - 1) == 0)
+			{
+				stack_command(process, cache, expanded + sizeof("#stack ") - 1);
+			}
+			else if(strcmp(expanded, "#numa") == 0 || strncmp(expanded, "#numa ", sizeof("#numa ") - 1) == 0)
+			{
+				numa_command(process, cache, expanded + sizeof("#numa") - 1);
+			}
+			else if(strncmp(expanded, "#migrate ", sizeof("#migrate ") - 1) == 0)
+			{
+				migrate_command(process, expanded + sizeof("#migrate ") - 1);
+			}
 			else
 			{
-				process_command(process, target_mmap, target_munmap, expanded);
+				process_command(process, arena, expanded);
 			}
 
 			free(expanded);
@@ -147,15 +288,432 @@ int main(int argc, const char* const argv[])
 
 	write_history(".console_history");
 
+	free_scratch_arena(arena, NULL);
+
+	if(window)
+		close_shared_window(window, NULL);
+
+	close_memory_accessor(accessor);
+
 	free_symtab_cache(cache);
 
 	return 0;
 }
 
+// Search the memory of the inferior for a "string" or a pointer value
+void search_command(int process, char* expanded)
+{
+	char* tokenizer_state = expanded;
+	char* token = tokenizer(&tokenizer_state);
+	if(!token)
+	{
+		printf("Usage: #search (\"string\" | pointer value)\n");
+		return;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	uintptr_t* matches;
+	size_t bytes_scanned;
+	int count;
+
+	int tokenLength = strlen(token);
+	if(token[0] == '\"' && tokenLength > 2 && token[tokenLength - 1] == '\"')
+	{
+		token[tokenLength - 1] = '\0';
+		count = scan_process(process, token + 1, tokenLength - 2, 1, 0, &matches, &bytes_scanned);
+	}
+	else
+	{
+		char* endptr;
+		uintptr_t value = strtoull(token, &endptr, 0);
+		if(*endptr != '\0')
+		{
+			printf("Usage: #search (\"string\" | pointer value)\n");
+			return;
+		}
+
+		count = scan_for_pointer(process, value, 0, &matches, &bytes_scanned);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(count < 0)
+	{
+		printf("Could not search process %d\n", process);
+		return;
+	}
+
+	int i;
+	for(i = 0; i < count && i < 100; i++)
+		printf("  %p\n", (void*) matches[i]);
+
+	if(count > 100)
+		printf("  ... and %d more\n", count - 100);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	printf("%d match(es) in %zu MiB, %.3f s (%.0f MiB/s)\n", count, bytes_scanned >> 20, seconds,
+			seconds > 0 ? (bytes_scanned / 1048576.0) / seconds : 0.0);
+
+	free(matches);
+}
+
+void tls_command(int process, char* expanded)
+{
+	char* tokenizer_state = expanded;
+	char* image = tokenizer(&tokenizer_state);
+	char* symbol = image ? tokenizer(&tokenizer_state) : NULL;
+	char* size_token = symbol ? tokenizer(&tokenizer_state) : NULL;
+	size_t size = size_token ? strtoull(size_token, NULL, 0) : sizeof(int);
+	if(!symbol || size == 0 || size > 8)
+	{
+		printf("Usage: #tls <image> <variable> [size up to 8, default %zu]\n", sizeof(int));
+		return;
+	}
+
+	TlsReader* reader = open_tls_reader(process, image, symbol, size);
+	if(!reader)
+	{
+		printf("Could not find thread-local %s in %s\n", symbol, image);
+		return;
+	}
+
+	ThreadLocal threads[1024];
+	uint64_t values[1024];
+	memset(values, 0, sizeof(values));
+	int count = tls_read(reader, threads, values, 1024);
+
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		if(threads[i].read)
+		{
+			uint64_t value = 0;
+			memcpy(&value, (char*) values + i * size, size);
+			printf("  %d: %" PRIu64 " (0x%" PRIx64 ") at %p\n", threads[i].tid, value, value,
+					(void*) threads[i].address);
+		}
+		else
+		{
+			printf("  %d: not allocated\n", threads[i].tid);
+		}
+	}
+
+	close_tls_reader(reader);
+}
+
+static int compare_thread_cpu(const void* a, const void* b)
+{
+	const ThreadSample* first = (const ThreadSample*) a;
+	const ThreadSample* second = (const ThreadSample*) b;
+	return first->cpu < second->cpu ? 1 : first->cpu > second->cpu ? -1 : first->tid - second->tid;
+}
+
+// Show the busiest threads every so often: #top [samples per second] [seconds]
+void top_command(int process, char* expanded)
+{
+	char* tokenizer_state = expanded;
+	char* rate_token = tokenizer(&tokenizer_state);
+	char* duration_token = rate_token ? tokenizer(&tokenizer_state) : NULL;
+	double rate = rate_token ? strtod(rate_token, NULL) : 1.0;
+	double duration = duration_token ? strtod(duration_token, NULL) : 10.0;
+	if(rate <= 0 || rate > 1000 || duration <= 0)
+	{
+		printf("Usage: #top [samples per second, default 1] [seconds, default 10]\n");
+		return;
+	}
+
+	// the monitor keeps a few files open per thread, as many as the descriptor limit lets it
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	ThreadMonitor* monitor = open_thread_monitor(process);
+	if(!monitor)
+	{
+		printf("Could not read the threads of process %d\n", process);
+		return;
+	}
+
+	int interactive = isatty(STDOUT_FILENO);
+	int rounds = (int) (rate * duration + 0.5);
+	if(rounds < 1)
+		rounds = 1;
+
+	struct timespec interval;
+	interval.tv_sec = (time_t) (1.0 / rate);
+	interval.tv_nsec = (long) ((1.0 / rate - interval.tv_sec) * 1000000000.0);
+
+	int round;
+	for(round = 0; round < rounds; round++)
+	{
+		nanosleep(&interval, NULL);
+
+		struct timespec start, end;
+		ThreadSample* samples;
+		uint64_t elapsed;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int count = sample_threads(monitor, &samples, &elapsed);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if(count < 0)
+		{
+			printf("Process %d is gone\n", process);
+			break;
+		}
+
+		qsort(samples, count, sizeof(ThreadSample), compare_thread_cpu);
+
+		if(interactive)
+			printf("\033[H\033[J");
+
+		double cost = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+		double seconds = elapsed / 1000000000.0;
+		printf("Process %d: %d threads, sampled in %.3f ms\n", process, count, cost);
+		printf("%8s %-16s %s %6s %6s %9s %9s %s\n", "TID", "NAME", "S", "CPU%", "WAIT%", "VCSW/s", "NVCSW/s", "SYSCALL");
+
+		int i;
+		for(i = 0; i < count && i < 20; i++)
+		{
+			char syscall[16] = "-";
+			if(samples[i].syscall == THREAD_SYSCALL_UNKNOWN)
+				strcpy(syscall, "?");
+			else if(samples[i].syscall != THREAD_RUNNING)
+				snprintf(syscall, sizeof(syscall), "%ld", samples[i].syscall);
+
+			printf("%8d %-16s %c %6.1f %6.1f %9.0f %9.0f %s\n", samples[i].tid, samples[i].name, samples[i].state,
+					samples[i].cpu, samples[i].wait, samples[i].voluntary_switches / seconds,
+					samples[i].involuntary_switches / seconds, syscall);
+		}
+
+		if(count > 20)
+			printf("  ... and %d more\n", count - 20);
+
+		if(!interactive)
+			printf("\n");
+
+		fflush(stdout);
+	}
+
+	close_thread_monitor(monitor);
+}
+
+// Take a one-shot stack sample of a thread: #stack <tid>
+void stack_command(int process, SymtabCache* cache, char* expanded)
+{
+	int tid = atoi(expanded);
+	if(tid <= 0)
+	{
+		printf("Usage: #stack <tid>\n");
+		return;
+	}
+
+	uintptr_t frames[64];
+	int count = sample_stack(process, tid, frames, 64);
+	if(count < 0)
+	{
+		printf("Could not sample the stack of thread %d\n", tid);
+		return;
+	}
+
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		void* symbol_address;
+		const char* name = find_symbol_for_address(cache, process, (void*) frames[i], &symbol_address);
+		if(name)
+			printf("  #%-2d %p %s+0x%lx\n", i, (void*) frames[i], name,
+					(unsigned long) (frames[i] - (uintptr_t) symbol_address));
+		else
+			printf("  #%-2d %p\n", i, (void*) frames[i]);
+	}
+}
+
+static void print_node_pages(const unsigned long* pages, int nodes, unsigned long absent)
+{
+	int node;
+	for(node = 0; node < nodes; node++)
+		printf(" N%d=%-7lu", node, pages[node]);
+
+	printf(" absent=%-7lu", absent);
+}
+
+// Show which NUMA nodes a process's memory is on: #numa for every mapping, or #numa <addr> <len> for the
+// pages of a range, grouped by the symbol or mapping they belong to
+void numa_command(int process, SymtabCache* cache, char* expanded)
+{
+	char* tokenizer_state = expanded;
+	char* start_token = tokenizer(&tokenizer_state);
+	char* length_token = start_token ? tokenizer(&tokenizer_state) : NULL;
+	int nodes = numa_nodes() < NUMA_MAX_NODES ? numa_nodes() : NUMA_MAX_NODES;
+
+	if(!start_token)
+	{
+		NumaMapping* mappings;
+		int count = query_numa_residency(process, &mappings);
+		if(count < 0)
+		{
+			printf("Could not read the mappings of process %d\n", process);
+			return;
+		}
+
+		unsigned long totals[NUMA_MAX_NODES];
+		unsigned long total_absent = 0;
+		memset(totals, 0, sizeof(totals));
+
+		int i;
+		for(i = 0; i < count; i++)
+		{
+			// only mappings with something resident are interesting
+			int node;
+			unsigned long resident = 0;
+			for(node = 0; node < nodes; node++)
+			{
+				resident += mappings[i].pages[node];
+				totals[node] += mappings[i].pages[node];
+			}
+
+			total_absent += mappings[i].absent;
+			if(!resident)
+				continue;
+
+			printf("%p-%p %s %-10s", (void*) mappings[i].start, (void*) mappings[i].end,
+					mappings[i].permissions, mappings[i].policy);
+			print_node_pages(mappings[i].pages, nodes, mappings[i].absent);
+			printf(" %s\n", mappings[i].path);
+		}
+
+		printf("Total:");
+		print_node_pages(totals, nodes, total_absent);
+		printf("\n");
+
+		free(mappings);
+		return;
+	}
+
+	uintptr_t start = strtoull(start_token, NULL, 0);
+	size_t length = length_token ? strtoull(length_token, NULL, 0) : 1;
+	uintptr_t page_size = sysconf(_SC_PAGE_SIZE);
+	uintptr_t first = start & ~(page_size - 1);
+	size_t num_pages = (start + length - first + page_size - 1) / page_size;
+	if(length == 0 || num_pages > (1 << 24))
+	{
+		printf("Usage: #numa [<addr> <len>], at most %d pages\n", 1 << 24);
+		return;
+	}
+
+	int* page_nodes = (int*) malloc(num_pages * sizeof(int));
+	int count = query_page_nodes(process, start, length, page_nodes);
+	if(count < 0)
+	{
+		printf("Could not query the pages of process %d\n", process);
+		free(page_nodes);
+		return;
+	}
+
+	MemoryRegion* regions;
+	int num_regions = find_memory_regions(process, &regions);
+	int region = 0;
+
+	// runs of pages in the same symbol, or in the same mapping if it has no symbols, are shown together
+	char label[PATH_MAX] = "";
+	unsigned long pages[NUMA_MAX_NODES];
+	unsigned long absent = 0;
+	uintptr_t run_start = first;
+	int i;
+	for(i = 0; i <= count; i++)
+	{
+		uintptr_t addr = first + i * page_size;
+		char page_label[PATH_MAX] = "";
+		if(i < count)
+		{
+			while(region < num_regions && regions[region].end <= addr)
+				++region;
+
+			// a bss continues its image's data in anonymous memory, and has symbols like it
+			void* symbol_address;
+			const char* name = NULL;
+			int has_image = region < num_regions && (regions[region].path[0] == '/' || (!regions[region].path[0]
+					&& region > 0 && regions[region - 1].end == regions[region].start
+					&& regions[region - 1].path[0] == '/'));
+			if(region >= num_regions || regions[region].start > addr)
+				strcpy(page_label, "(unmapped)");
+			else if(has_image && (name = find_symbol_for_address(cache, process, (void*) addr, &symbol_address)))
+				snprintf(page_label, sizeof(page_label), "%s", name);
+			else if(regions[region].path[0])
+				snprintf(page_label, sizeof(page_label), "%s", regions[region].path);
+			else
+				strcpy(page_label, "(anonymous)");
+		}
+
+		if(i == count || (i > 0 && strcmp(page_label, label) != 0))
+		{
+			printf("%p-%p", (void*) run_start, (void*) addr);
+			print_node_pages(pages, nodes, absent);
+			printf(" %s\n", label);
+		}
+
+		if(i == count)
+			break;
+
+		if(i == 0 || strcmp(page_label, label) != 0)
+		{
+			strcpy(label, page_label);
+			memset(pages, 0, sizeof(pages));
+			absent = 0;
+			run_start = addr;
+		}
+
+		if(page_nodes[i] >= 0 && page_nodes[i] < NUMA_MAX_NODES)
+			++pages[page_nodes[i]];
+		else
+			++absent;
+	}
+
+	if(num_regions >= 0)
+		free(regions);
+
+	free(page_nodes);
+}
+
+// Move a range of a process's memory to a NUMA node: #migrate <addr> <len> <node>
+void migrate_command(int process, char* expanded)
+{
+	char* tokenizer_state = expanded;
+	char* start_token = tokenizer(&tokenizer_state);
+	char* length_token = start_token ? tokenizer(&tokenizer_state) : NULL;
+	char* node_token = length_token ? tokenizer(&tokenizer_state) : NULL;
+	if(!node_token)
+	{
+		printf("Usage: #migrate <addr> <len> <node>\n");
+		return;
+	}
+
+	uintptr_t start = strtoull(start_token, NULL, 0);
+	size_t length = strtoull(length_token, NULL, 0);
+	int node = atoi(node_token);
+
+	struct timespec begin, end;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	long moved = migrate_range(process, start, length, node);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(moved < 0)
+		printf("Could not migrate %p-%p of process %d\n", (void*) start, (void*) (start + length), process);
+	else
+		printf("%ld pages of %p-%p are on node %d, %.3f ms\n", moved, (void*) start, (void*) (start + length), node,
+				(end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_nsec - begin.tv_nsec) / 1000000.0);
+}
+
 // Perform argument parsing and possibly execute a command in the inferior
-void process_command(int process, void* target_mmap, void* target_munmap, char* expanded)
+void process_command(int process, ScratchArena* arena, char* expanded)
 {
-	uintptr_t* strings = NULL;
+	char** strings = NULL;
+	int* stringargs = NULL;
+	uintptr_t* stringaddrs = NULL;
 	size_t* stringlens = NULL;
 	int numstrings = 0;
 
@@ -174,6 +732,7 @@ void process_command(int process, void* target_mmap, void* target_munmap, char*
 		else
 		{
 			args = (uintptr_t*) realloc(args, sizeof(uintptr_t) * (numargs + 1));	
+			args[numargs] = 0;
 
 			if(token[0] == '\"')
 			{
@@ -186,33 +745,15 @@ void process_command(int process, void* target_mmap, void* target_munmap, char*
 					++token;
 					--tokenLength;
 
-					printf("Allocating string \"%s\" ... ", token);
-
-					// Allocate it within target process and copy the string
-					strings = (uintptr_t*) realloc(strings,
-							sizeof(uintptr_t) * (numstrings + 1));	
-
-					stringlens = (uintptr_t*) realloc(stringlens,
-							sizeof(uintptr_t) * (numstrings + 1));	
-
-					strings[numstrings] =
-						call_function_in_target(process,
-								target_mmap,
-								6,
-								0, tokenLength, PROT_READ | PROT_WRITE,
-								MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+					// Remember the string for now. It is copied into the target process only once
+					// the process is stopped for the actual call.
+					strings = (char**) realloc(strings, sizeof(char*) * (numstrings + 1));
+					stringargs = (int*) realloc(stringargs, sizeof(int) * (numstrings + 1));
+					stringlens = (size_t*) realloc(stringlens, sizeof(size_t) * (numstrings + 1));
 
+					strings[numstrings] = token;
+					stringargs[numstrings] = numargs;
 					stringlens[numstrings] = tokenLength;
-
-					process_write(process, token, tokenLength,
-							strings[numstrings]);
-
-					process_read(process, token, tokenLength,
-							strings[numstrings]);
-
-					args[numargs] = strings[numstrings];
-
-					printf("(%s) 0x%" PRIxPTR "\n", token, strings[numstrings]);
 					++numstrings;
 				}
 			}
@@ -256,6 +797,78 @@ void process_command(int process, void* target_mmap, void* target_munmap, char*
 
 		if(function)
 		{
+			// With an agent in the process nothing needs the process stopped at all. Otherwise
+			// everything that does happens inside this one session.
+			AgentConnection* agent = find_agent_connection(process);
+			ProcessSession* session = NULL;
+			void* target_malloc = NULL;
+			void* target_free = NULL;
+
+			if(agent && numstrings > 0)
+			{
+				// without malloc and free in the target, strings go through scratch memory after all
+				target_malloc = find_libc_function(process, "malloc");
+				target_free = find_libc_function(process, "free");
+				if(!target_malloc || !target_free)
+					agent = NULL;
+			}
+
+			if(!agent)
+			{
+				session = open_thread_session(process, call_thread, call_thread_flags);
+				if(!session)
+				{
+					printf("Cannot attach to process %d.\n", process);
+					free(image_path);
+					goto cleanup;
+				}
+
+				// Strings from the last command are no longer needed
+				scratch_reset(arena);
+			}
+
+			stringaddrs = (uintptr_t*) malloc(sizeof(uintptr_t) * (numstrings + 1));
+			for(i = 0; i < numstrings; i++)
+			{
+				printf("Allocating string \"%s\" ... ", strings[i]);
+
+				// Copy the string into the target process
+				if(agent)
+				{
+					stringaddrs[i] = agent_call_function(agent, target_malloc, 1, stringlens[i]);
+					if(!stringaddrs[i] || stringaddrs[i] == (uintptr_t) -1
+							|| agent_write(agent, strings[i], stringlens[i], stringaddrs[i]) != (ssize_t) stringlens[i])
+					{
+						printf("failed!\n");
+						if(stringaddrs[i] && stringaddrs[i] != (uintptr_t) -1)
+							++i;
+
+						while(i-- > 0)
+							agent_call_function(agent, target_free, 1, stringaddrs[i]);
+
+						free(image_path);
+						goto cleanup;
+					}
+				}
+				else
+				{
+					stringaddrs[i] = scratch_push(arena, session, strings[i], stringlens[i]);
+					if(!stringaddrs[i])
+					{
+						printf("failed!\n");
+						close_process_session(session);
+						free(image_path);
+						goto cleanup;
+					}
+				}
+
+				process_read(process, strings[i], stringlens[i], stringaddrs[i]);
+
+				args[stringargs[i]] = stringaddrs[i];
+
+				printf("(%s) 0x%" PRIxPTR "\n", strings[i], stringaddrs[i]);
+			}
+
 			printf("Calling '%s' at %p (%s) with %d arguments (",
 					func_name, function, image_path, numargs);
 
@@ -269,9 +882,24 @@ void process_command(int process, void* target_mmap, void* target_munmap, char*
 
 			printf(")...\n");
 
-			uintptr_t ret = call_function_in_target_with_args(process, function, numargs, args);
+			uintptr_t ret;
+			if(agent)
+				ret = agent_call_function_with_args(agent, function, numargs, args);
+			else
+				ret = session_call_function_with_args(session, function, numargs, args);
+
 			free(image_path);
 
+			if(agent)
+			{
+				for(i = 0; i < numstrings; i++)
+					agent_call_function(agent, target_free, 1, stringaddrs[i]);
+			}
+			else
+			{
+				close_process_session(session);
+			}
+
 			printf("Return value (hex/dec/oct): 0x%" PRIxPTR " / %" PRIuPTR " / 0%" PRIoPTR "\n",
 				ret, ret, ret);
 		}
@@ -279,8 +907,6 @@ void process_command(int process, void* target_mmap, void* target_munmap, char*
 		{
 			printf("Cannot find function '%s' to call.\n", func_name);
 		}
-
-		free(func_name);
 	}
 	else
 	{
@@ -308,18 +934,21 @@ void process_command(int process, void* target_mmap, void* target_munmap, char*
 		}
 	}
 
+cleanup:
+	free(func_name);
+
 	if(args)
 		free(args);
 
-	for(i = 0; i < numstrings; i++)
-	{
-		printf("Freeing string at 0x%" PRIxPTR ".\n", strings[i]);
-		call_function_in_target(process, target_munmap, 2, strings[i], stringlens[i]);
-	}
-
 	if(strings)
 		free(strings);
 
+	if(stringargs)
+		free(stringargs);
+
+	if(stringaddrs)
+		free(stringaddrs);
+
 	if(stringlens)
 		free(stringlens);
 }
@@ -0,0 +1,391 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "core.h"
+#include "process.h"
+#include "objdump.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/procfs.h>
+#include <sys/syscall.h>
+
+// Core files are ELF files of type ET_CORE: a PT_NOTE segment describing the process (registers, name,
+// mapped files) followed by a PT_LOAD segment per mapping holding its memory. gdb and other tools
+// read them like the kernel's own core dumps.
+//
+// Reading a large process takes a while, and it can't be allowed to run meanwhile or the image would be
+// torn. With CORE_FORK the target forks instead: it is stopped only for as long as the clone system call
+// takes, and its copy-on-write child, which nothing ever resumes, is what gets read. The clone is a raw
+// system call rather than a call to fork() so that no atfork handlers run in the target, and it passes
+// CLONE_PTRACE so the child is born traced by us and stopped before it runs a single instruction. Its
+// exit signal is 0, so the target is not sent a SIGCHLD and waits for plain children don't see it.
+
+#define CORE_READ_SIZE (1024 * 1024)
+
+#ifdef __x86_64__
+#define CORE_MACHINE EM_X86_64
+#define CORE_CLASS ELFCLASS64
+#else
+#define CORE_MACHINE EM_386
+#define CORE_CLASS ELFCLASS32
+#endif
+
+#ifndef NT_FILE
+#define NT_FILE 0x46494c45
+#endif
+
+/**
+ * A note segment being built up.
+ *
+ */
+typedef struct NoteBuffer
+{
+	char* data;
+	size_t size;
+	size_t capacity;
+} NoteBuffer;
+
+static void add_note(NoteBuffer* notes, int type, const void* desc, size_t desc_size)
+{
+	static const char name[] = "CORE";
+	ElfW(Nhdr) header;
+	header.n_namesz = sizeof(name);
+	header.n_descsz = desc_size;
+	header.n_type = type;
+
+	size_t name_size = (sizeof(name) + 3) & ~3;
+	size_t padded_desc_size = (desc_size + 3) & ~3;
+	size_t needed = notes->size + sizeof(header) + name_size + padded_desc_size;
+	if(needed > notes->capacity)
+	{
+		notes->capacity = needed * 2;
+		notes->data = (char*) realloc(notes->data, notes->capacity);
+	}
+
+	char* out = notes->data + notes->size;
+	memset(out, 0, needed - notes->size);
+	memcpy(out, &header, sizeof(header));
+	memcpy(out + sizeof(header), name, sizeof(name));
+	memcpy(out + sizeof(header) + name_size, desc, desc_size);
+	notes->size = needed;
+}
+
+/**
+ *  Only private anonymous memory and writable mappings are worth dumping; read-only file mappings can be
+ *  read from the files the NT_FILE note names.
+ *
+ */
+static int region_dumped(MemoryRegion* region)
+{
+	if(region->permissions[0] != 'r')
+		return 0;
+
+	// the kernel doesn't let anyone read these through /proc/pid/mem or process_vm_readv
+	if(strncmp(region->path, "[vvar", 5) == 0 || strcmp(region->path, "[vsyscall]") == 0)
+		return 0;
+
+	return region->permissions[1] == 'w' || region->path[0] != '/';
+}
+
+static void add_process_notes(NoteBuffer* notes, int process, int source, struct user_regs_struct* regs,
+		MemoryRegion* regions, int num_regions)
+{
+	char buf[PATH_MAX];
+	int page_size = sysconf(_SC_PAGE_SIZE);
+
+	struct elf_prstatus status;
+	memset(&status, 0, sizeof(status));
+	status.pr_pid = process;
+	memcpy(&status.pr_reg, regs, sizeof(status.pr_reg) < sizeof(*regs) ? sizeof(status.pr_reg) : sizeof(*regs));
+	add_note(notes, NT_PRSTATUS, &status, sizeof(status));
+
+	struct elf_prpsinfo info;
+	memset(&info, 0, sizeof(info));
+	info.pr_pid = process;
+	snprintf(buf, sizeof(buf), "/proc/%d/cmdline", source);
+	FILE* file = fopen(buf, "r");
+	if(file)
+	{
+		size_t len = fread(info.pr_psargs, 1, sizeof(info.pr_psargs) - 1, file);
+		size_t i;
+		for(i = 0; i + 1 < len; i++)
+		{
+			if(info.pr_psargs[i] == '\0')
+				info.pr_psargs[i] = ' ';
+		}
+
+		fclose(file);
+	}
+
+	snprintf(buf, sizeof(buf), "/proc/%d/comm", source);
+	file = fopen(buf, "r");
+	if(file)
+	{
+		if(fgets(info.pr_fname, sizeof(info.pr_fname), file))
+			info.pr_fname[strcspn(info.pr_fname, "\n")] = '\0';
+
+		fclose(file);
+	}
+
+	add_note(notes, NT_PRPSINFO, &info, sizeof(info));
+
+	// NT_FILE: count, page size, then start, end and page offset of each file mapping, then their paths
+	int num_files = 0;
+	size_t names_size = 0;
+	int i;
+	for(i = 0; i < num_regions; i++)
+	{
+		if(regions[i].path[0] == '/')
+		{
+			++num_files;
+			names_size += strlen(regions[i].path) + 1;
+		}
+	}
+
+	size_t desc_size = sizeof(long) * (2 + 3 * num_files) + names_size;
+	long* desc = (long*) malloc(desc_size);
+	char* names = (char*) &desc[2 + 3 * num_files];
+	desc[0] = num_files;
+	desc[1] = page_size;
+
+	int file_index = 0;
+	for(i = 0; i < num_regions; i++)
+	{
+		if(regions[i].path[0] != '/')
+			continue;
+
+		desc[2 + file_index * 3] = regions[i].start;
+		desc[2 + file_index * 3 + 1] = regions[i].end;
+		desc[2 + file_index * 3 + 2] = regions[i].offset / page_size;
+		strcpy(names, regions[i].path);
+		names += strlen(regions[i].path) + 1;
+		++file_index;
+	}
+
+	add_note(notes, NT_FILE, desc, desc_size);
+	free(desc);
+}
+
+/**
+ *  Copies a mapping of a process into the core file. Pages that can't be read are left as a hole.
+ *
+ */
+static void copy_region(int source, int fd, char* buf, uintptr_t start, uintptr_t end, off_t offset)
+{
+	int page_size = sysconf(_SC_PAGE_SIZE);
+
+	uintptr_t addr = start;
+	while(addr < end)
+	{
+		size_t len = end - addr;
+		if(len > CORE_READ_SIZE)
+			len = CORE_READ_SIZE;
+
+		RemoteIOVec vec = { addr, len, buf, 0 };
+		process_readv(source, &vec, 1);
+
+		size_t got = vec.result > 0 ? vec.result : 0;
+		if(got > 0 && pwrite(fd, buf, got, offset + (addr - start)) != got)
+			fprintf(stderr, "Error: cannot write to core file!\n");
+
+		if(got < len)
+		{
+			// skip the page that failed and carry on from the next one
+			got = (got + page_size) & ~((size_t) page_size - 1);
+		}
+
+		addr += got;
+	}
+}
+
+/**
+ *  Writes the memory of a stopped process into a core file.
+ *
+ *  @param[in] process
+ *  	PID to record in the core file.
+ *
+ *  @param[in] source
+ *  	PID of the stopped process to read, which is the fork of process in CORE_FORK mode.
+ *
+ *  @return
+ *  	0 on failure, 1 on success.
+ *
+ */
+static int write_core(int process, int source, const char* path, struct user_regs_struct* regs)
+{
+	MemoryRegion* regions;
+	int num_regions = find_memory_regions(source, &regions);
+	if(num_regions < 0)
+		return 0;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd == -1)
+	{
+		fprintf(stderr, "Error: cannot create core file %s!\n", path);
+		free(regions);
+		return 0;
+	}
+
+	int page_size = sysconf(_SC_PAGE_SIZE);
+
+	NoteBuffer notes = { NULL, 0, 0 };
+	add_process_notes(&notes, process, source, regs, regions, num_regions);
+
+	size_t num_headers = num_regions + 1;
+	size_t headers_size = sizeof(ElfW(Ehdr)) + sizeof(ElfW(Phdr)) * num_headers;
+	ElfW(Ehdr)* ehdr = (ElfW(Ehdr)*) calloc(1, headers_size);
+	ElfW(Phdr)* phdrs = (ElfW(Phdr)*)(ehdr + 1);
+
+	memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+	ehdr->e_ident[EI_CLASS] = CORE_CLASS;
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_ident[EI_OSABI] = ELFOSABI_NONE;
+	ehdr->e_type = ET_CORE;
+	ehdr->e_machine = CORE_MACHINE;
+	ehdr->e_version = EV_CURRENT;
+	ehdr->e_phoff = sizeof(ElfW(Ehdr));
+	ehdr->e_ehsize = sizeof(ElfW(Ehdr));
+	ehdr->e_phentsize = sizeof(ElfW(Phdr));
+	ehdr->e_phnum = num_headers;
+
+	phdrs[0].p_type = PT_NOTE;
+	phdrs[0].p_offset = headers_size;
+	phdrs[0].p_filesz = notes.size;
+	phdrs[0].p_align = 4;
+
+	// memory goes after the notes, page aligned like the kernel lays it out
+	off_t offset = (headers_size + notes.size + page_size - 1) & ~((off_t) page_size - 1);
+	int i;
+	for(i = 0; i < num_regions; i++)
+	{
+		MemoryRegion* region = &regions[i];
+		ElfW(Phdr)* phdr = &phdrs[i + 1];
+		phdr->p_type = PT_LOAD;
+		phdr->p_vaddr = region->start;
+		phdr->p_memsz = region->end - region->start;
+		phdr->p_filesz = region_dumped(region) ? phdr->p_memsz : 0;
+		phdr->p_offset = offset;
+		phdr->p_align = page_size;
+		phdr->p_flags = (region->permissions[0] == 'r' ? PF_R : 0)
+				| (region->permissions[1] == 'w' ? PF_W : 0)
+				| (region->permissions[2] == 'x' ? PF_X : 0);
+
+		offset += phdr->p_filesz;
+	}
+
+	int ok = pwrite(fd, ehdr, headers_size, 0) == headers_size
+		&& pwrite(fd, notes.data, notes.size, headers_size) == notes.size;
+
+	char* buf = (char*) malloc(CORE_READ_SIZE);
+	for(i = 0; ok && i < num_regions; i++)
+	{
+		if(phdrs[i + 1].p_filesz)
+			copy_region(source, fd, buf, regions[i].start, regions[i].end, phdrs[i + 1].p_offset);
+	}
+
+	// unreadable pages at the very end would otherwise leave the file short
+	if(ok && ftruncate(fd, offset) == -1)
+		ok = 0;
+
+	if(!ok)
+		fprintf(stderr, "Error: cannot write core file %s!\n", path);
+
+	free(buf);
+	free(ehdr);
+	free(notes.data);
+	free(regions);
+	close(fd);
+
+	return ok;
+}
+
+/**
+ *  Dump the memory of a process to an ELF core file.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] path
+ *  	Path of the core file. It is created, or truncated if it exists.
+ *
+ *  @param[in] flags
+ *  	CORE_FORK to fork the process and dump the child, so the process is only stopped for the fork.
+ *  	Otherwise the process is kept stopped until the dump is complete.
+ *
+ *  @param[out] pause_time
+ *  	If not NULL, set to the number of nanoseconds the process was stopped for.
+ *
+ *  @return
+ *  	0 on failure, 1 on success.
+ *
+ */
+int dump_core(int process, const char* path, int flags, uint64_t* pause_time)
+{
+	struct user_regs_struct regs;
+	uint64_t paused = 0;
+	int ok = 0;
+
+	if(!(flags & CORE_FORK))
+	{
+		ProcessSession* session = open_process_session_with_flags(process, SESSION_ALL_THREADS | SESSION_NO_CALLS);
+		if(!session)
+			return 0;
+
+		if(ptrace(PTRACE_GETREGS, process, NULL, &regs) != -1)
+			ok = write_core(process, process, path, &regs);
+
+		paused = close_process_session(session);
+	}
+	else
+	{
+		ProcessSession* session = open_process_session(process);
+		if(!session)
+			return 0;
+
+		long child = -1;
+		if(ptrace(PTRACE_GETREGS, process, NULL, &regs) != -1)
+			child = session_syscall(session, SYS_clone, 5, CLONE_PTRACE, 0, 0, 0, 0);
+
+		paused = close_process_session(session);
+
+		if(child <= 0)
+		{
+			fprintf(stderr, "Error: cannot fork process %d!\n", process);
+			return 0;
+		}
+
+		// the child is ours to trace and stops before doing anything
+		int status;
+		if(waitpid(child, &status, __WALL) != -1 && WIFSTOPPED(status))
+			ok = write_core(process, child, path, &regs);
+
+		kill(child, SIGKILL);
+		while(waitpid(child, &status, __WALL) != -1 && !WIFEXITED(status) && !WIFSIGNALED(status));
+
+		// we were only its tracer; the process is its parent and has to reap it
+		session = open_process_session(process);
+		if(session)
+		{
+			session_syscall(session, SYS_wait4, 4, child, 0, __WALL, 0);
+			paused += close_process_session(session);
+		}
+	}
+
+	if(pause_time)
+		*pause_time = paused;
+
+	return ok;
+}
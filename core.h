@@ -0,0 +1,11 @@
+#ifndef CORE_H
+#define CORE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define CORE_FORK 1			/// Dump a copy-on-write child of the process instead of the stopped process.
+
+int dump_core(int process, const char* path, int flags, uint64_t* pause_time);
+
+#endif
@@ -13,81 +13,1074 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/user.h>
 #include "util.h"
 #include "asm.h"
 #include "objdump.h"
 #include "process.h"
+#include "arena.h"
+#include "async.h"
+
+#define MAX_PROCESSES 4096
+#define DEFAULT_JOBS 8
+
+typedef enum InjectAction
+{
+	ACTION_INJECT,
+	ACTION_UNINJECT_HANDLE,
+	ACTION_UNINJECT_PATH,
+	ACTION_RELOAD
+} InjectAction;
+
+typedef enum JobStatus
+{
+	JOB_OK,
+	JOB_ATTACH_FAILED,
+	JOB_NOT_LOADED,
+	JOB_FAILED,
+	JOB_TIMED_OUT
+} JobStatus;
+
+/**
+ * What to do to a process, and how it went.
+ *
+ */
+typedef struct InjectJob
+{
+	int pid;				/// The target process.
+	JobStatus status;			/// Outcome.
+	uintptr_t result;			/// Handle from the injection or return value of the uninjection.
+	int threads;				/// Number of threads stopped.
+	uint64_t quiesce_time;			/// Nanoseconds it took to stop them.
+	uint64_t stop_time;			/// Nanoseconds the process was stopped for.
+	uint64_t call_time;			/// Nanoseconds spent in remote calls while it was stopped.
+	int pending_signal;			/// Signal for a process we keep tracing to be resumed with.
+} InjectJob;
+
+/**
+ * Work shared by the worker threads.
+ *
+ */
+typedef struct JobQueue
+{
+	InjectAction action;
+	const char* path;			/// Library path, or the path of the library to replace for ACTION_RELOAD.
+	void* handle;				/// Library handle for ACTION_UNINJECT_HANDLE, and ACTION_RELOAD if there is no path.
+	const char* new_path;			/// Library to load in place of the old one for ACTION_RELOAD.
+	uint64_t call_timeout;			/// Nanoseconds a remote call may take, 0 for no limit.
+	int session_flags;			/// SESSION_ATTACHED if the (single) process is already traced and stopped.
+	InjectJob* jobs;
+	int num_jobs;
+	int next_job;				/// Index of the next job to hand out.
+} JobQueue;
+
+/**
+ * A thread being followed, and the breakpoint waiting for it if its process has just exec'd.
+ *
+ */
+typedef struct FollowedTask
+{
+	int tid;				/// Thread (or process) ID.
+	uintptr_t entry;			/// Entry point of the new image we put a breakpoint on, or 0.
+	unsigned char backup;			/// Instruction byte the breakpoint replaced.
+} FollowedTask;
+
+/**
+ * Everything being followed in follow mode.
+ *
+ */
+typedef struct Follower
+{
+	FollowedTask* tasks;
+	int num_tasks;
+	char exe_name[PATH_MAX];		/// Name of the executable that exec'd children must run to be injected.
+	int stop_signal;			/// Signal the main thread had on its way when begin_follow stopped it.
+} Follower;
+
+#define FOLLOW_OPTIONS (PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC)
+
+static volatile sig_atomic_t follow_interrupted = 0;
 
 void usage()
 {
-	printf("Usage: inject ([<user>/]exec_name | pid) <option>\n");
+	printf("Usage: inject [-a] [-j <jobs> | -A] [-t <ms>] [-f] ([<user>/]exec_name | pid | cgroup=<path> | ppid=<pid>) <option>\n");
 	printf(" One of the following options must be given:\n");
 	printf("   %-30s%s\n", "-i <.so file>", "Inject a shared library into a process.");
 	printf("   %-30s%s\n", "-u (<.so file>|<handle>)", "Remove a shared library previously injected into a process.");
+	printf("   %-30s%s\n", "-r (<.so>|<handle>) <.so>", "Replace an injected shared library with a new build,");
+	printf("   %-30s%s\n", "", "handing its hooks and state over in a single stop.");
+	printf(" With -a, every process with a matching name is targeted. cgroup= and ppid= always target every\n");
+	printf(" matching process. Up to <jobs> (default %d) processes are worked on at a time.\n", DEFAULT_JOBS);
+	printf(" With -A, -i works on every process at once from a single thread instead.\n");
+	printf(" With -t, a call into a process that takes longer than <ms> milliseconds is cancelled.\n");
+	printf(" With -f, a single process given -i is followed from the injection on until it exits or inject is\n");
+	printf(" interrupted: children that exec the same executable again are injected as they start up.\n");
 	printf("\n");
 }
 
+/**
+ *  Stops a job's process for the job to work on, having first found the library functions the job will
+ *  call, so the process isn't kept waiting for objdump.
+ *
+ */
+static ProcessSession* open_job_session(JobQueue* queue, InjectJob* job, LibraryCalls* calls)
+{
+	find_library_calls(job->pid, calls);
+
+	ProcessSession* session = open_process_session_with_flags(job->pid, SESSION_ALL_THREADS | queue->session_flags);
+	if(!session)
+	{
+		job->status = JOB_ATTACH_FAILED;
+		return NULL;
+	}
+
+	session_set_call_timeout(session, queue->call_timeout);
+	return session;
+}
+
+static void close_job_session(InjectJob* job, ProcessSession* session)
+{
+	if(session_last_call_status(session) == CALL_TIMED_OUT)
+		job->status = JOB_TIMED_OUT;
+
+	job->call_time = session_call_time(session);
+	job->quiesce_time = session_quiesce_time(session);
+	job->threads = session_stopped_threads(session);
+	job->pending_signal = session_pending_signal(session);
+	job->stop_time = close_process_session(session);
+}
+
+/**
+ *  Removes a library from a process, given its path. The process is only stopped if the library is loaded.
+ *
+ *  @param[in] queue
+ *  	The queue the job came from.
+ *
+ *  @param[in] job
+ *  	The job to run.
+ *
+ *  @param[in] path
+ *  	The full path of the library.
+ *
+ */
+static void uninject_path(JobQueue* queue, InjectJob* job, const char* path)
+{
+	// look the handle up in the dynamic linker's list rather than asking dlopen for it, which would
+	// take a reference of its own that then has to be dropped as well.
+	void* handle = find_library_handle(job->pid, path);
+	if(!handle)
+	{
+		job->status = JOB_NOT_LOADED;
+		return;
+	}
+
+	LibraryCalls calls;
+	ProcessSession* session = open_job_session(queue, job, &calls);
+	if(!session)
+		return;
+
+	job->result = session_uninject_so(session, &calls, handle);
+	job->status = JOB_OK;
+
+	close_job_session(job, session);
+}
+
+/**
+ *  Replaces a library in a process with a new build of it.
+ *
+ *  @param[in] job
+ *  	The job to run.
+ *
+ *  @param[in] queue
+ *  	The queue the job came from, which says what to replace with what.
+ *
+ */
+static void reload(InjectJob* job, JobQueue* queue)
+{
+	void* handle = queue->handle;
+	if(queue->path)
+	{
+		handle = find_library_handle(job->pid, queue->path);
+		if(!handle)
+		{
+			job->status = JOB_NOT_LOADED;
+			return;
+		}
+	}
+
+	LibraryCalls calls;
+	ProcessSession* session = open_job_session(queue, job, &calls);
+	if(!session)
+		return;
+
+	job->result = (uintptr_t) session_reload_so(session, &calls, handle, queue->new_path);
+	job->status = job->result ? JOB_OK : JOB_FAILED;
+
+	close_job_session(job, session);
+}
+
+/**
+ *  Runs one job against its process.
+ *
+ */
+static void run_job(JobQueue* queue, InjectJob* job)
+{
+	if(queue->action == ACTION_UNINJECT_PATH)
+	{
+		uninject_path(queue, job, queue->path);
+		return;
+	}
+
+	if(queue->action == ACTION_RELOAD)
+	{
+		reload(job, queue);
+		return;
+	}
+
+	LibraryCalls calls;
+	ProcessSession* session = open_job_session(queue, job, &calls);
+	if(!session)
+		return;
+
+	if(queue->action == ACTION_INJECT)
+	{
+		job->result = (uintptr_t) session_inject_so(session, &calls, queue->path);
+		job->status = job->result ? JOB_OK : JOB_FAILED;
+	}
+	else
+	{
+		job->result = session_uninject_so(session, &calls, queue->handle);
+		job->status = JOB_OK;
+	}
+
+	close_job_session(job, session);
+}
+
+static void* job_worker(void* arg)
+{
+	JobQueue* queue = (JobQueue*) arg;
+
+	while(1)
+	{
+		int i = __atomic_fetch_add(&queue->next_job, 1, __ATOMIC_RELAXED);
+		if(i >= queue->num_jobs)
+			break;
+
+		run_job(queue, &queue->jobs[i]);
+	}
+
+	return NULL;
+}
+
+/**
+ *  Runs every job in a queue, a bounded number at a time.
+ *
+ *  @param[in] queue
+ *  	The jobs to run.
+ *
+ *  @param[in] num_workers
+ *  	The maximum number of processes to work on at once.
+ *
+ */
+static void run_jobs(JobQueue* queue, int num_workers)
+{
+	if(num_workers > queue->num_jobs)
+		num_workers = queue->num_jobs;
+
+	if(num_workers <= 1)
+	{
+		job_worker(queue);
+		return;
+	}
+
+	// A process can only be traced by the thread that attached to it, so each worker sees its jobs
+	// through from start to finish.
+	pthread_t* workers = (pthread_t*) malloc(sizeof(pthread_t) * num_workers);
+	int started = 0;
+	while(started < num_workers)
+	{
+		if(pthread_create(&workers[started], NULL, job_worker, queue) != 0)
+			break;
+
+		++started;
+	}
+
+	// if we couldn't start any threads, do it ourselves
+	if(started == 0)
+		job_worker(queue);
+
+	int i;
+	for(i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+}
+
+static void async_inject_done(AsyncCall* call, void* context)
+{
+	InjectJob* job = (InjectJob*) context;
+
+	job->result = async_call_result(call);
+	job->status = (async_call_status(call) == CALL_OK && job->result) ? JOB_OK : JOB_FAILED;
+
+	close_job_session(job, async_call_session(call));
+	free_async_call(call);
+}
+
+/**
+ *  Runs every injection job in a queue from this thread, with the dlopen calls in all the processes running
+ *  at the same time, so the whole thing takes about as long as the slowest process.
+ *
+ *  @param[in] queue
+ *  	The jobs to run.
+ *
+ */
+static void run_jobs_async(JobQueue* queue)
+{
+	CallEngine* engine = new_call_engine();
+	if(!engine)
+	{
+		run_jobs(queue, 1);
+		return;
+	}
+
+	engine_set_call_timeout(engine, queue->call_timeout);
+
+	int i;
+	for(i = 0; i < queue->num_jobs; i++)
+	{
+		InjectJob* job = &queue->jobs[i];
+
+		LibraryCalls calls;
+		ProcessSession* session = open_job_session(queue, job, &calls);
+		if(session)
+			engine_inject_so(engine, session, &calls, queue->path, async_inject_done, job);
+
+		// collect whatever has finished meanwhile, so the first processes aren't kept waiting on the last
+		engine_run(engine, 0);
+	}
+
+	engine_run(engine, -1);
+	free_call_engine(engine);
+}
+
+/**
+ *  Reports the outcome of a job run on a single process, the way this program always has.
+ *
+ */
+static int print_single_result(JobQueue* queue, InjectJob* job)
+{
+	if(job->status == JOB_ATTACH_FAILED)
+	{
+		fprintf(stderr, "Cannot attach to process %d!\n", job->pid);
+		return 1;
+	}
+
+	if(job->status == JOB_NOT_LOADED)
+	{
+		printf("The file %s is not loaded in proess %d.\n", queue->path, job->pid);
+		return 0;
+	}
+
+	if(job->status == JOB_TIMED_OUT)
+		printf("A call into process %d timed out and was cancelled.\n", job->pid);
+	else if(queue->action == ACTION_INJECT)
+		printf("Injection returned handle: 0x%" PRIxPTR "\n", job->result);
+	else if(queue->action == ACTION_RELOAD && job->status == JOB_OK)
+		printf("Reload returned handle: 0x%" PRIxPTR "\n", job->result);
+	else if(queue->action == ACTION_RELOAD)
+		printf("Reload failed.\n");
+	else if(job->status == JOB_OK)
+		printf("Uninjection returned: %d\n", (int) job->result);
+	else
+		printf("Uninjection failed.\n");
+
+	printf("Stopped %d thread(s) in %.3f ms, resumed after %.3f ms, %.3f ms of it in calls.\n",
+		job->threads, job->quiesce_time / 1000000.0, job->stop_time / 1000000.0, job->call_time / 1000000.0);
+
+	return job->status == JOB_TIMED_OUT;
+}
+
+/**
+ *  Reports the outcome of a job that is one of many.
+ *
+ */
+static void print_fleet_result(JobQueue* queue, InjectJob* job)
+{
+	printf("%-8d ", job->pid);
+
+	switch(job->status)
+	{
+		case JOB_ATTACH_FAILED:
+			printf("cannot attach\n");
+			return;
+
+		case JOB_NOT_LOADED:
+			printf("not loaded\n");
+			return;
+
+		case JOB_FAILED:
+			printf("%-16s ", "failed");
+			break;
+
+		case JOB_TIMED_OUT:
+			printf("%-16s ", "timed out");
+			break;
+
+		case JOB_OK:
+			if(queue->action == ACTION_INJECT || queue->action == ACTION_RELOAD)
+				printf("handle 0x%-12" PRIxPTR " ", job->result);
+			else
+				printf("returned %-7d ", (int) job->result);
+			break;
+	}
+
+	printf("stopped %d thread(s) for %.3f ms, calls %.3f ms\n", job->threads, job->stop_time / 1000000.0,
+		job->call_time / 1000000.0);
+}
+
+static FollowedTask* find_task(Follower* follower, int tid)
+{
+	int i;
+	for(i = 0; i < follower->num_tasks; i++)
+	{
+		if(follower->tasks[i].tid == tid)
+			return &follower->tasks[i];
+	}
+
+	return NULL;
+}
+
+static FollowedTask* add_task(Follower* follower, int tid)
+{
+	FollowedTask* task = find_task(follower, tid);
+	if(task)
+		return task;
+
+	follower->tasks = (FollowedTask*) realloc(follower->tasks, sizeof(FollowedTask) * (follower->num_tasks + 1));
+	task = &follower->tasks[follower->num_tasks++];
+	task->tid = tid;
+	task->entry = 0;
+	task->backup = 0;
+	return task;
+}
+
+static void remove_task(Follower* follower, int tid)
+{
+	FollowedTask* task = find_task(follower, tid);
+	if(task)
+		*task = follower->tasks[--follower->num_tasks];
+}
+
+/**
+ *  Returns the name of the executable a process is running, without its directory.
+ *
+ */
+static int exe_name(int process, char name[PATH_MAX])
+{
+	char buf[PATH_MAX];
+	char path[PATH_MAX];
+
+	snprintf(buf, sizeof(buf), "/proc/%d/exe", process);
+	int len = readlink(buf, path, sizeof(path) - 1);
+	if(len == -1)
+		return 0;
+
+	path[len] = '\0';
+
+	char* slash = strrchr(path, '/');
+	strcpy(name, slash ? slash + 1 : path);
+
+	// an executable replaced on disk since it was started
+	char* deleted = strstr(name, " (deleted)");
+	if(deleted)
+		*deleted = '\0';
+
+	return 1;
+}
+
+/**
+ *  Starts tracing every thread of a process, so we hear about the processes it forks and execs. Threads
+ *  created from then on are traced automatically.
+ *
+ *  @return
+ *  	0 on success, -1 if the process could not be traced.
+ *
+ */
+static int seize_process(Follower* follower, int process)
+{
+	if(ptrace(PTRACE_SEIZE, process, NULL, (void*) FOLLOW_OPTIONS) == -1)
+		return -1;
+
+	add_task(follower, process);
+
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "/proc/%d/task", process);
+
+	// keep going until a pass finds no threads we haven't seized yet, in case threads are being created.
+	int found_new = 1;
+	while(found_new)
+	{
+		found_new = 0;
+
+		DIR* tasks = opendir(buf);
+		if(!tasks)
+			break;
+
+		struct dirent* entry;
+		while((entry = readdir(tasks)) != NULL)
+		{
+			char* endptr;
+			int tid = strtol(entry->d_name, &endptr, 10);
+			if(*endptr != '\0' || find_task(follower, tid))
+				continue;
+
+			// a thread that exits before we get to it isn't an error
+			if(ptrace(PTRACE_SEIZE, tid, NULL, (void*) FOLLOW_OPTIONS) == -1)
+				continue;
+
+			add_task(follower, tid);
+			found_new = 1;
+		}
+
+		closedir(tasks);
+	}
+
+	return 0;
+}
+
+/**
+ *  A process has exec'd. Its new image can't be injected until the dynamic linker has loaded libc, so
+ *  put a breakpoint on the entry point of the executable, which is where the linker hands over.
+ *
+ */
+static void exec_stopped(Follower* follower, FollowedTask* task)
+{
+	char name[PATH_MAX];
+	if(!exe_name(task->tid, name) || strcmp(name, follower->exe_name) != 0)
+		return;
+
+	uintptr_t entry = find_process_entry_point(task->tid);
+	if(!entry)
+		return;
+
+	unsigned char breakpoint = 0xcc;
+	process_read(task->tid, &task->backup, 1, entry);
+	if(process_write(task->tid, &breakpoint, 1, entry) != 1)
+		return;
+
+	task->entry = entry;
+}
+
+/**
+ *  Checks whether a trap is the breakpoint on the entry point of a freshly exec'd process and, if so,
+ *  removes it and injects the library.
+ *
+ *  @return
+ *  	-1 if the trap was not ours, otherwise the signal to resume the process with.
+ *
+ */
+static int entry_reached(JobQueue* queue, FollowedTask* task)
+{
+	struct user_regs_struct regs;
+	if(ptrace(PTRACE_GETREGS, task->tid, NULL, &regs) == -1)
+		return -1;
+
+#if __WORDSIZE == 64
+	if(regs.rip != task->entry + 1)
+		return -1;
+
+	regs.rip = task->entry;
+#else
+	if(regs.eip != task->entry + 1)
+		return -1;
+
+	regs.eip = task->entry;
+#endif
+
+	process_write(task->tid, &task->backup, 1, task->entry);
+	ptrace(PTRACE_SETREGS, task->tid, NULL, &regs);
+	task->entry = 0;
+
+	// the new image's libc has only just been mapped
+	LibraryCalls calls;
+	find_library_calls(task->tid, &calls);
+
+	ProcessSession* session = open_process_session_with_flags(task->tid, SESSION_ATTACHED);
+	if(!session)
+	{
+		printf("%-8d cannot inject after exec\n", task->tid);
+		return 0;
+	}
+
+	session_set_call_timeout(session, queue->call_timeout);
+
+	void* handle = session_inject_so(session, &calls, queue->path);
+	int pending_signal = session_pending_signal(session);
+	uint64_t stop_time = close_process_session(session);
+
+	if(handle)
+		printf("%-8d handle 0x%-12" PRIxPTR " stopped for %.3f ms after exec\n", task->tid, (uintptr_t) handle,
+			stop_time / 1000000.0);
+	else
+		printf("%-8d injection after exec failed\n", task->tid);
+
+	return pending_signal;
+}
+
+/**
+ *  Stops a thread being followed, passing over whatever else was on its way. Threads and processes it
+ *  starts in the meantime report in to follow later.
+ *
+ *  @param[out] sig
+ *  	A signal that was on its way to the thread, to resume it with, or 0.
+ *
+ *  @return
+ *  	0 once the thread is stopped, -1 if it went away.
+ *
+ */
+static int interrupt_task(int tid, int* sig)
+{
+	int status;
+
+	*sig = 0;
+	if(ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1)
+		return -1;
+
+	while(waitpid(tid, &status, __WALL) != -1 && WIFSTOPPED(status))
+	{
+		if((status >> 16) == PTRACE_EVENT_STOP)
+			return 0;
+
+		if((status >> 16) == 0 && WSTOPSIG(status) != SIGTRAP)
+			*sig = WSTOPSIG(status);
+
+		ptrace(PTRACE_CONT, tid, NULL, NULL);
+	}
+
+	return -1;
+}
+
+/**
+ *  Lets go of everything being followed, taking out any breakpoints that are still waiting.
+ *
+ */
+static void release_tasks(Follower* follower)
+{
+	int i;
+	for(i = 0; i < follower->num_tasks; i++)
+	{
+		FollowedTask* task = &follower->tasks[i];
+
+		int sig;
+		if(interrupt_task(task->tid, &sig) == -1)
+			continue;
+
+		if(task->entry)
+		{
+			struct user_regs_struct regs;
+			process_write(task->tid, &task->backup, 1, task->entry);
+			ptrace(PTRACE_GETREGS, task->tid, NULL, &regs);
+#if __WORDSIZE == 64
+			if(regs.rip == task->entry + 1)
+			{
+				regs.rip = task->entry;
+				ptrace(PTRACE_SETREGS, task->tid, NULL, &regs);
+			}
+#else
+			if(regs.eip == task->entry + 1)
+			{
+				regs.eip = task->entry;
+				ptrace(PTRACE_SETREGS, task->tid, NULL, &regs);
+			}
+#endif
+		}
+
+		ptrace(PTRACE_DETACH, task->tid, NULL, (void*) (uintptr_t) sig);
+	}
+
+	free(follower->tasks);
+	follower->tasks = NULL;
+	follower->num_tasks = 0;
+}
+
+static void follow_interrupt(int sig)
+{
+	(void) sig;
+	follow_interrupted = 1;
+}
+
+/**
+ *  Starts following a process before the library is injected into it, so nothing it forks or execs while
+ *  that happens goes unnoticed. Every thread is traced, and the main thread is left stopped for the
+ *  injection to run in a session opened with SESSION_ATTACHED.
+ *
+ *  @param[out] follower
+ *  	What is being followed.
+ *
+ *  @param[in] process
+ *  	The process to follow.
+ *
+ *  @return
+ *  	0 on success, -1 if the process couldn't be traced.
+ *
+ */
+static int begin_follow(Follower* follower, int process)
+{
+	memset(follower, 0, sizeof(*follower));
+
+	if(!exe_name(process, follower->exe_name) || seize_process(follower, process) == -1)
+		return -1;
+
+	if(interrupt_task(process, &follower->stop_signal) == -1)
+	{
+		release_tasks(follower);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  Follows a process and its descendants after the library has been injected into it. Forked children
+ *  inherit the library; children that exec the same executable get it injected once the dynamic linker is
+ *  done with them. Library symbols come from the cache that the first injection filled, so injecting a
+ *  child running the same images costs no objdump runs.
+ *
+ *  @param[in] queue
+ *  	The (single) injection job.
+ *
+ *  @param[in] follower
+ *  	What begin_follow started following. Everything is let go of on return.
+ *
+ *  @param[in] process
+ *  	The process to follow, which is still stopped from the injection. If the injection failed, it is
+ *  	only let go of.
+ *
+ *  @return
+ *  	0 once everything followed has exited or inject was interrupted.
+ *
+ */
+static int follow(JobQueue* queue, Follower* follower, int process)
+{
+	int sig = queue->jobs[0].pending_signal ? queue->jobs[0].pending_signal : follower->stop_signal;
+	ptrace(PTRACE_CONT, process, NULL, (void*) (uintptr_t) sig);
+
+	if(queue->jobs[0].status != JOB_OK)
+	{
+		release_tasks(follower);
+		return 0;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = follow_interrupt;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	printf("Following process %d; interrupt to stop.\n", process);
+	fflush(stdout);
+
+	while(!follow_interrupted)
+	{
+		int status;
+		int tid = waitpid(-1, &status, __WALL);
+		if(tid == -1)
+		{
+			if(errno == EINTR)
+				continue;
+
+			// nothing left to follow
+			break;
+		}
+
+		if(WIFEXITED(status) || WIFSIGNALED(status))
+		{
+			remove_task(follower, tid);
+			continue;
+		}
+
+		if(!WIFSTOPPED(status))
+			continue;
+
+		// a new child can report in before its parent's fork event does
+		FollowedTask* task = add_task(follower, tid);
+		int event = status >> 16;
+		int sig = WSTOPSIG(status);
+		unsigned long message;
+
+		switch(event)
+		{
+			case PTRACE_EVENT_FORK:
+			case PTRACE_EVENT_VFORK:
+			case PTRACE_EVENT_CLONE:
+				ptrace(PTRACE_GETEVENTMSG, tid, NULL, &message);
+				add_task(follower, (int) message);
+				if(event != PTRACE_EVENT_CLONE)
+				{
+					printf("%-8d forked from %d\n", (int) message, tid);
+					fflush(stdout);
+				}
+				ptrace(PTRACE_CONT, tid, NULL, NULL);
+				break;
+
+			case PTRACE_EVENT_EXEC:
+				// if a thread other than the main one exec'd, it has taken over the process ID
+				ptrace(PTRACE_GETEVENTMSG, tid, NULL, &message);
+				if((int) message != tid)
+					remove_task(follower, (int) message);
+
+				task = find_task(follower, tid);
+				task->entry = 0;
+				exec_stopped(follower, task);
+				ptrace(PTRACE_CONT, tid, NULL, NULL);
+				break;
+
+			case PTRACE_EVENT_STOP:
+				// the first stop of a new child, or a group-stop we must not end by resuming the thread
+				if(sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN || sig == SIGTTOU)
+					ptrace(PTRACE_LISTEN, tid, NULL, NULL);
+				else
+					ptrace(PTRACE_CONT, tid, NULL, NULL);
+				break;
+
+			default:
+				if(sig == SIGTRAP && task->entry)
+				{
+					int pending_signal = entry_reached(queue, task);
+					fflush(stdout);
+					if(pending_signal != -1)
+						sig = pending_signal;
+				}
+
+				// otherwise, a signal on its way to the thread
+				ptrace(PTRACE_CONT, tid, NULL, (void*) (uintptr_t) sig);
+				break;
+		}
+	}
+
+	release_tasks(follower);
+
+	return 0;
+}
+
 int main(int argc, const char* const argv[])
 {
-	if(argc < 4)
+	JobQueue queue;
+	memset(&queue, 0, sizeof(queue));
+
+	int all = 0;
+	int async = 0;
+	int follow_children = 0;
+	int num_workers = DEFAULT_JOBS;
+
+	int arg = 1;
+	while(arg < argc && argv[arg][0] == '-')
+	{
+		if(strcmp(argv[arg], "-a") == 0)
+		{
+			all = 1;
+			++arg;
+		}
+		else if(strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
+		{
+			queue.call_timeout = strtoull(argv[arg + 1], NULL, 10) * 1000000ULL;
+			arg += 2;
+		}
+		else if(strcmp(argv[arg], "-A") == 0)
+		{
+			async = 1;
+			++arg;
+		}
+		else if(strcmp(argv[arg], "-f") == 0)
+		{
+			follow_children = 1;
+			++arg;
+		}
+		else if(strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+		{
+			num_workers = atoi(argv[arg + 1]);
+			if(num_workers < 1)
+				num_workers = 1;
+			arg += 2;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if(argc - arg < 3)
 	{
 		usage();
 		exit(0);
 	}
 
-	int pid = resolve_process(argv[1]);
+	const char* target = argv[arg];
+	const char* option = argv[arg + 1];
+	const char* library = argv[arg + 2];
 
-	if(strncmp(argv[2], "-i", 2) == 0)
+	char resolved_path[PATH_MAX];
+	char resolved_new_path[PATH_MAX];
+	if(strncmp(option, "-i", 2) == 0)
+	{
+		queue.action = ACTION_INJECT;
+		queue.path = library;
+	}
+	else if(strncmp(option, "-r", 2) == 0)
 	{
-		printf("Injection returned handle: %x\n",
-			(unsigned int)((uintptr_t)inject_so(pid, argv[3])));
+		if(argc - arg < 4)
+		{
+			usage();
+			exit(0);
+		}
+
+		queue.action = ACTION_RELOAD;
+		queue.new_path = realpath(argv[arg + 3], resolved_new_path);
+		if(!queue.new_path)
+		{
+			fprintf(stderr, "Cannot find %s to load!\n", argv[arg + 3]);
+			return 1;
+		}
+
+		char* endptr;
+		queue.handle = (void*) (uintptr_t) strtoull(library, &endptr, 16);
+		if(*endptr != '\0')
+		{
+			queue.path = realpath(library, resolved_path);
+			if(!queue.path)
+			{
+				fprintf(stderr, "Cannot find %s to replace!\n", library);
+				return 1;
+			}
+		}
 	}
-	else if(strncmp(argv[2], "-u", 2) == 0)
+	else if(strncmp(option, "-u", 2) == 0)
 	{
 		char* endptr;
-		void* handle = (void*) (uintptr_t) strtoll(argv[3], &endptr, 16);
+		queue.handle = (void*) (uintptr_t) strtoull(library, &endptr, 16);
 		if(*endptr == '\0')
 		{
 			// "handle" argument, use directly.
-			printf("Uninjection returned: %d\n", uninject_so(pid, handle));
+			queue.action = ACTION_UNINJECT_HANDLE;
 		}
 		else
 		{
-			// first, make sure the image is loaded. We do this by attempting
-			// find the load address of the full path of the .so inside the
-			// process's memory.
-			char resolved_path[PATH_MAX];
-			char* path = realpath(argv[3], resolved_path);
-			if(!path)
+			queue.action = ACTION_UNINJECT_PATH;
+			queue.path = realpath(library, resolved_path);
+			if(!queue.path)
 			{
-				fprintf(stderr, "Cannot find %s to uninject!\n", argv[3]);
+				fprintf(stderr, "Cannot find %s to uninject!\n", library);
 				return 1;
 			}
+		}
+	}
+	else
+	{
+		usage();
+		return 0;
+	}
 
-			char image_out_path[PATH_MAX];
-			uintptr_t image_start;
-			if(find_image_address(pid, path, image_out_path, &image_start))
-			{
-				void* handle = inject_so(pid, path);
+	int* processes = (int*) malloc(sizeof(int) * MAX_PROCESSES);
+	int num_processes;
+	int fleet = all || strncmp(target, "cgroup=", sizeof("cgroup=") - 1) == 0
+		|| strncmp(target, "ppid=", sizeof("ppid=") - 1) == 0;
+	if(follow_children && (fleet || queue.action != ACTION_INJECT))
+	{
+		fprintf(stderr, "-f can only be used to inject into a single process.\n");
+		return 1;
+	}
 
-				// get rid of the reference we just made
-				uninject_so(pid, handle);
+	if(fleet)
+	{
+		num_processes = resolve_processes(target, processes, MAX_PROCESSES);
+	}
+	else
+	{
+		processes[0] = resolve_process(target);
+		num_processes = processes[0] != 0 ? 1 : 0;
+	}
 
-				// get rid of the first injection's reference, hopefully
-				printf("Uninjection returned: %d\n", uninject_so(pid, handle));
-			}
-			else
-			{
-				printf("The file %s is not loaded in proess %d.\n", path, pid);
-			}
+	if(num_processes <= 0)
+	{
+		fprintf(stderr, "Could not find process: %s\n", target);
+		free(processes);
+		return 1;
+	}
+
+	queue.jobs = (InjectJob*) calloc(num_processes, sizeof(InjectJob));
+	queue.num_jobs = num_processes;
+
+	int i;
+	for(i = 0; i < num_processes; i++)
+		queue.jobs[i].pid = processes[i];
+
+	free(processes);
+
+	// trace the process before injecting, so whatever it starts in the meantime is followed too
+	Follower follower;
+	if(follow_children)
+	{
+		if(begin_follow(&follower, queue.jobs[0].pid) == -1)
+		{
+			fprintf(stderr, "Cannot follow process %d!\n", queue.jobs[0].pid);
+			free(queue.jobs);
+			return 1;
 		}
+
+		queue.session_flags = SESSION_ATTACHED;
 	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(async && !follow_children && queue.action == ACTION_INJECT)
+		run_jobs_async(&queue);
 	else
+		run_jobs(&queue, num_workers);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	int ret = 0;
+	if(!fleet)
 	{
-		usage();
+		ret = print_single_result(&queue, &queue.jobs[0]);
+
+		if(follow_children)
+		{
+			fflush(stdout);
+			int followed = follow(&queue, &follower, queue.jobs[0].pid);
+			if(queue.jobs[0].status == JOB_OK)
+				ret = followed;
+		}
+	}
+	else
+	{
+		int succeeded = 0;
+		for(i = 0; i < num_processes; i++)
+		{
+			print_fleet_result(&queue, &queue.jobs[i]);
+			if(queue.jobs[i].status == JOB_OK)
+				++succeeded;
+		}
+
+		printf("%d of %d process(es) succeeded in %.3f ms.\n", succeeded, num_processes,
+			(end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0);
 	}
 
-	return 0;
+	free(queue.jobs);
+
+	return ret;
 }
 
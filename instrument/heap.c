@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <limits.h>
 #include <time.h>
 #include <execinfo.h>
@@ -416,17 +417,35 @@ void* realloc_hook(void* ptr, size_t size)
 	return ret;
 }
 
-void __attribute__ ((constructor)) interpose_init()
-{
-	time(&logging_started);
-	last_report = logging_started;
-
-	snprintf(LogFilename, PATH_MAX, "/tmp/malloc-log.%d", getpid());
-
-	FILE* f = fopen(LogFilename, "a");
-	fprintf(f, "------ LOGGING STARTED ------\n");
-	fclose(f);
+// bump whenever HeapState, Backtrace or Allocation change, so builds that disagree don't swap state
+#define HEAP_STATE_VERSION 1
 
+/**
+ * Everything the library has learned about the process, as handed from one build to the next on reload.
+ *
+ */
+typedef struct HeapState
+{
+	uint32_t size;				/// sizeof(HeapState) of the build that made it.
+	uint32_t version;			/// HEAP_STATE_VERSION of the build that made it.
+	int BacktraceCacheSize;
+	int AllocationCacheSize;
+	int ActiveBacktraces;
+	int ActiveAllocations;
+	Backtrace* BacktraceCache;
+	Allocation* AllocationCache;
+	int* AllocationCacheSorted;
+	int NextFreeBacktraceCacheEntry;
+	int NextFreeAllocationCacheEntry;
+	time_t logging_started;
+	time_t last_report;
+} HeapState;
+
+// set once our state has been given to another build, which also takes over reporting it
+static int handed_over = 0;
+
+static void install_hooks()
+{
 	calloc_relocation = find_relocation(getpid(), "", "calloc");
 	malloc_relocation = find_relocation(getpid(), "", "malloc");
 	free_relocation = find_relocation(getpid(), "", "free");
@@ -465,7 +484,7 @@ void __attribute__ ((constructor)) interpose_init()
 		real_realloc = &realloc;
 }
 
-void __attribute__ ((destructor)) interpose_fini()
+static void remove_hooks()
 {
 	if(calloc_relocation)
 		*calloc_relocation = real_calloc;
@@ -479,6 +498,100 @@ void __attribute__ ((destructor)) interpose_fini()
 	if(realloc_relocation)
 		*realloc_relocation = real_realloc;
 
+	calloc_relocation = NULL;
+	malloc_relocation = NULL;
+	free_relocation = NULL;
+	realloc_relocation = NULL;
+}
+
+void __attribute__ ((constructor)) interpose_init()
+{
+	time(&logging_started);
+	last_report = logging_started;
+
+	snprintf(LogFilename, PATH_MAX, "/tmp/malloc-log.%d", getpid());
+
+	FILE* f = fopen(LogFilename, "a");
+	fprintf(f, "------ LOGGING STARTED ------\n");
+	fclose(f);
+
+	install_hooks();
+}
+
+/**
+ *  Called by inject -r before this build is replaced: unhooks and gives away everything logged so far.
+ *
+ */
+void* lcitk_reload_export()
+{
+	remove_hooks();
+
+	HeapState* state = (HeapState*) malloc(sizeof(HeapState));
+	state->size = sizeof(HeapState);
+	state->version = HEAP_STATE_VERSION;
+	state->BacktraceCacheSize = BacktraceCacheSize;
+	state->AllocationCacheSize = AllocationCacheSize;
+	state->ActiveBacktraces = ActiveBacktraces;
+	state->ActiveAllocations = ActiveAllocations;
+	state->BacktraceCache = BacktraceCache;
+	state->AllocationCache = AllocationCache;
+	state->AllocationCacheSorted = AllocationCacheSorted;
+	state->NextFreeBacktraceCacheEntry = NextFreeBacktraceCacheEntry;
+	state->NextFreeAllocationCacheEntry = NextFreeAllocationCacheEntry;
+	state->logging_started = logging_started;
+	state->last_report = last_report;
+
+	handed_over = 1;
+
+	return state;
+}
+
+/**
+ *  Called by inject -r once this build has replaced another, or if the replacement failed to load and the
+ *  state is coming back: takes over what was logged so far and makes sure the hooks are in. State from a build
+ *  that lays it out differently is left alone, and logging starts over.
+ *
+ */
+void lcitk_reload_import(void* arg)
+{
+	HeapState* state = (HeapState*) arg;
+	if(state && (state->size != sizeof(HeapState) || state->version != HEAP_STATE_VERSION))
+	{
+		// what it points to can't be freed without knowing its layout, so only the state itself goes
+		FILE* f = fopen(LogFilename, "a");
+		fprintf(f, "------ STATE OF ANOTHER VERSION NOT TAKEN OVER ------\n");
+		fclose(f);
+		free(state);
+	}
+	else if(state)
+	{
+		BacktraceCacheSize = state->BacktraceCacheSize;
+		AllocationCacheSize = state->AllocationCacheSize;
+		ActiveBacktraces = state->ActiveBacktraces;
+		ActiveAllocations = state->ActiveAllocations;
+		BacktraceCache = state->BacktraceCache;
+		AllocationCache = state->AllocationCache;
+		AllocationCacheSorted = state->AllocationCacheSorted;
+		NextFreeBacktraceCacheEntry = state->NextFreeBacktraceCacheEntry;
+		NextFreeAllocationCacheEntry = state->NextFreeAllocationCacheEntry;
+		logging_started = state->logging_started;
+		last_report = state->last_report;
+		free(state);
+	}
+
+	handed_over = 0;
+
+	if(!malloc_relocation && !calloc_relocation && !free_relocation && !realloc_relocation)
+		install_hooks();
+}
+
+void __attribute__ ((destructor)) interpose_fini()
+{
+	if(handed_over)
+		return;
+
+	remove_hooks();
+
 	instrument_report();
 
 	if(AllocationCache)
@@ -32,6 +32,9 @@ int main(int argc, const char* const argv[])
 		return 0;
 	}
 
+	// only ever read the process; a backtrace filter must not stop the program it's describing
+	set_process_policy(POLICY_OBSERVE_ONLY);
+
 	SymtabCache* cache = new_symtab_cache();
 
 	char line[4096];
@@ -0,0 +1,240 @@
+/**
+ * @file lcitk_agent.c
+ * @author Your Mom
+ *
+ * Resident agent for LCITK. Once injected, it serves requests from the controller through a shared
+ * memory ring (see agent.h) on a thread of its own, so the target never has to be stopped for them.
+ *
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "agent.h"
+#include "asm.h"
+
+// how long to keep polling for new requests after the last one before going to sleep
+#define AGENT_IDLE_SPINS 100000
+
+static AgentRing* ring = NULL;
+static pthread_t service_thread;
+static volatile int stopping = 0;
+
+typedef uintptr_t (*AgentFunction)(uintptr_t, uintptr_t, uintptr_t, uintptr_t,
+		uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+
+static long futex(volatile uint32_t* addr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+// Copy memory within our own process without faulting on bad addresses.
+static ssize_t safe_copy(void* dst, const void* src, size_t count)
+{
+	struct iovec local = { dst, count };
+	struct iovec remote = { (void*) src, count };
+	return process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+}
+
+static void execute(AgentSlot* slot)
+{
+	ssize_t ret;
+	uint64_t args[AGENT_MAX_ARGS] = {0};
+
+	// the slot is shared memory, so take one copy of the sizes and check them ourselves
+	uint64_t numargs = slot->numargs;
+	uint64_t length = slot->length;
+	if(numargs > AGENT_MAX_ARGS || length > AGENT_SLOT_DATA)
+	{
+		slot->error = EINVAL;
+		slot->result = -1;
+		return;
+	}
+
+	memcpy(args, slot->args, sizeof(uint64_t) * numargs);
+	slot->error = 0;
+
+	switch(slot->op)
+	{
+		case AGENT_OP_CALL:
+			// unused argument registers and stack slots are harmless to the callee
+			slot->result = ((AgentFunction) slot->function)(args[0], args[1], args[2], args[3],
+					args[4], args[5], args[6], args[7]);
+			break;
+
+		case AGENT_OP_READ:
+			ret = safe_copy(slot->data, (void*) slot->function, length);
+			slot->error = ret == -1 ? errno : 0;
+			slot->result = ret;
+			break;
+
+		case AGENT_OP_WRITE:
+			{
+				struct iovec local = { slot->data, length };
+				struct iovec remote = { (void*) slot->function, length };
+				ret = process_vm_writev(getpid(), &local, 1, &remote, 1, 0);
+				slot->error = ret == -1 ? errno : 0;
+				slot->result = ret;
+				break;
+			}
+
+		case AGENT_OP_INTERPOSE:
+			slot->result = (uintptr_t) interpose_by_address64((void*) args[0], (void*) slot->function);
+			break;
+
+		case AGENT_OP_UNINTERPOSE:
+			uninterpose64((void*) slot->function);
+			slot->result = 0;
+			break;
+
+		default:
+			slot->error = EINVAL;
+			slot->result = -1;
+	}
+}
+
+static void* service(void* arg)
+{
+	(void) arg;
+
+	int idle = 0;
+
+	// polling only pays off if the controller can run at the same time
+	int idle_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? AGENT_IDLE_SPINS : 0;
+
+	while(!stopping)
+	{
+		uint32_t doorbell = __atomic_load_n(&ring->doorbell, __ATOMIC_SEQ_CST);
+		int found = 0;
+
+		int i;
+		for(i = 0; i < AGENT_RING_SLOTS; i++)
+		{
+			// claim the request, so that the controller can't cancel it under us
+			AgentSlot* slot = &ring->slots[i];
+			uint32_t expected = AGENT_SLOT_SUBMITTED;
+			if(!__atomic_compare_exchange_n(&slot->state, &expected, AGENT_SLOT_RUNNING,
+						0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				continue;
+
+			execute(slot);
+
+			// a controller that gave up waiting left the slot for us to free
+			expected = AGENT_SLOT_RUNNING;
+			if(!__atomic_compare_exchange_n(&slot->state, &expected, AGENT_SLOT_DONE,
+						0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+				__atomic_store_n(&slot->state, AGENT_SLOT_FREE, __ATOMIC_RELEASE);
+
+			__atomic_add_fetch(&ring->completions, 1, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST))
+				futex(&ring->completions, FUTEX_WAKE, INT_MAX);
+
+			found = 1;
+		}
+
+		if(found)
+		{
+			idle = 0;
+			continue;
+		}
+
+		if(++idle < idle_spins)
+		{
+			__builtin_ia32_pause();
+			continue;
+		}
+
+		// nothing to do for a while, sleep until the doorbell rings
+		__atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&ring->doorbell, __ATOMIC_SEQ_CST) == doorbell && !stopping)
+			futex(&ring->doorbell, FUTEX_WAIT, doorbell);
+		__atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+void __attribute__ ((constructor)) agent_init()
+{
+	char name[PATH_MAX];
+	agent_ring_name(getpid(), name, sizeof(name));
+
+	// The name is predictable and /dev/shm is shared by everyone, so only serve an object we created.
+	// A leftover from an earlier agent of ours can be removed; somebody else's can't, and then we don't run.
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd == -1 && errno == EEXIST && shm_unlink(name) == 0)
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+	if(fd == -1)
+		return;
+
+	struct stat st;
+	if(fstat(fd, &st) == -1 || st.st_uid != geteuid() || (st.st_mode & 077))
+	{
+		close(fd);
+		return;
+	}
+
+	if(ftruncate(fd, sizeof(AgentRing)) == -1)
+	{
+		close(fd);
+		shm_unlink(name);
+		return;
+	}
+
+	ring = (AgentRing*) mmap(NULL, sizeof(AgentRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(ring == MAP_FAILED)
+	{
+		ring = NULL;
+		shm_unlink(name);
+		return;
+	}
+
+	ring->version = AGENT_VERSION;
+
+	if(pthread_create(&service_thread, NULL, service, NULL) != 0)
+	{
+		munmap(ring, sizeof(AgentRing));
+		ring = NULL;
+		shm_unlink(name);
+		return;
+	}
+
+	// publish the ring only once somebody is serving it
+	__atomic_store_n(&ring->magic, AGENT_MAGIC, __ATOMIC_RELEASE);
+}
+
+void __attribute__ ((destructor)) agent_fini()
+{
+	if(!ring)
+		return;
+
+	char name[PATH_MAX];
+	agent_ring_name(getpid(), name, sizeof(name));
+	shm_unlink(name);
+
+	stopping = 1;
+	__atomic_add_fetch(&ring->doorbell, 1, __ATOMIC_SEQ_CST);
+	futex(&ring->doorbell, FUTEX_WAKE, 1);
+	pthread_join(service_thread, NULL);
+
+	munmap(ring, sizeof(AgentRing));
+	ring = NULL;
+}
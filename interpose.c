@@ -63,10 +63,25 @@ void __attribute__ ((constructor)) interpose_init()
 	//*relocation = fake_write;
 }
 
+void* lcitk_reload_export()
+{
+	// hand do_loop back to the next build; there is no state to speak of
+	uninterpose64(real_do_loop);
+	real_do_loop = NULL;
+	return NULL;
+}
+
+void lcitk_reload_import(void* state)
+{
+	if(!real_do_loop)
+		real_do_loop = interpose_by_name64(&do_loop_interpose, "", "do_loop");
+}
+
 void __attribute__ ((destructor)) interpose_fini()
 {
 	//printf("uninterposing...\n");
-	uninterpose64(real_do_loop);
+	if(real_do_loop)
+		uninterpose64(real_do_loop);
 	//printf("removed.\n");
 	//*relocation = real_write;
 }
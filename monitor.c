@@ -0,0 +1,433 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "monitor.h"
+#include "process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/resource.h>
+
+#if __WORDSIZE == 64
+#define IP(x) (x).rip
+#define FP(x) (x).rbp
+#else
+#define IP(x) (x).eip
+#define FP(x) (x).ebp
+#endif
+
+// A thread monitor samples the /proc files of every thread of a process and reports the difference from
+// the previous sample. To be cheap enough to run ten times a second over thousands of threads, it keeps
+// each thread's files open and rereads them with pread, which regenerates their contents without a path
+// lookup or a new open file each time. Only as many files are kept open as our descriptor limit allows;
+// threads past that open and close their files at each sample.
+
+#define TASK_STAT 0
+#define TASK_SCHEDSTAT 1
+#define TASK_STATUS 2
+#define TASK_SYSCALL 3
+#define TASK_FILES 4
+
+#define MONITOR_RESERVED_FDS 64		/// Descriptors left for everything else in our process.
+
+static const char* task_files[TASK_FILES] = { "stat", "schedstat", "status", "syscall" };
+
+/**
+ * What a monitor remembers about a thread from one sample to the next.
+ *
+ */
+typedef struct MonitoredThread
+{
+	int tid;
+	int fds[TASK_FILES];			/// Open task files, -1 if closed.
+	uint64_t cpu_ticks;			/// utime + stime.
+	uint64_t run_ns;			/// Time on a CPU, from schedstat.
+	uint64_t wait_ns;			/// Time runnable but waiting, from schedstat.
+	uint64_t voluntary_switches;
+	uint64_t involuntary_switches;
+	int sampled;				/// Nonzero once the thread's files have all been read.
+	ThreadSample last;			/// The thread's last full sample, for its name, state and system call.
+} MonitoredThread;
+
+/**
+ *  Samples the threads of one process.
+ */
+struct ThreadMonitor
+{
+	int process;				/// The process.
+	MonitoredThread* threads;		/// Threads as of the last sample, sorted by tid.
+	int num_threads;
+	ThreadSample* samples;			/// What the last sample found, in the same order.
+	int num_open;				/// Task files we hold open.
+	int max_open;				/// Task files we may hold open.
+	struct timespec last;			/// When the last sample was taken.
+	long ticks_per_second;
+};
+
+static void close_thread_files(ThreadMonitor* monitor, MonitoredThread* thread)
+{
+	int i;
+	for(i = 0; i < TASK_FILES; i++)
+	{
+		if(thread->fds[i] != -1)
+		{
+			close(thread->fds[i]);
+			thread->fds[i] = -1;
+			--monitor->num_open;
+		}
+	}
+}
+
+/**
+ *  Reads one of a thread's task files into buf, keeping it open if we can afford to.
+ *
+ *  @return
+ *  	The number of bytes read, which are followed by a terminating null, or -1 on error.
+ *
+ */
+static ssize_t read_task_file(ThreadMonitor* monitor, MonitoredThread* thread, int file, char* buf, size_t size)
+{
+	int fd = thread->fds[file];
+	if(fd == -1)
+	{
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "/proc/%d/task/%d/%s", monitor->process, thread->tid, task_files[file]);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if(fd == -1)
+			return -1;
+
+		if(monitor->num_open < monitor->max_open)
+		{
+			thread->fds[file] = fd;
+			++monitor->num_open;
+		}
+	}
+
+	ssize_t got = pread(fd, buf, size - 1, 0);
+	if(thread->fds[file] != fd)
+		close(fd);
+
+	buf[got > 0 ? got : 0] = '\0';
+	return got;
+}
+
+static uint64_t status_field(const char* status, const char* name)
+{
+	const char* field = strstr(status, name);
+	return field ? strtoull(field + strlen(name), NULL, 10) : 0;
+}
+
+/**
+ *  Reads a thread's files, fills in its sample from the difference to what we had before and remembers
+ *  what was read. Threads that appeared since the last sample start from zero, which is right: everything
+ *  they did, they did since then.
+ *
+ *  Most threads of a big process are blocked most of the time, and a thread that hasn't run since the
+ *  last sample can't have used CPU, switched or entered another system call. schedstat is by far the
+ *  cheapest file to generate, so it is read first and the others only if the thread ran.
+ *
+ *  @return
+ *  	1 if the thread could be sampled, 0 if it has exited.
+ *
+ */
+static int sample_thread(ThreadMonitor* monitor, MonitoredThread* thread, ThreadSample* sample, uint64_t elapsed)
+{
+	char buf[4096];
+	memset(sample, 0, sizeof(*sample));
+	sample->tid = thread->tid;
+
+	double interval = elapsed > 0 ? (double) elapsed : 1.0;
+
+	// schedstat counts in nanoseconds rather than clock ticks, when the kernel has it
+	unsigned long long run_ns;
+	unsigned long long wait_ns;
+	int have_schedstat = read_task_file(monitor, thread, TASK_SCHEDSTAT, buf, sizeof(buf)) > 0
+			&& sscanf(buf, "%llu %llu", &run_ns, &wait_ns) == 2;
+	if(have_schedstat)
+	{
+		sample->cpu = 100.0 * (run_ns - thread->run_ns) / interval;
+		sample->wait = 100.0 * (wait_ns - thread->wait_ns) / interval;
+
+		int ran = run_ns != thread->run_ns;
+		thread->run_ns = run_ns;
+		thread->wait_ns = wait_ns;
+
+		if(thread->sampled && !ran)
+		{
+			memcpy(sample->name, thread->last.name, sizeof(sample->name));
+			sample->state = thread->last.state;
+			sample->syscall = thread->last.syscall;
+			return 1;
+		}
+	}
+
+	// the command name can contain anything, including parentheses, so parse from the last one
+	if(read_task_file(monitor, thread, TASK_STAT, buf, sizeof(buf)) <= 0)
+		return 0;
+
+	char* name = strchr(buf, '(');
+	char* fields = strrchr(buf, ')');
+	unsigned long long utime;
+	unsigned long long stime;
+	if(!name || !fields || sscanf(fields + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+				&sample->state, &utime, &stime) != 3)
+		return 0;
+
+	size_t name_length = fields - name - 1 < sizeof(sample->name) - 1 ? fields - name - 1 : sizeof(sample->name) - 1;
+	memcpy(sample->name, name + 1, name_length);
+
+	uint64_t ticks = utime + stime;
+	if(!have_schedstat)
+		sample->cpu = 100.0 * (ticks - thread->cpu_ticks) * (1000000000.0 / monitor->ticks_per_second) / interval;
+
+	thread->cpu_ticks = ticks;
+
+	if(read_task_file(monitor, thread, TASK_STATUS, buf, sizeof(buf)) > 0)
+	{
+		uint64_t voluntary = status_field(buf, "\nvoluntary_ctxt_switches:");
+		uint64_t involuntary = status_field(buf, "\nnonvoluntary_ctxt_switches:");
+		sample->voluntary_switches = voluntary - thread->voluntary_switches;
+		sample->involuntary_switches = involuntary - thread->involuntary_switches;
+		thread->voluntary_switches = voluntary;
+		thread->involuntary_switches = involuntary;
+	}
+
+	sample->syscall = THREAD_SYSCALL_UNKNOWN;
+	if(read_task_file(monitor, thread, TASK_SYSCALL, buf, sizeof(buf)) > 0)
+	{
+		if(strncmp(buf, "running", sizeof("running") - 1) == 0)
+			sample->syscall = THREAD_RUNNING;
+		else
+			sscanf(buf, "%ld", &sample->syscall);
+	}
+
+	thread->sampled = 1;
+	thread->last = *sample;
+	return 1;
+}
+
+static int compare_tids(const void* a, const void* b)
+{
+	return *(const int*) a - *(const int*) b;
+}
+
+/**
+ *  Start monitoring the threads of a process. This takes the first sample, which later samples are
+ *  compared with. Task files are kept open as far as the current RLIMIT_NOFILE soft limit allows; threads
+ *  beyond that are sampled by opening their files each time.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	A handle to the monitor, or NULL if the process's threads cannot be read.
+ *
+ */
+ThreadMonitor* open_thread_monitor(int process)
+{
+	ThreadMonitor* monitor = (ThreadMonitor*) calloc(1, sizeof(ThreadMonitor));
+	monitor->process = process;
+	monitor->ticks_per_second = sysconf(_SC_CLK_TCK);
+
+	// keeping files open is what makes sampling cheap, so use the descriptors we are allowed. The limit
+	// is the caller's to raise; it applies to the whole process.
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		if(limit.rlim_cur > MONITOR_RESERVED_FDS)
+			monitor->max_open = limit.rlim_cur - MONITOR_RESERVED_FDS < INT_MAX
+					? limit.rlim_cur - MONITOR_RESERVED_FDS : INT_MAX;
+	}
+
+	ThreadSample* samples;
+	if(sample_threads(monitor, &samples, NULL) < 0)
+	{
+		close_thread_monitor(monitor);
+		return NULL;
+	}
+
+	return monitor;
+}
+
+/**
+ *  Stop monitoring a process, closing its task files.
+ *
+ *  @param[in] monitor
+ *  	The monitor returned by open_thread_monitor.
+ *
+ */
+void close_thread_monitor(ThreadMonitor* monitor)
+{
+	int i;
+	for(i = 0; i < monitor->num_threads; i++)
+		close_thread_files(monitor, &monitor->threads[i]);
+
+	free(monitor->threads);
+	free(monitor->samples);
+	free(monitor);
+}
+
+/**
+ *  Sample every thread of the process.
+ *
+ *  @param[in] monitor
+ *  	The monitor returned by open_thread_monitor.
+ *
+ *  @param[out] samples
+ *  	Set to what each thread did since the previous sample, sorted by thread ID. The array belongs to the
+ *  	monitor and is valid until the next sample.
+ *
+ *  @param[out] elapsed
+ *  	Set to the nanoseconds since the previous sample, if not NULL.
+ *
+ *  @return
+ *  	The number of threads sampled, or -1 if the process's threads cannot be read.
+ *
+ */
+int sample_threads(ThreadMonitor* monitor, ThreadSample** samples, uint64_t* elapsed)
+{
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "/proc/%d/task", monitor->process);
+	DIR* tasks = opendir(buf);
+	if(!tasks)
+		return -1;
+
+	int num_tids = 0;
+	int capacity = monitor->num_threads + 16;
+	int* tids = (int*) malloc(capacity * sizeof(int));
+
+	struct dirent* entry;
+	while((entry = readdir(tasks)) != NULL)
+	{
+		int tid = atoi(entry->d_name);
+		if(tid <= 0)
+			continue;
+
+		if(num_tids == capacity)
+		{
+			capacity *= 2;
+			tids = (int*) realloc(tids, capacity * sizeof(int));
+		}
+
+		tids[num_tids++] = tid;
+	}
+
+	closedir(tasks);
+	qsort(tids, num_tids, sizeof(int), compare_tids);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t since = (now.tv_sec - monitor->last.tv_sec) * 1000000000ULL + now.tv_nsec - monitor->last.tv_nsec;
+	monitor->last = now;
+	if(elapsed)
+		*elapsed = since;
+
+	// both lists are sorted, so carry over threads we know in one pass and drop the ones that exited
+	MonitoredThread* threads = (MonitoredThread*) calloc(num_tids > 0 ? num_tids : 1, sizeof(MonitoredThread));
+	ThreadSample* thread_samples = (ThreadSample*) calloc(num_tids > 0 ? num_tids : 1, sizeof(ThreadSample));
+	int count = 0;
+	int old = 0;
+	int i;
+	for(i = 0; i < num_tids; i++)
+	{
+		while(old < monitor->num_threads && monitor->threads[old].tid < tids[i])
+			close_thread_files(monitor, &monitor->threads[old++]);
+
+		MonitoredThread* thread = &threads[count];
+		if(old < monitor->num_threads && monitor->threads[old].tid == tids[i])
+		{
+			*thread = monitor->threads[old++];
+		}
+		else
+		{
+			thread->tid = tids[i];
+			memset(thread->fds, -1, sizeof(thread->fds));
+		}
+
+		if(sample_thread(monitor, thread, &thread_samples[count], since))
+			++count;
+		else
+			close_thread_files(monitor, thread);
+	}
+
+	while(old < monitor->num_threads)
+		close_thread_files(monitor, &monitor->threads[old++]);
+
+	free(tids);
+	free(monitor->threads);
+	free(monitor->samples);
+	monitor->threads = threads;
+	monitor->samples = thread_samples;
+	monitor->num_threads = count;
+
+	*samples = thread_samples;
+	return count;
+}
+
+/**
+ *  Take a stack sample of one thread by following its frame pointers. The thread is stopped for as
+ *  long as the walk takes; the rest of the process keeps running. Code built without frame pointers
+ *  cuts the walk short.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] tid
+ *  	The thread to sample.
+ *
+ *  @param[out] frames
+ *  	The instruction pointer, then the return address of each frame.
+ *
+ *  @param[in] max_frames
+ *  	Number of entries in frames.
+ *
+ *  @return
+ *  	The number of frames found, or -1 if the thread could not be stopped.
+ *
+ */
+int sample_stack(int process, int tid, uintptr_t* frames, int max_frames)
+{
+	ProcessSession* session = open_thread_session(process, tid, SESSION_NO_CALLS);
+	if(!session)
+		return -1;
+
+	struct user_regs_struct regs;
+	if(ptrace(PTRACE_GETREGS, tid, NULL, &regs) == -1)
+	{
+		close_process_session(session);
+		return -1;
+	}
+
+	int count = 0;
+	if(count < max_frames)
+		frames[count++] = IP(regs);
+
+	// each frame starts with the caller's frame pointer, followed by the return address
+	uintptr_t fp = FP(regs);
+	while(count < max_frames && fp && !(fp & (sizeof(uintptr_t) - 1)))
+	{
+		uintptr_t frame[2];
+		RemoteIOVec vec = { fp, sizeof(frame), frame, 0 };
+		if(process_readv(process, &vec, 1) != 1 || !frame[1])
+			break;
+
+		frames[count++] = frame[1];
+
+		// stacks grow down, so callers' frames are at higher addresses
+		if(frame[0] <= fp)
+			break;
+
+		fp = frame[0];
+	}
+
+	close_process_session(session);
+	return count;
+}
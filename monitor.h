@@ -0,0 +1,34 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct ThreadMonitor;
+typedef struct ThreadMonitor ThreadMonitor;
+
+#define THREAD_RUNNING -1		/// ThreadSample.syscall of a thread that isn't in a system call.
+#define THREAD_SYSCALL_UNKNOWN -2	/// ThreadSample.syscall of a thread whose system call could not be read.
+
+/**
+ * What one thread did between two samples.
+ *
+ */
+typedef struct ThreadSample
+{
+	int tid;				/// The thread.
+	char name[16];				/// Its command name.
+	char state;				/// Its state as /proc shows it: R, S, D, ...
+	double cpu;				/// Percentage of one CPU it used.
+	double wait;				/// Percentage of the time it was runnable but waiting for a CPU.
+	uint64_t voluntary_switches;		/// Times it blocked.
+	uint64_t involuntary_switches;		/// Times it was preempted.
+	long syscall;				/// The system call it is in, THREAD_RUNNING or THREAD_SYSCALL_UNKNOWN.
+} ThreadSample;
+
+ThreadMonitor* open_thread_monitor(int process);
+void close_thread_monitor(ThreadMonitor* monitor);
+int sample_threads(ThreadMonitor* monitor, ThreadSample** samples, uint64_t* elapsed);
+int sample_stack(int process, int tid, uintptr_t* frames, int max_frames);
+
+#endif
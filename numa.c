@@ -0,0 +1,449 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "numa.h"
+#include "objdump.h"
+#include "process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+// Which node a page of another process is on comes from move_pages(2) with no target nodes, which only
+// reports; the same call with target nodes migrates. The C library doesn't wrap it (libnuma does), so it
+// is called directly. numa_maps adds each mapping's memory policy, and stands in for move_pages on
+// kernels that can't answer it. Most of a process's address space is usually not resident at all, so
+// residency reports ask pagemap which pages are before asking move_pages where they are.
+
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+#define NUMA_BATCH 1024			/// Pages per move_pages call.
+
+#define PAGEMAP_PRESENT (1ULL << 63)		/// pagemap entry bit of a page that is in memory.
+
+/**
+ *  Reads the list of online NUMA nodes of this machine.
+ *
+ *  @param[in] node
+ *  	A node to look for in the list, or -1.
+ *
+ *  @param[out] online
+ *  	If not NULL, set to whether node is in the list.
+ *
+ *  @return
+ *  	The highest node number in the list plus one, 1 if there is no list.
+ *
+ */
+static int read_online_nodes(int node, int* online)
+{
+	FILE* file = fopen("/sys/devices/system/node/online", "r");
+	if(!file)
+	{
+		// not NUMA at all, so everything is on node 0
+		if(online)
+			*online = (node == 0);
+
+		return 1;
+	}
+
+	if(online)
+		*online = 0;
+
+	// a list of ranges such as 0-1,3, which can have gaps
+	int highest = 0;
+	int first;
+	int last;
+	char separator;
+	while(fscanf(file, "%d", &first) == 1)
+	{
+		last = first;
+		if(fscanf(file, "%c", &separator) == 1 && separator == '-')
+		{
+			if(fscanf(file, "%d", &last) != 1)
+				break;
+
+			if(fscanf(file, "%c", &separator) != 1)
+				separator = '\n';
+		}
+
+		if(last > highest)
+			highest = last;
+
+		if(online && node >= first && node <= last)
+			*online = 1;
+
+		if(separator != ',')
+			break;
+	}
+
+	fclose(file);
+	return highest + 1;
+}
+
+/**
+ *  Returns the number of NUMA nodes of this machine, as the highest node number plus one. This is 1 on
+ *  machines that aren't NUMA at all. Nodes below it are not necessarily online; see numa_node_online.
+ *
+ */
+int numa_nodes()
+{
+	return read_online_nodes(-1, NULL);
+}
+
+/**
+ *  Returns whether a NUMA node of this machine is online, and so can have memory moved to it.
+ *
+ *  @param[in] node
+ *  	The node number.
+ *
+ */
+int numa_node_online(int node)
+{
+	int online;
+	read_online_nodes(node, &online);
+	return online;
+}
+
+/**
+ *  Lists the pages of a range.
+ *
+ */
+static void page_range(void** pages, uintptr_t start, int count)
+{
+	int page_size = sysconf(_SC_PAGE_SIZE);
+	int i;
+	for(i = 0; i < count; i++)
+		pages[i] = (void*) (start + (uintptr_t) i * page_size);
+}
+
+/**
+ *  Lists the pages of a range that are in memory, according to a process's pagemap.
+ *
+ *  @return
+ *  	The number of pages listed, or -1 if pagemap could not be read.
+ *
+ */
+static int present_pages(int pagemap, void** pages, uintptr_t start, int count)
+{
+	int page_size = sysconf(_SC_PAGE_SIZE);
+	uint64_t entries[NUMA_BATCH];
+	off_t offset = (off_t) (start / page_size) * sizeof(uint64_t);
+	if(pread(pagemap, entries, count * sizeof(uint64_t), offset) != (ssize_t) (count * sizeof(uint64_t)))
+		return -1;
+
+	int present = 0;
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		if(entries[i] & PAGEMAP_PRESENT)
+			pages[present++] = (void*) (start + (uintptr_t) i * page_size);
+	}
+
+	return present;
+}
+
+/**
+ *  Asks the kernel where a batch of pages is, or moves them to a node.
+ *
+ *  @return
+ *  	0 on success, -1 with errno set otherwise.
+ *
+ */
+static long move_pages_batch(int process, void** pages, int count, int node, int* status)
+{
+	int nodes[NUMA_BATCH];
+	int i;
+	for(i = 0; i < count; i++)
+		nodes[i] = node;
+
+	return syscall(SYS_move_pages, process, (unsigned long) count, pages, node < 0 ? NULL : nodes, status,
+			node < 0 ? 0 : MPOL_MF_MOVE);
+}
+
+/**
+ *  Find which node each page of a range of a process's memory is on.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] start
+ *  	Start of the range. It is rounded down to a page.
+ *
+ *  @param[in] length
+ *  	Length of the range in bytes.
+ *
+ *  @param[out] nodes
+ *  	For each page, its node, or a negative errno: -ENOENT for a page that isn't resident, -EFAULT for
+ *  	one that isn't mapped. It needs room for one entry per page the range touches.
+ *
+ *  @return
+ *  	The number of pages, or -1 if the kernel could not be asked.
+ *
+ */
+int query_page_nodes(int process, uintptr_t start, size_t length, int* nodes)
+{
+	uintptr_t page_size = sysconf(_SC_PAGE_SIZE);
+	uintptr_t first = start & ~(page_size - 1);
+	int count = (int) ((start + length - first + page_size - 1) / page_size);
+
+	void* pages[NUMA_BATCH];
+	int done;
+	for(done = 0; done < count; done += NUMA_BATCH)
+	{
+		int batch = count - done < NUMA_BATCH ? count - done : NUMA_BATCH;
+		page_range(pages, first + done * page_size, batch);
+		if(move_pages_batch(process, pages, batch, -1, nodes + done) == -1)
+		{
+			fprintf(stderr, "Error: cannot query the pages of process %d: %s\n", process, strerror(errno));
+			return -1;
+		}
+	}
+
+	return count;
+}
+
+/**
+ *  Fills in the policy of each mapping from numa_maps, and its residency too if move_pages isn't
+ *  available. numa_maps lists the same mappings as maps, in the same order, by start address.
+ *
+ */
+static void read_numa_maps(int process, NumaMapping* mappings, int count, int counts_too)
+{
+	char buf[PATH_MAX + 256];
+	snprintf(buf, sizeof(buf), "/proc/%d/numa_maps", process);
+	FILE* file = fopen(buf, "r");
+	if(!file)
+		return;
+
+	int current = 0;
+	while(fgets(buf, sizeof(buf), file) != NULL)
+	{
+		unsigned long long start;
+		char policy[32];
+		int consumed;
+		if(sscanf(buf, "%llx %31s%n", &start, policy, &consumed) != 2)
+			continue;
+
+		while(current < count && mappings[current].start < start)
+			++current;
+
+		if(current == count)
+			break;
+
+		NumaMapping* mapping = &mappings[current];
+		if(mapping->start != start)
+			continue;
+
+		strcpy(mapping->policy, policy);
+		if(!counts_too)
+			continue;
+
+		// pages resident on each node are listed as N<node>=<pages>
+		unsigned long resident = 0;
+		char* saveptr;
+		char* token;
+		for(token = strtok_r(buf + consumed, " \n", &saveptr); token; token = strtok_r(NULL, " \n", &saveptr))
+		{
+			int node;
+			unsigned long pages;
+			if(sscanf(token, "N%d=%lu", &node, &pages) == 2 && node >= 0 && node < NUMA_MAX_NODES)
+			{
+				mapping->pages[node] = pages;
+				resident += pages;
+			}
+		}
+
+		unsigned long total = (mapping->end - mapping->start) / sysconf(_SC_PAGE_SIZE);
+		mapping->absent = total > resident ? total - resident : 0;
+	}
+
+	fclose(file);
+}
+
+/**
+ *  Find how many pages of each mapping of a process are on each NUMA node.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[out] mappings
+ *  	Set to an array of the process's mappings, in address order. This must be freed by the caller.
+ *
+ *  @return
+ *  	The number of mappings, or -1 if the process's mappings cannot be read.
+ *
+ */
+int query_numa_residency(int process, NumaMapping** mappings)
+{
+	MemoryRegion* regions;
+	int num_regions = find_memory_regions(process, &regions);
+	if(num_regions < 0)
+		return -1;
+
+	*mappings = (NumaMapping*) calloc(num_regions > 0 ? num_regions : 1, sizeof(NumaMapping));
+	int count = 0;
+	int i;
+	for(i = 0; i < num_regions; i++)
+	{
+		// the kernel's own pages have no node to speak of
+		MemoryRegion* region = &regions[i];
+		if(strncmp(region->path, "[vvar", 5) == 0 || strcmp(region->path, "[vsyscall]") == 0)
+			continue;
+
+		NumaMapping* mapping = &(*mappings)[count++];
+		mapping->start = region->start;
+		mapping->end = region->end;
+		strcpy(mapping->permissions, region->permissions);
+		strcpy(mapping->path, region->path);
+	}
+
+	free(regions);
+
+	// without pagemap, every page is asked about
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "/proc/%d/pagemap", process);
+	int pagemap = open(buf, O_RDONLY | O_CLOEXEC);
+
+	int page_size = sysconf(_SC_PAGE_SIZE);
+	void* pages[NUMA_BATCH];
+	int status[NUMA_BATCH];
+	int have_move_pages = 1;
+	for(i = 0; i < count && have_move_pages; i++)
+	{
+		NumaMapping* mapping = &(*mappings)[i];
+
+		// guard pages and reservations can't have been touched
+		if(mapping->permissions[0] != 'r')
+		{
+			mapping->absent = (mapping->end - mapping->start) / page_size;
+			continue;
+		}
+
+		uintptr_t addr;
+		for(addr = mapping->start; addr < mapping->end; addr += (uintptr_t) NUMA_BATCH * page_size)
+		{
+			int batch = (mapping->end - addr) / page_size < NUMA_BATCH ? (mapping->end - addr) / page_size : NUMA_BATCH;
+			int present = pagemap == -1 ? -1 : present_pages(pagemap, pages, addr, batch);
+			if(present == -1)
+			{
+				page_range(pages, addr, batch);
+				present = batch;
+			}
+
+			mapping->absent += batch - present;
+			if(present == 0)
+				continue;
+
+			if(move_pages_batch(process, pages, present, -1, status) == -1)
+			{
+				// a kernel without NUMA support; numa_maps still has what it knows
+				if(errno == ENOSYS)
+				{
+					have_move_pages = 0;
+					break;
+				}
+
+				mapping->absent += present;
+				continue;
+			}
+
+			int j;
+			for(j = 0; j < present; j++)
+			{
+				if(status[j] >= 0 && status[j] < NUMA_MAX_NODES)
+					++mapping->pages[status[j]];
+				else
+					++mapping->absent;
+			}
+		}
+	}
+
+	if(pagemap != -1)
+		close(pagemap);
+
+	if(!have_move_pages)
+	{
+		for(i = 0; i < count; i++)
+		{
+			memset((*mappings)[i].pages, 0, sizeof((*mappings)[i].pages));
+			(*mappings)[i].absent = 0;
+		}
+	}
+
+	read_numa_maps(process, *mappings, count, !have_move_pages);
+
+	return count;
+}
+
+/**
+ *  Move a range of a process's memory to a NUMA node. Pages shared with other processes, such as those
+ *  of libraries, stay where they are, as do pages that aren't resident.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] start
+ *  	Start of the range. It is rounded down to a page.
+ *
+ *  @param[in] length
+ *  	Length of the range in bytes.
+ *
+ *  @param[in] node
+ *  	The node to move the range to.
+ *
+ *  @return
+ *  	The number of pages of the range that are on the node afterwards, or -1 on error.
+ *
+ */
+long migrate_range(int process, uintptr_t start, size_t length, int node)
+{
+	// moving pages doesn't change what the process sees, but it stalls the process while it happens
+	if(process_policy() & POLICY_OBSERVE_ONLY)
+	{
+		fprintf(stderr, "Error: not migrating pages of process %d, which is only being observed!\n", process);
+		return -1;
+	}
+
+	if(!numa_node_online(node))
+	{
+		fprintf(stderr, "Error: there is no online NUMA node %d!\n", node);
+		return -1;
+	}
+
+	uintptr_t page_size = sysconf(_SC_PAGE_SIZE);
+	uintptr_t first = start & ~(page_size - 1);
+	long count = (long) ((start + length - first + page_size - 1) / page_size);
+
+	void* pages[NUMA_BATCH];
+	int status[NUMA_BATCH];
+	long moved = 0;
+	long done;
+	for(done = 0; done < count; done += NUMA_BATCH)
+	{
+		int batch = count - done < NUMA_BATCH ? count - done : NUMA_BATCH;
+		page_range(pages, first + done * page_size, batch);
+
+		// a positive return is the number of pages that could not be moved, which status tells us anyway
+		if(move_pages_batch(process, pages, batch, node, status) < 0)
+		{
+			fprintf(stderr, "Error: cannot migrate pages of process %d: %s\n", process, strerror(errno));
+			return -1;
+		}
+
+		int i;
+		for(i = 0; i < batch; i++)
+		{
+			if(status[i] == node)
+				++moved;
+		}
+	}
+
+	return moved;
+}
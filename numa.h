@@ -0,0 +1,31 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+#define NUMA_MAX_NODES 64		/// Nodes a residency report can tell apart.
+
+/**
+ * Where the pages of one mapping of a process are.
+ *
+ */
+typedef struct NumaMapping
+{
+	uintptr_t start;			/// First address of the mapping.
+	uintptr_t end;				/// First address past the mapping.
+	char permissions[5];			/// As in maps, e.g. "rw-p".
+	char path[PATH_MAX];			/// Mapped file or pseudo-name such as [heap], empty if anonymous.
+	char policy[32];			/// The mapping's memory policy, from numa_maps.
+	unsigned long pages[NUMA_MAX_NODES];	/// Resident pages on each node.
+	unsigned long absent;			/// Pages that aren't resident.
+} NumaMapping;
+
+int numa_nodes();
+int numa_node_online(int node);
+int query_page_nodes(int process, uintptr_t start, size_t length, int* nodes);
+int query_numa_residency(int process, NumaMapping** mappings);
+long migrate_range(int process, uintptr_t start, size_t length, int node);
+
+#endif
@@ -7,7 +7,54 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <elf.h>
+#include <link.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/**
+ * One symbol from an objdump listing of an image.
+ *
+ */
+typedef struct SymbolEntry
+{
+	char* name;				/// Symbol name, or NULL if the slot is empty.
+	uintptr_t offset;			/// Offset of the symbol from the start of the image.
+} SymbolEntry;
+
+/**
+ * A hash table of symbols, loaded from one objdump run.
+ *
+ */
+typedef struct SymbolTable
+{
+	int loaded;				/// Whether objdump has been run for this table.
+	SymbolEntry* entries;			/// Open-addressed hash table.
+	size_t capacity;			/// Number of slots in entries, always a power of two.
+	size_t count;				/// Number of slots in use.
+} SymbolTable;
+
+/**
+ * The symbols of an image file. Images are identified by their build-id where they have one, so the
+ * table is shared by every process that maps the same file, wherever it is loaded.
+ *
+ */
+typedef struct ImageSymbols
+{
+	char key[128];				/// Build-id, or the file's identity if it has none.
+	SymbolTable symbols;			/// From objdump -tT.
+	SymbolTable relocations;		/// From objdump -rR.
+	struct ImageSymbols* next;
+} ImageSymbols;
+
+// Symbol tables are also kept on disk, so a new run of lcitk doesn't have to objdump the same images again.
+#define SYMBOL_STORE_HEADER "lcitk-symbols 2"
+
+static ImageSymbols* image_symbols = NULL;
+static pthread_mutex_t image_symbols_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /**
@@ -33,12 +80,21 @@ int find_image_load_information(int process, uintptr_t elf_start, uintptr_t* ima
 {
 #if __WORDSIZE == 64
 	Elf64_Ehdr elf;
+	char phdr_guess[16 * sizeof(Elf64_Phdr)];
 #else
 	Elf32_Ehdr elf;
+	char phdr_guess[16 * sizeof(Elf32_Phdr)];
 #endif
 
-	// read the main elf header
-	process_read(process, &elf, sizeof(elf), elf_start);
+	// read the main elf header, and in the same go whatever follows it, since that
+	// is where the program headers usually are.
+	RemoteIOVec vecs[] = {
+		{ elf_start, sizeof(elf), &elf, 0 },
+		{ elf_start + sizeof(elf), sizeof(phdr_guess), phdr_guess, 0 }
+	};
+
+	if(process_readv(process, vecs, 2) < 1)
+		process_read(process, &elf, sizeof(elf), elf_start);
 
 	// fail if the ELF file doesn't match our architecture
 #if __WORDSIZE == 64
@@ -49,12 +105,16 @@ int find_image_load_information(int process, uintptr_t elf_start, uintptr_t* ima
 		return 0;
 #endif
 
-	// read end all the program headers
+	// read end all the program headers, unless we already have them
 	char* phdr_buffer;
 	int phdrs_size;
 	phdrs_size = elf.e_phentsize * elf.e_phnum;
 	phdr_buffer = (char*) malloc(phdrs_size);
-	process_read(process, phdr_buffer, phdrs_size, elf_start + elf.e_phoff);
+
+	if(elf.e_phoff == sizeof(elf) && vecs[1].result >= phdrs_size)
+		memcpy(phdr_buffer, phdr_guess, phdrs_size);
+	else
+		process_read(process, phdr_buffer, phdrs_size, elf_start + elf.e_phoff);
 
 	// find the program header that is a PT_LOAD that is responsible for loading
 	// the ELF header (which is at offset 0x0), but loop through them all if necessary
@@ -87,16 +147,16 @@ int find_image_load_information(int process, uintptr_t elf_start, uintptr_t* ima
 }
 
 /**
- *  For the specified process pid, find the address in its memory of its entry point.
+ *  For the specified process pid, find the address in its memory of the ELF header of its main executable.
  *
  *  @param[in] process
  *  	The process's PID.
  *
  *  @return
- *  	The address of the process's entry point as defined by its main executable. 0 if there was an error.
+ *  	The address of the main executable's ELF header. 0 if there was an error.
  *
  */
-uintptr_t find_process_entry_point(int process)
+static uintptr_t find_main_exe_header(int process)
 {
 	char buf[PATH_MAX];
 	char main_exe_path[PATH_MAX];
@@ -116,7 +176,7 @@ uintptr_t find_process_entry_point(int process)
 	if(!maps)
 		return 0;
 
-	intptr_t elf_start = -1;
+	uintptr_t elf_start = 0;
 	while(fgets(buf, sizeof(buf), maps) != NULL)
 	{
 		unsigned long long start;
@@ -135,8 +195,25 @@ uintptr_t find_process_entry_point(int process)
 
 	fclose(maps);
 
+	return elf_start;
+}
+
+/**
+ *  For the specified process pid, find the address in its memory of its entry point.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	The address of the process's entry point as defined by its main executable. 0 if there was an error.
+ *
+ */
+uintptr_t find_process_entry_point(int process)
+{
+	uintptr_t elf_start = find_main_exe_header(process);
+
 	// main exe entry not found. Bizarre.
-	if(elf_start == -1)
+	if(!elf_start)
 		return 0;
 
 	// find the entry point based on the main exe ELF header
@@ -147,6 +224,172 @@ uintptr_t find_process_entry_point(int process)
 	return ret;
 }
 
+/**
+ *  For the specified process pid, find the dynamic linker's debugging structure (struct r_debug), which
+ *  the linker advertises through the DT_DEBUG entry of the main executable's dynamic section.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	The address of the structure within the process. 0 if it could not be found.
+ *
+ */
+static uintptr_t find_r_debug(int process)
+{
+	uintptr_t elf_start = find_main_exe_header(process);
+	uintptr_t image_start;
+	if(!elf_start || !find_image_load_information(process, elf_start, &image_start, NULL))
+		return 0;
+
+	ElfW(Ehdr) elf;
+	process_read(process, &elf, sizeof(elf), elf_start);
+
+	int phdrs_size = elf.e_phentsize * elf.e_phnum;
+	char* phdr_buffer = (char*) malloc(phdrs_size);
+	process_read(process, phdr_buffer, phdrs_size, elf_start + elf.e_phoff);
+
+	uintptr_t dynamic = 0;
+	int i;
+	for(i = 0; i < elf.e_phnum; i++)
+	{
+		ElfW(Phdr)* phdr = (ElfW(Phdr)*)(phdr_buffer + (i * elf.e_phentsize));
+		if(phdr->p_type == PT_DYNAMIC)
+		{
+			dynamic = image_start + phdr->p_vaddr;
+			break;
+		}
+	}
+
+	free(phdr_buffer);
+
+	// statically linked, so there is no dynamic linker to ask
+	if(!dynamic)
+		return 0;
+
+	ElfW(Dyn) dyn;
+	do
+	{
+		RemoteIOVec vec = { dynamic, sizeof(dyn), &dyn, 0 };
+		if(process_readv(process, &vec, 1) != 1 || vec.result != sizeof(dyn))
+			return 0;
+
+		if(dyn.d_tag == DT_DEBUG)
+			return dyn.d_un.d_ptr;
+
+		dynamic += sizeof(dyn);
+	} while(dyn.d_tag != DT_NULL);
+
+	return 0;
+}
+
+/**
+ *  For the specified process pid, find the dlopen handle of a loaded library without asking the process for one.
+ *  dlopen hands out the address of the library's link_map, so the dynamic linker's list of loaded objects is
+ *  walked instead. Unlike calling dlopen with RTLD_NOLOAD, this does not add a reference to the library.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] path
+ *  	The full path of the library, as it was given to dlopen or as /proc/pid/maps has it. The path of
+ *  	the process's executable finds the link_map of the main program.
+ *
+ *  @return
+ *  	The library's handle within the process. NULL if the library is not loaded or the list could not be read.
+ *
+ */
+void* find_library_handle(int process, const char* path)
+{
+	uintptr_t debug = find_r_debug(process);
+	if(!debug)
+		return NULL;
+
+	// maps has resolved symlinks that the dynamic linker's names may go through, so compare files too
+	struct stat path_stat;
+	int have_stat = stat(path, &path_stat) == 0;
+
+	char exe[PATH_MAX];
+	char exe_link[PATH_MAX];
+	snprintf(exe_link, sizeof(exe_link), "/proc/%d/exe", process);
+	ssize_t exe_len = readlink(exe_link, exe, sizeof(exe) - 1);
+	exe[exe_len > 0 ? exe_len : 0] = '\0';
+
+	struct r_debug r;
+	RemoteIOVec vec = { debug, sizeof(r), &r, 0 };
+	if(process_readv(process, &vec, 1) != 1 || vec.result != sizeof(r))
+		return NULL;
+
+	uintptr_t map = (uintptr_t) r.r_map;
+	int first = 1;
+	while(map)
+	{
+		struct link_map entry;
+		char name[PATH_MAX];
+
+		RemoteIOVec entry_vec = { map, sizeof(entry), &entry, 0 };
+		if(process_readv(process, &entry_vec, 1) != 1 || entry_vec.result != sizeof(entry))
+			return NULL;
+
+		// the name may end just short of an unmapped page, so take whatever can be read of it
+		RemoteIOVec name_vec = { (uintptr_t) entry.l_name, sizeof(name) - 1, name, -1 };
+		if(entry.l_name)
+			process_readv(process, &name_vec, 1);
+
+		if(name_vec.result > 0)
+		{
+			name[name_vec.result] = '\0';
+
+			// the main program comes first and has no name
+			if(first && !name[0])
+				strcpy(name, exe);
+
+			struct stat name_stat;
+			if(strcmp(name, path) == 0 || (have_stat && name[0] && stat(name, &name_stat) == 0
+					&& name_stat.st_dev == path_stat.st_dev && name_stat.st_ino == path_stat.st_ino))
+				return (void*) map;
+		}
+
+		first = 0;
+
+		map = (uintptr_t) entry.l_next;
+	}
+
+	return NULL;
+}
+
+/**
+ *  For the specified process pid, find the path a library was loaded from given its dlopen handle.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] handle
+ *  	The library's handle within the process, that is, the address of its link_map.
+ *
+ *  @param[out] path
+ *  	The path the library was loaded from, as the dynamic linker has it.
+ *
+ *  @return
+ *  	A true value if the path was read, false for failure. The main program has no path of its own here.
+ *
+ */
+int find_library_path(int process, void* handle, char path[PATH_MAX])
+{
+	struct link_map entry;
+	RemoteIOVec entry_vec = { (uintptr_t) handle, sizeof(entry), &entry, 0 };
+	if(!handle || process_readv(process, &entry_vec, 1) != 1 || entry_vec.result != sizeof(entry) || !entry.l_name)
+		return 0;
+
+	RemoteIOVec name_vec = { (uintptr_t) entry.l_name, PATH_MAX - 1, path, -1 };
+	process_readv(process, &name_vec, 1);
+	if(name_vec.result <= 0)
+		return 0;
+
+	path[name_vec.result] = '\0';
+	return path[0] != '\0';
+}
+
 /**
  *  For the specified process pid and object image name, return the address within the process for the start of the image.
  *
@@ -180,15 +423,27 @@ int find_image_address(int process, const char* image_name, char image_path[PATH
 	if(!maps)
 		return 0;
 
+	// Newer linkers map the ELF header in a separate read-only segment in front of the text,
+	// so remember where the start of each file (offset 0) was mapped as we go.
+	uintptr_t header_start = 0;
+	char header_path[PATH_MAX] = "";
+
 	while(fgets(buf, sizeof(buf), maps) != NULL)
 	{
 		unsigned long long start;
+		unsigned long long offset;
 		char permissions[PATH_MAX];
 		int scanned;
 
-		if((scanned = sscanf(buf, "%llx-%*x %s %*x %*s %*d %s", &start, permissions, image_path)) != 3)
+		if((scanned = sscanf(buf, "%llx-%*x %s %llx %*s %*d %s", &start, permissions, &offset, image_path)) != 4)
 			continue;
 
+		if(offset == 0)
+		{
+			header_start = start;
+			strcpy(header_path, image_path);
+		}
+
 		// we're looking for an entry that is both readable and executable
 		if(permissions[0] != 'r' || permissions[2] != 'x')
 			continue;
@@ -198,7 +453,10 @@ int find_image_address(int process, const char* image_name, char image_path[PATH
 			continue;
 
 		// this is probably it. let's use it.
-		*image_start = start;
+		if(offset != 0 && strcmp(header_path, image_path) == 0)
+			*image_start = header_start;
+		else
+			*image_start = start - offset;
 		break;
 	}
 
@@ -214,6 +472,72 @@ int find_image_address(int process, const char* image_name, char image_path[PATH
 	return 1;
 }
 
+/**
+ *  For the specified process pid, list every memory mapping in its address space.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[out] regions
+ *  	Set to a malloc'd array of the mappings, in address order. This must be freed by the caller.
+ *
+ *  @return
+ *  	The number of mappings, or -1 if the process's maps could not be read.
+ *
+ */
+int find_memory_regions(int process, MemoryRegion** regions)
+{
+	char buf[PATH_MAX + 128];
+
+	snprintf(buf, sizeof(buf), "/proc/%d/maps", process);
+
+	FILE* maps = fopen(buf, "r");
+	if(!maps)
+		return -1;
+
+	int count = 0;
+	int capacity = 64;
+	*regions = (MemoryRegion*) malloc(sizeof(MemoryRegion) * capacity);
+
+	while(fgets(buf, sizeof(buf), maps) != NULL)
+	{
+		unsigned long long start;
+		unsigned long long end;
+		unsigned long long offset;
+		char permissions[8];
+		int path_start = 0;
+
+		if(sscanf(buf, "%llx-%llx %7s %llx %*s %*d %n", &start, &end, permissions, &offset, &path_start) != 4)
+			continue;
+
+		if(count == capacity)
+		{
+			capacity *= 2;
+			*regions = (MemoryRegion*) realloc(*regions, sizeof(MemoryRegion) * capacity);
+		}
+
+		MemoryRegion* region = &(*regions)[count++];
+		region->start = start;
+		region->end = end;
+		region->offset = offset;
+		strncpy(region->permissions, permissions, sizeof(region->permissions) - 1);
+		region->permissions[sizeof(region->permissions) - 1] = '\0';
+
+		// anonymous mappings have no path at all
+		region->path[0] = '\0';
+		if(path_start)
+		{
+			strncpy(region->path, buf + path_start, sizeof(region->path) - 1);
+			region->path[sizeof(region->path) - 1] = '\0';
+			region->path[strcspn(region->path, "\n")] = '\0';
+		}
+	}
+
+	fclose(maps);
+
+	return count;
+}
+
 /**
  *  For the specified process pid and address, return the image that contains the address in range.
  *
@@ -246,6 +570,7 @@ int find_image_for_address(int process, void* address, char image_path[PATH_MAX]
 	uintptr_t iAddress = (uintptr_t) address;
 
 	*image_start = 0;
+	*range_start = 0;
 
 	// The first step is to find which mapping contains the address.
 
@@ -255,38 +580,74 @@ int find_image_for_address(int process, void* address, char image_path[PATH_MAX]
 	if(!maps)
 		return 0;
 
+	unsigned long long map_start = 0;
+	unsigned long long map_offset = 0;
+	char previous_path[PATH_MAX] = "";
+	unsigned long long previous_start = 0;
+	unsigned long long previous_end = 0;
+	unsigned long long previous_offset = 0;
 	while(fgets(buf, sizeof(buf), maps) != NULL)
 	{
 		unsigned long long start;
 		unsigned long long end;
-		int scanned;
+		unsigned long long offset;
+		char path[PATH_MAX];
 
-		if((scanned = sscanf(buf, "%llx-%llx %*s %*x %*s %*d %s", &start, &end, image_path)) != 3)
+		int scanned = sscanf(buf, "%llx-%llx %*s %llx %*s %*d %s", &start, &end, &offset, path);
+		if(scanned < 3)
 			continue;
 
+		if(scanned == 3)
+			path[0] = '\0';
+
 		// skip if our address is not within range
 		if(!(start <= iAddress && iAddress <= end))
+		{
+			strcpy(previous_path, path);
+			previous_start = start;
+			previous_end = end;
+			previous_offset = offset;
 			continue;
+		}
 
 		// this is probably it. let's use it.
-		*image_start = start;
 		*range_start = start;
 		*range_end = end;
+
+		// the part of a bss that isn't in the file is anonymous memory right after the image's data
+		if(!path[0] && previous_path[0] == '/' && previous_end == start)
+		{
+			strcpy(path, previous_path);
+			start = previous_start;
+			offset = previous_offset;
+		}
+		else if(!path[0])
+		{
+			break;
+		}
+
+		strcpy(image_path, path);
+		map_start = start;
+		map_offset = offset;
 		break;
 	}
 
 	fclose(maps);
 
-	if(*image_start == 0)
+	if(!map_start)
 		return 0;
 
-	// second step is to discover the offset from the start of the image the first loaded section actually is.
+	// The mapping need not start at the beginning of the file, and the image need not be loaded at the
+	// addresses its file offsets say. Find the segment the mapping is of to see how far it was moved.
 	char* symbolTable = get_command_output("/usr/bin/objdump", "/usr/bin/objdump", "-p", image_path, NULL);
+	long long shift = 0;
+	int found = 0;
 	char* symbolTableLine = strtok(symbolTable, "\n");	// TODO: Not thread-safe
 	do
 	{
 		unsigned long long offset;
 		unsigned long long vaddr;
+		unsigned long long filesz;
 
 		if(sscanf(symbolTableLine, " LOAD off 0x%llx vaddr 0x%llx paddr 0x%*x align %*s", &offset, &vaddr) != 2)
 			continue;
@@ -295,26 +656,450 @@ int find_image_for_address(int process, void* address, char image_path[PATH_MAX]
 		if((symbolTableLine = strtok(NULL, "\n")) == NULL)
 			break;
 
-		if(sscanf(symbolTableLine, " filesz 0x%*x memsz 0x%*x flags %s", buf) != 1)
+		if(sscanf(symbolTableLine, " filesz 0x%llx memsz 0x%*x flags %s", &filesz, buf) != 2)
 			continue;
 
-		// we're looking for a LOAD segment that is both readable and executable like the one in the map
-		// we probably don't need to worry about permissions here.
-		if(buf[0] != 'r' || buf[2] != 'x')
-			continue;
-
-		// we must adjust image_start by the amount the first section has shifted up from the actual start
-		// of the image.
-		*image_start -= vaddr - offset;		
-		break;
+		// the segment whose pages the mapping maps, or failing that the first executable one
+		int contains = (offset & ~((unsigned long long) sysconf(_SC_PAGE_SIZE) - 1)) <= map_offset
+				&& map_offset < offset + filesz;
+		if(contains || (!found && buf[0] == 'r' && buf[2] == 'x'))
+		{
+			shift = vaddr - offset;
+			found = 1;
+			if(contains)
+				break;
+		}
 	}
 	while((symbolTableLine = strtok(NULL, "\n")) != NULL);
 
 	free(symbolTable);
 
+	*image_start = map_start - map_offset - shift;
+
 	return 1;
 }
 
+static size_t hash_symbol_name(const char* name)
+{
+	// FNV-1a
+	size_t hash = 2166136261u;
+	while(*name)
+	{
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static SymbolEntry* find_symbol_slot(SymbolEntry* entries, size_t capacity, const char* name)
+{
+	size_t i = hash_symbol_name(name) & (capacity - 1);
+	while(entries[i].name && strcmp(entries[i].name, name) != 0)
+		i = (i + 1) & (capacity - 1);
+
+	return &entries[i];
+}
+
+/**
+ *  Adds a symbol to a table. A later symbol of the same name replaces an earlier one, which is what
+ *  scanning the whole objdump listing for the last match used to do.
+ *
+ */
+static void add_symbol(SymbolTable* table, const char* name, uintptr_t offset)
+{
+	if((table->count + 1) * 2 > table->capacity)
+	{
+		size_t capacity = table->capacity ? table->capacity * 2 : 1024;
+		SymbolEntry* entries = (SymbolEntry*) calloc(capacity, sizeof(SymbolEntry));
+
+		size_t i;
+		for(i = 0; i < table->capacity; i++)
+		{
+			if(table->entries[i].name)
+				*find_symbol_slot(entries, capacity, table->entries[i].name) = table->entries[i];
+		}
+
+		free(table->entries);
+		table->entries = entries;
+		table->capacity = capacity;
+	}
+
+	SymbolEntry* entry = find_symbol_slot(table->entries, table->capacity, name);
+	if(!entry->name)
+	{
+		entry->name = strdup(name);
+		++table->count;
+	}
+
+	entry->offset = offset;
+}
+
+/**
+ *  Works out where the symbol store keeps a listing of an image: under $LCITK_CACHE_DIR if it is set (an
+ *  empty value turns the store off), otherwise $XDG_CACHE_HOME/lcitk or ~/.cache/lcitk. The directory is
+ *  created if need be.
+ *
+ *  @return
+ *  	0 if there is nowhere to keep it, 1 on success.
+ *
+ */
+static int symbol_store_path(const char* key, int relocations, char* path, size_t size)
+{
+	char dir[PATH_MAX];
+	const char* base = getenv("LCITK_CACHE_DIR");
+	if(base)
+	{
+		if(!*base)
+			return 0;
+
+		snprintf(dir, sizeof(dir), "%s", base);
+	}
+	else if((base = getenv("XDG_CACHE_HOME")) && *base)
+	{
+		snprintf(dir, sizeof(dir), "%s/lcitk", base);
+	}
+	else if((base = getenv("HOME")) && *base)
+	{
+		snprintf(dir, sizeof(dir), "%s/.cache", base);
+		mkdir(dir, 0700);
+		snprintf(dir, sizeof(dir), "%s/.cache/lcitk", base);
+	}
+	else
+	{
+		return 0;
+	}
+
+	if(mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return 0;
+
+	// keys look like "build-id:<hex>", which makes a fine file name apart from the colons
+	int len = snprintf(path, size, "%s/", dir);
+	char* out = path + len;
+	const char* in;
+	for(in = key; *in && out < path + size - 16; in++)
+		*out++ = (*in == ':') ? '-' : *in;
+
+	snprintf(out, path + size - out, relocations ? ".relocations" : ".symbols");
+	return 1;
+}
+
+/**
+ *  Fills a symbol table from a listing saved by an earlier run.
+ *
+ *  @return
+ *  	0 if there is no usable listing, 1 on success.
+ *
+ */
+static int load_stored_symbol_table(SymbolTable* table, const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if(!file)
+		return 0;
+
+	char buf[PATH_MAX];
+	if(!fgets(buf, sizeof(buf), file) || strcmp(buf, SYMBOL_STORE_HEADER "\n") != 0)
+	{
+		fclose(file);
+		return 0;
+	}
+
+	while(fgets(buf, sizeof(buf), file))
+	{
+		unsigned long long offset;
+		char name[PATH_MAX];
+		if(sscanf(buf, "%llx %s", &offset, name) == 2)
+			add_symbol(table, name, offset);
+	}
+
+	fclose(file);
+	return 1;
+}
+
+/**
+ *  Saves a symbol table for later runs. The listing is written to a temporary file that is then renamed
+ *  into place, so other processes never see half of it.
+ *
+ */
+static void store_symbol_table(SymbolTable* table, const char* path)
+{
+	char temp[PATH_MAX];
+	snprintf(temp, sizeof(temp), "%s.%d", path, getpid());
+
+	FILE* file = fopen(temp, "w");
+	if(!file)
+		return;
+
+	fprintf(file, SYMBOL_STORE_HEADER "\n");
+
+	size_t i;
+	for(i = 0; i < table->capacity; i++)
+	{
+		if(table->entries[i].name)
+			fprintf(file, "%llx %s\n", (unsigned long long) table->entries[i].offset, table->entries[i].name);
+	}
+
+	if(fclose(file) != 0 || rename(temp, path) == -1)
+		unlink(temp);
+}
+
+/**
+ *  Fills a symbol table from the symbol store, or from objdump if the image hasn't been seen before, in
+ *  which case the listing is saved to the store.
+ *
+ *  @param[in] table
+ *  	The table to fill.
+ *
+ *  @param[in] image
+ *  	Path of the image file.
+ *
+ *  @param[in] key
+ *  	The key the image's symbols are cached under, from image_cache_key.
+ *
+ *  @param[in] relocations
+ *  	Nonzero to list the relocations of the image rather than its symbols.
+ *
+ */
+static void load_symbol_table(SymbolTable* table, const char* image, const char* key, int relocations)
+{
+	char buf[PATH_MAX];
+	char store_path[PATH_MAX];
+
+	table->loaded = 1;
+
+	int have_store = symbol_store_path(key, relocations, store_path, sizeof(store_path));
+	if(have_store && load_stored_symbol_table(table, store_path))
+		return;
+
+	// I think on the balance, it's better to use the binutils shell commands than try
+	// to do something fancy. This way we get a free disassembler and everything.
+	char* symbolTable = get_command_output("/usr/bin/objdump", "/usr/bin/objdump",
+			relocations ? "-rR" : "-tT", image, NULL);
+	if(!symbolTable)
+		return;
+
+	char* saveptr;
+	char* symbolTableLine;
+	for(symbolTableLine = strtok_r(symbolTable, "\n", &saveptr); symbolTableLine;
+			symbolTableLine = strtok_r(NULL, "\n", &saveptr))
+	{
+		unsigned long long start;
+
+		if(relocations)
+		{
+			if(sscanf(symbolTableLine, "%llx %*s %s", &start, buf) != 2)
+				continue;
+		}
+		else
+		{
+			// thread-local symbols of the static symbol table have no type, so their section comes third
+			char section[16];
+			if(sscanf(symbolTableLine, "%llx %*s %15s %*x %s", &start, section, buf) == 3
+					&& (strcmp(section, ".tdata") == 0 || strcmp(section, ".tbss") == 0))
+			{
+			}
+			// variety of line with version information
+			else if(sscanf(symbolTableLine, "%llx %*s %*s %*s %*x %*s %s", &start, buf) != 2)
+			{
+				// sometimes there's no version information
+				if(sscanf(symbolTableLine, "%llx %*s %*s %*s %*x %s", &start, buf) != 2)
+					continue;
+			}
+		}
+
+		add_symbol(table, buf, start);
+	}
+
+	free(symbolTable);
+
+	if(have_store)
+		store_symbol_table(table, store_path);
+}
+
+/**
+ *  Works out the key an image file's symbols are cached under: its GNU build-id if it has one,
+ *  otherwise the device, inode, size and modification time of the file.
+ *
+ *  @param[in] image
+ *  	Path of the image file.
+ *
+ *  @param[out] key
+ *  	Buffer for the key.
+ *
+ *  @param[in] size
+ *  	Size of the buffer.
+ *
+ *  @return
+ *  	0 if the file could not be read, 1 on success.
+ *
+ */
+static int image_cache_key(const char* image, char* key, size_t size)
+{
+	int fd = open(image, O_RDONLY);
+	if(fd == -1)
+		return 0;
+
+	struct stat st;
+	if(fstat(fd, &st) == -1)
+	{
+		close(fd);
+		return 0;
+	}
+
+	snprintf(key, size, "file:%llx:%llx:%llx:%llx", (unsigned long long) st.st_dev, (unsigned long long) st.st_ino,
+			(unsigned long long) st.st_size, (unsigned long long) st.st_mtime);
+
+#if __WORDSIZE == 64
+	Elf64_Ehdr elf;
+	Elf64_Phdr phdr;
+	Elf64_Nhdr* note;
+#else
+	Elf32_Ehdr elf;
+	Elf32_Phdr phdr;
+	Elf32_Nhdr* note;
+#endif
+
+	if(pread(fd, &elf, sizeof(elf), 0) != sizeof(elf) || memcmp(elf.e_ident, ELFMAG, SELFMAG) != 0
+			|| elf.e_phentsize != sizeof(phdr))
+	{
+		close(fd);
+		return 1;
+	}
+
+	int i;
+	for(i = 0; i < elf.e_phnum; i++)
+	{
+		if(pread(fd, &phdr, sizeof(phdr), elf.e_phoff + i * sizeof(phdr)) != sizeof(phdr))
+			break;
+
+		if(phdr.p_type != PT_NOTE || phdr.p_filesz > 0x10000)
+			continue;
+
+		char* notes = (char*) malloc(phdr.p_filesz);
+		if(pread(fd, notes, phdr.p_filesz, phdr.p_offset) != phdr.p_filesz)
+		{
+			free(notes);
+			continue;
+		}
+
+		// walk the notes in the segment, looking for the GNU build-id
+		size_t pos = 0;
+		while(pos + sizeof(*note) <= phdr.p_filesz)
+		{
+			note = (void*)(notes + pos);
+			size_t name_size = (note->n_namesz + 3) & ~3;
+			size_t desc_size = (note->n_descsz + 3) & ~3;
+			char* name = notes + pos + sizeof(*note);
+			unsigned char* desc = (unsigned char*) name + name_size;
+
+			if(pos + sizeof(*note) + name_size + desc_size > phdr.p_filesz)
+				break;
+
+			if(note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0
+					&& note->n_descsz * 2 + sizeof("build-id:") <= size)
+			{
+				char* out = key + snprintf(key, size, "build-id:");
+				size_t j;
+				for(j = 0; j < note->n_descsz; j++)
+					out += sprintf(out, "%02x", desc[j]);
+
+				free(notes);
+				close(fd);
+				return 1;
+			}
+
+			pos += sizeof(*note) + name_size + desc_size;
+		}
+
+		free(notes);
+	}
+
+	close(fd);
+	return 1;
+}
+
+/**
+ *  Looks up the offset of a symbol from the start of an image file. objdump is only run once per image
+ *  (per listing type); every other lookup, from any process that maps the same file, is a hash lookup.
+ *
+ *  @param[in] image
+ *  	Path of the image file.
+ *
+ *  @param[in] relocations
+ *  	Nonzero to look up a relocation rather than a symbol.
+ *
+ *  @param[in] func
+ *  	The name of the symbol.
+ *
+ *  @param[out] offset
+ *  	The offset of the symbol. Thread-local symbols are offsets into the image's TLS block, so 0 is a
+ *  	valid offset for them.
+ *
+ *  @return
+ *  	1 if the symbol was found, 0 otherwise.
+ *
+ */
+static int lookup_image_symbol(const char* image, int relocations, const char* func, uintptr_t* offset)
+{
+	char key[128];
+	if(!image_cache_key(image, key, sizeof(key)))
+		return 0;
+
+	pthread_mutex_lock(&image_symbols_lock);
+
+	ImageSymbols* entry;
+	for(entry = image_symbols; entry; entry = entry->next)
+	{
+		if(strcmp(entry->key, key) == 0)
+			break;
+	}
+
+	if(!entry)
+	{
+		entry = (ImageSymbols*) calloc(1, sizeof(ImageSymbols));
+		strcpy(entry->key, key);
+		entry->next = image_symbols;
+		image_symbols = entry;
+	}
+
+	SymbolTable* table = relocations ? &entry->relocations : &entry->symbols;
+
+	// loaded while holding the lock, so that many threads asking about the same image only run objdump once
+	if(!table->loaded)
+		load_symbol_table(table, image, key, relocations);
+
+	int found = 0;
+	if(table->count)
+	{
+		SymbolEntry* symbol = find_symbol_slot(table->entries, table->capacity, func);
+		if(symbol->name)
+		{
+			*offset = symbol->offset;
+			found = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&image_symbols_lock);
+
+	return found;
+}
+
+/**
+ *  Looks up the offset of a symbol from the start of an image file.
+ *
+ *  @return
+ *  	The offset of the symbol, or 0 if it was not found.
+ *
+ */
+static uintptr_t find_image_symbol(const char* image, int relocations, const char* func)
+{
+	uintptr_t offset = 0;
+	if(!lookup_image_symbol(image, relocations, func, &offset))
+		return 0;
+
+	return offset;
+}
+
 /**
  *  For the specified process pid and object image name, return the address within the process for the relocation of the named function.
  *
@@ -333,7 +1118,6 @@ int find_image_for_address(int process, void* address, char image_path[PATH_MAX]
  */
 void* find_relocation(int process, const char* image_name, const char* func)
 {
-	char buf[PATH_MAX];
 	char image[PATH_MAX];
 	uintptr_t image_start = 0;
 	uintptr_t func_start = 0;
@@ -341,25 +1125,8 @@ void* find_relocation(int process, const char* image_name, const char* func)
 	if(!find_image_address(process, image_name, image, &image_start))
 		return NULL;
 
-	// dump the relocation tables for that binary we fished out of /proc/pid/maps
-	char* symbolTable = get_command_output("/usr/bin/objdump", "/usr/bin/objdump", "-rR", image, NULL);
-	char* symbolTableLine = strtok(symbolTable, "\n");	// TODO: Not thread-safe
-	do
-	{
-		unsigned long long start;
-
-		if(sscanf(symbolTableLine, "%llx %*s %s", &start, buf) != 2)
-			continue;
-
-		// we're only interested if we have an exact match for the symbol name
-		if(strcmp(buf, func) != 0)
-			continue;
-
-		func_start = start;
-	}
-	while((symbolTableLine = strtok(NULL, "\n")) != NULL);
-
-	free(symbolTable);
+	// look it up in the relocation tables for that binary we fished out of /proc/pid/maps
+	func_start = find_image_symbol(image, 1, func);
 
 	if(func_start == 0)
 		return NULL;
@@ -389,7 +1156,6 @@ void* find_relocation(int process, const char* image_name, const char* func)
  */
 void* find_function(int process, const char* image_name, const char* func, char** image_path)
 {
-	char buf[PATH_MAX];
 	char image[PATH_MAX];
 	uintptr_t image_start = 0;
 	uintptr_t func_start = 0;
@@ -397,34 +1163,9 @@ void* find_function(int process, const char* image_name, const char* func, char*
 	if(!find_image_address(process, image_name, image, &image_start))
 		return NULL;
 
-	// second step is to find out where the function is in the libc symbol table
-	// I think on the balance, it's better to use the binutils shell commands than try
-	// to do something fancy. This way we get a free disassembler and everything.
-
-	// dump the symbol tables for that binary we fished out of /proc/pid/maps
-	char* symbolTable = get_command_output("/usr/bin/objdump", "/usr/bin/objdump", "-tT", image, NULL);
-	char* symbolTableLine = strtok(symbolTable, "\n");	// TODO: Not thread-safe
-	do
-	{
-		unsigned long long start;
-
-		// variety of line with version information
-		if(sscanf(symbolTableLine, "%llx %*s %*s %*s %*x %*s %s", &start, buf) != 2)
-		{
-			// sometimes there's no version information
-			if(sscanf(symbolTableLine, "%llx %*s %*s %*s %*x %s", &start, buf) != 2)
-				continue;
-		}
-
-		// we're only interested if we have an exact match for the symbol name
-		if(strcmp(buf, func) != 0)
-			continue;
-
-		func_start = start;
-	}
-	while((symbolTableLine = strtok(NULL, "\n")) != NULL);
-
-	free(symbolTable);
+	// second step is to find out where the function is in the symbol table of the binary
+	// we fished out of /proc/pid/maps
+	func_start = find_image_symbol(image, 0, func);
 
 	if(func_start == 0)
 		return NULL;
@@ -435,6 +1176,40 @@ void* find_function(int process, const char* image_name, const char* func, char*
 	return (void*)(image_start + func_start);
 }
 
+/**
+ *  For the specified process pid and object image name, return the value of a symbol as the image's symbol
+ *  table has it, without relocating it. This is what thread-local variables need: their symbol value is an
+ *  offset into the image's TLS block, which can be 0.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] image_name
+ *  	The name of the image to look for. Any image with image_name as a substring is matched.
+ *
+ *  @param[in] symbol
+ *  	The name of the symbol to find.
+ *
+ *  @param[out] image_path
+ *  	The full filesystem path of the image.
+ *
+ *  @param[out] offset
+ *  	The value of the symbol.
+ *
+ *  @return
+ *  	1 if the symbol was found, 0 otherwise.
+ *
+ */
+int find_symbol_offset(int process, const char* image_name, const char* symbol, char image_path[PATH_MAX],
+		uintptr_t* offset)
+{
+	uintptr_t image_start;
+	if(!find_image_address(process, image_name, image_path, &image_start))
+		return 0;
+
+	return lookup_image_symbol(image_path, 0, symbol, offset);
+}
+
 /**
  *  For the specified process pid, return the address within the process for the named libc function.
  *
@@ -452,3 +1227,95 @@ void* find_libc_function(int process, const char* func)
 {
 	return find_function(process, "/libc", func, NULL);
 }
+
+/**
+ *  For the specified process pid, return the address within the process of a function that works like dlopen.
+ *  libc's private __libc_dlopen_mode is preferred, but newer versions of glibc only have the public dlopen.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[out] mode_flags
+ *  	If not NULL, set to the extra mode flags the function found needs, which are to be or'd into the mode
+ *  	argument. The private function wants __RTLD_DLOPEN, which the public one rejects.
+ *
+ *  @return
+ *  	The address of the function within the process. NULL if nothing was found.
+ *
+ */
+void* find_libc_dlopen(int process, int* mode_flags)
+{
+	int flags = __RTLD_DLOPEN;
+	void* ret = find_libc_function(process, "__libc_dlopen_mode");
+	if(!ret)
+	{
+		flags = 0;
+		ret = find_libc_function(process, "dlopen");
+	}
+
+	if(mode_flags)
+		*mode_flags = flags;
+
+	return ret;
+}
+
+/**
+ *  For the specified process pid, return the address within the process of a function that works like dlclose.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	The address of the function within the process. NULL if nothing was found.
+ *
+ */
+void* find_libc_dlclose(int process)
+{
+	void* ret = find_libc_function(process, "__libc_dlclose");
+	if(!ret)
+		ret = find_libc_function(process, "dlclose");
+
+	return ret;
+}
+
+/**
+ *  For the specified process pid, return the address within the process of a function that works like dlsym.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	The address of the function within the process. NULL if nothing was found.
+ *
+ */
+void* find_libc_dlsym(int process)
+{
+	void* ret = find_libc_function(process, "__libc_dlsym");
+	if(!ret)
+		ret = find_libc_function(process, "dlsym");
+
+	return ret;
+}
+
+/**
+ *  For the specified process pid, find the libc functions used to load and unload libraries. Finding them can
+ *  mean running objdump over libc, so this is to be done before the process is stopped.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[out] calls
+ *  	The functions found. Those that could not be found are NULL.
+ *
+ *  @return
+ *  	1 if every function was found, 0 otherwise.
+ *
+ */
+int find_library_calls(int process, LibraryCalls* calls)
+{
+	calls->dlopen = find_libc_dlopen(process, &calls->mode_flags);
+	calls->dlclose = find_libc_dlclose(process);
+	calls->dlsym = find_libc_dlsym(process);
+
+	return calls->dlopen && calls->dlclose && calls->dlsym;
+}
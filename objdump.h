@@ -4,13 +4,49 @@
 #include <stdint.h>
 #include <limits.h>
 
+#define __RTLD_DLOPEN 0x80000000
+
+/**
+ * One mapping from /proc/pid/maps.
+ *
+ */
+typedef struct MemoryRegion
+{
+	uintptr_t start;		/// First address of the mapping.
+	uintptr_t end;			/// First address past the mapping.
+	uintptr_t offset;		/// Offset into the mapped file.
+	char permissions[5];		/// As in maps, e.g. "rw-p".
+	char path[PATH_MAX];		/// Mapped file or pseudo-name such as [heap], empty if anonymous.
+} MemoryRegion;
+
+/**
+ * The libc functions used to load and unload libraries in a process, as found by find_library_calls.
+ *
+ */
+typedef struct LibraryCalls
+{
+	void* dlopen;			/// Function that works like dlopen, or NULL.
+	int mode_flags;			/// Extra mode flags dlopen needs, see find_libc_dlopen.
+	void* dlclose;			/// Function that works like dlclose, or NULL.
+	void* dlsym;			/// Function that works like dlsym, or NULL.
+} LibraryCalls;
+
 int find_image_load_information(int process, uintptr_t elf_start, uintptr_t* image_start, uintptr_t* entry);
 uintptr_t find_process_entry_point(int process);
+void* find_library_handle(int process, const char* path);
+int find_library_path(int process, void* handle, char path[PATH_MAX]);
 int find_image_address(int process, const char* image_name, char image_path[PATH_MAX], uintptr_t* image_start);
+int find_memory_regions(int process, MemoryRegion** regions);
 int find_image_for_address(int process, void* address, char image_path[PATH_MAX], uintptr_t* image_start,
 		uintptr_t* range_start, uintptr_t* range_end);
 void* find_relocation(int process, const char* image_name, const char* func);
 void* find_function(int process, const char* image_name, const char* func, char** image_path);
+int find_symbol_offset(int process, const char* image_name, const char* symbol, char image_path[PATH_MAX],
+		uintptr_t* offset);
 void* find_libc_function(int process, const char* func);
+void* find_libc_dlopen(int process, int* mode_flags);
+void* find_libc_dlclose(int process);
+void* find_libc_dlsym(int process);
+int find_library_calls(int process, LibraryCalls* calls);
 
 #endif
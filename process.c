@@ -1,7 +1,13 @@
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 
 #include "process.h"
 #include "objdump.h"
+#include "util.h"
+#include "arena.h"
+#include "agent.h"
+#include "window.h"
+#include "accessor.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,11 +20,15 @@
 #include <fcntl.h>
 #include <dlfcn.h>
 #include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/user.h>
-#define __RTLD_DLOPEN 0x80000000
+#include <sys/syscall.h>
 
 #if __WORDSIZE == 64
 #define RETURN_REG(x) (x).rax
@@ -32,7 +42,154 @@
 #define SYSCALL_PARAM(x) (x).orig_eax
 #endif
 
-ssize_t pread64(int filedes, void *buffer, size_t size, off_t offset);
+static int policy = 0;
+
+/**
+ *  Set the library-wide policy for how far operations may interfere with target processes.
+ *
+ *  @param[in] new_policy
+ *  	POLICY_OBSERVE_ONLY to make every operation that would stop a process, write to it or run code
+ *  	in it fail with an error instead; memory is then only read through process_vm_readv,
+ *  	/proc/pid/mem or an agent. 0 to allow everything.
+ *
+ */
+void set_process_policy(int new_policy)
+{
+	policy = new_policy;
+}
+
+/**
+ *  Returns the library-wide policy set with set_process_policy.
+ *
+ */
+int process_policy()
+{
+	return policy;
+}
+
+/**
+ *  Checks whether an operation on a process is allowed by the policy, complaining if it isn't.
+ *
+ *  @return
+ *  	1 if it is allowed, 0 if not.
+ *
+ */
+static int policy_allows(int process, const char* operation)
+{
+	if(!(policy & POLICY_OBSERVE_ONLY))
+		return 1;
+
+	fprintf(stderr, "Error: %s process %d is not allowed in observe-only mode!\n", operation, process);
+	return 0;
+}
+
+/**
+ *  Attach to a thread and ask it to stop, without waiting for it to do so. Unlike PTRACE_ATTACH, this
+ *  does not send the thread a SIGSTOP that could be observed by the process or its parent.
+ *
+ *  @param[in] tid
+ *  	The thread (or process) ID.
+ *
+ *  @return
+ *  	0 on success, -1 on error (check errno).
+ *
+ */
+static int interrupt_thread(int tid)
+{
+	if(ptrace(PTRACE_SEIZE, tid, NULL, NULL) == -1)
+		return -1;
+
+	if(ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1)
+	{
+		ptrace(PTRACE_DETACH, tid, NULL, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  Wait for a thread we interrupted to stop.
+ *
+ *  @param[in] tid
+ *  	The thread (or process) ID.
+ *
+ *  @param[out] pending_signal
+ *  	If the thread stopped to receive a signal instead, the signal, which should be passed on when the
+ *  	thread is detached. 0 otherwise.
+ *
+ *  @return
+ *  	0 once the thread is stopped, -1 if it went away.
+ *
+ */
+static int wait_for_stop(int tid, int* pending_signal)
+{
+	int status;
+
+	*pending_signal = 0;
+
+	while(1)
+	{
+		if(waitpid(tid, &status, __WALL) == -1)
+			return -1;
+
+		if(WIFEXITED(status) || WIFSIGNALED(status))
+			return -1;
+
+		if(!WIFSTOPPED(status))
+			continue;
+
+		// The interrupt itself, a group-stop, or an event a caller tracing the thread asked for.
+		if((status >> 16) != 0)
+			return 0;
+
+		// A signal got there first. The thread is stopped all the same, just hold on to the signal.
+		*pending_signal = WSTOPSIG(status);
+		return 0;
+	}
+}
+
+/**
+ *  Stop a single thread with ptrace, for the few operations that need it outside of a session.
+ *
+ *  @param[in] tid
+ *  	The thread (or process) ID.
+ *
+ *  @param[out] pending_signal
+ *  	Signal to pass to resume_thread.
+ *
+ *  @return
+ *  	0 on success, -1 on error.
+ *
+ */
+static int stop_thread(int tid, int* pending_signal)
+{
+	if(interrupt_thread(tid) == -1)
+		return -1;
+
+	if(wait_for_stop(tid, pending_signal) == -1)
+	{
+		ptrace(PTRACE_DETACH, tid, NULL, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ *  Detach from a thread, letting it run again.
+ *
+ *  @param[in] tid
+ *  	The thread (or process) ID.
+ *
+ *  @param[in] pending_signal
+ *  	Signal the thread was about to receive when we stopped it, or 0.
+ *
+ */
+static void resume_thread(int tid, int pending_signal)
+{
+	ptrace(PTRACE_DETACH, tid, NULL, (void*) (uintptr_t) pending_signal);
+}
 
 /**
  *  Reads bytes from the address space of a target process.
@@ -52,6 +209,20 @@ ssize_t pread64(int filedes, void *buffer, size_t size, off_t offset);
  */
 void process_read(int process, void* buf, size_t count, uintptr_t addr)
 {
+	// Fastest path: memory we share with the process is just a copy away.
+	if(window_read(process, buf, count, addr))
+		return;
+
+	// Fast path: a single process_vm_readv, no file descriptors involved.
+	RemoteIOVec vec = { addr, count, buf, 0 };
+	if(process_readv(process, &vec, 1) == 1)
+		return;
+
+	// An open accessor already has /proc/pid/mem open.
+	MemoryAccessor* accessor = find_memory_accessor(process);
+	if(accessor && accessor_read(accessor, buf, count, addr))
+		return;
+
 	char name[PATH_MAX];
 	snprintf(name, sizeof(name), "/proc/%d/mem", process);
 
@@ -59,357 +230,2241 @@ void process_read(int process, void* buf, size_t count, uintptr_t addr)
 	
 	if(fd == -1 || pread64(fd, buf, count, addr) == -1)
 	{
+		// If there's an agent in the process, ask it rather than stopping the process.
+		AgentConnection* agent = find_agent_connection(process);
+		if(agent && agent_read(agent, buf, count, addr) == count)
+		{
+			if(fd != -1)
+				close(fd);
+
+			return;
+		}
+
 		// Hmm, maybe we're not attached.
-		if(ptrace(PTRACE_ATTACH, process, NULL, NULL) == -1)
+		int pending_signal;
+		if(!policy_allows(process, "stopping") || stop_thread(process, &pending_signal) == -1)
 		{
 			// Guess that wasn't the problem.
-			close(fd);
+			if(fd != -1)
+				close(fd);
 			return;
 		}
 
-		// Wait for process to stop. We need to have it stop before we do anything else.
-		int status;
-		waitpid(process, &status, 0);
+		if(fd != -1)
+			close(fd);
 
 		fd = open(name, O_RDONLY);
 		pread64(fd, buf, count, addr);
 		close(fd);
 
-		ptrace(PTRACE_DETACH, process, NULL, NULL);
+		resume_thread(process, pending_signal);
 		return;
 	}
 
 	close(fd);
 }
 
+static int readv_remote(int process, RemoteIOVec* vecs, int count)
+{
+	struct iovec local[IOV_MAX];
+	struct iovec remote[IOV_MAX];
+	int complete = 0;
+	int i;
+
+	for(i = 0; i < count; i++)
+		vecs[i].result = -1;
+
+	i = 0;
+	while(i < count)
+	{
+		// build a batch of at most IOV_MAX entries starting at i
+		int batch = count - i;
+		if(batch > IOV_MAX)
+			batch = IOV_MAX;
+
+		int j;
+		for(j = 0; j < batch; j++)
+		{
+			local[j].iov_base = vecs[i + j].buf;
+			local[j].iov_len = vecs[i + j].len;
+			remote[j].iov_base = (void*) vecs[i + j].addr;
+			remote[j].iov_len = vecs[i + j].len;
+		}
+
+		ssize_t ret = process_vm_readv(process, local, batch, remote, batch, 0);
+		if(ret < 0)
+		{
+			// no point in retrying the rest if the process itself is inaccessible
+			if(errno == ESRCH || errno == EPERM)
+				return complete;
+
+			ret = 0;
+		}
+
+		// hand out the bytes read to the entries in order. The kernel stops at the first
+		// remote region it cannot read, so everything after that has to be retried.
+		size_t left = ret;
+		for(j = 0; j < batch; j++)
+		{
+			if(left < vecs[i + j].len)
+				break;
+
+			vecs[i + j].result = vecs[i + j].len;
+			left -= vecs[i + j].len;
+			++complete;
+		}
+
+		if(j == batch)
+		{
+			i += batch;
+			continue;
+		}
+
+		// entry i + j failed, possibly after a few bytes. Record what we got, skip it and
+		// resume the batch from the entry after it.
+		if(left > 0)
+			vecs[i + j].result = left;
+
+		i += j + 1;
+	}
+
+	return complete;
+}
+
 /**
- *  Write bytes to the address space of a target process, without regard to memory protection.
+ *  Reads many disjoint regions from the address space of a target process, using as few
+ *  process_vm_readv calls as possible (one per IOV_MAX entries, plus one per entry that
+ *  could not be completely read). Regions an open accessor has cached are copied from its cache.
  *
  *  @param[in] process
- *  	The process PID to write to.
+ *  	The process PID to read from.
  *
- *  @param[in] buf
- *  	The buffer to write the bytes from.
+ *  @param[in,out] vecs
+ *  	Array of regions to read. The result field of each entry is set to the number of bytes
+ *  	that were read into its buffer, or -1 if none could be read.
  *
  *  @param[in] count
- *  	Number of bytes to write.
+ *  	Number of entries in vecs.
  *
- *  @param[in] addr
- *  	Address to write.
+ *  @return
+ *  	Number of entries that were read completely.
+ *
+ */
+int process_readv(int process, RemoteIOVec* vecs, int count)
+{
+	MemoryAccessor* accessor = find_memory_accessor(process);
+	if(!accessor)
+		return readv_remote(process, vecs, count);
+
+	RemoteIOVec* rest = (RemoteIOVec*) malloc(sizeof(RemoteIOVec) * count);
+	int* rest_index = (int*) malloc(sizeof(int) * count);
+	int num_rest = 0;
+	int complete = 0;
+
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		if(accessor_read_cached(accessor, vecs[i].buf, vecs[i].len, vecs[i].addr))
+		{
+			vecs[i].result = vecs[i].len;
+			++complete;
+			continue;
+		}
+
+		rest[num_rest] = vecs[i];
+		rest_index[num_rest] = i;
+		++num_rest;
+	}
+
+	if(num_rest)
+		complete += readv_remote(process, rest, num_rest);
+
+	for(i = 0; i < num_rest; i++)
+		vecs[rest_index[i]].result = rest[i].result;
+
+	free(rest_index);
+	free(rest);
+
+	return complete;
+}
+
+/**
+ *  Write bytes to the address space of a target process one word at a time with PTRACE_POKEDATA. This
+ *  is the slowest write path and is only used when the faster bulk paths refuse the write, which normally
+ *  only happens for read-only text on kernels that do not allow forced writes through /proc/pid/mem.
+ *
+ *  @return
+ *  	Number of bytes written.
  *
  */
-void process_write(int process, const void* buf, size_t count, uintptr_t addr)
+static ssize_t process_write_words(int process, const void* buf, size_t count, uintptr_t addr)
 {
 	int do_detach = 0;
+	int pending_signal = 0;
+	size_t written = 0;
+
 	// write word aligned data
 	while(count >= sizeof(void*))
 	{
+		uintptr_t word;
+		memcpy(&word, buf, sizeof(word));
 
-		if(ptrace(PTRACE_POKEDATA, process, (void*)addr, (void*)(*((uintptr_t*)buf))) == -1)
+		if(ptrace(PTRACE_POKEDATA, process, (void*)addr, (void*)word) == -1)
 		{
-			if(ptrace(PTRACE_ATTACH, process, NULL, NULL) == -1)
+			if(do_detach || stop_thread(process, &pending_signal) == -1)
 			{
 				// Guess that wasn't the problem.
-				return;
+				goto out;
 			}
 
-			// Wait for process to stop. We need to have it stop before we do anything else.
-			int status;
-			waitpid(process, &status, 0);
-
-			ptrace(PTRACE_POKEDATA, process, (void*)addr, (void*)(*((uintptr_t*)buf)));
 			do_detach = 1;
+
+			if(ptrace(PTRACE_POKEDATA, process, (void*)addr, (void*)word) == -1)
+				goto out;
 		}
 
 		buf += sizeof(void*);
 		addr += sizeof(void*);
 		count -= sizeof(void*);
+		written += sizeof(void*);
 	}
 
+	if(count == 0)
+		goto out;
+
 	// write rest
+	errno = 0;
 	void* cur_word = (void*) ptrace(PTRACE_PEEKDATA, process, (void*)addr, NULL);
 	if(errno != 0)
 	{
-		if(ptrace(PTRACE_ATTACH, process, NULL, NULL) == -1)
+		if(do_detach || stop_thread(process, &pending_signal) == -1)
 		{
 			// Guess that wasn't the problem.
-			return;
+			goto out;
 		}
 
-		// Wait for process to stop. We need to have it stop before we do anything else.
-		int status;
-		waitpid(process, &status, 0);
-
 		do_detach = 1;
+
+		errno = 0;
+		cur_word = (void*) ptrace(PTRACE_PEEKDATA, process, (void*)addr, NULL);
+		if(errno != 0)
+			goto out;
 	}
 
 	memcpy(&cur_word, buf, count);
-	ptrace(PTRACE_POKEDATA, process, (void*)addr, cur_word);
+	if(ptrace(PTRACE_POKEDATA, process, (void*)addr, cur_word) != -1)
+		written += count;
 
+out:
 	if(do_detach)
-		ptrace(PTRACE_DETACH, process, NULL, NULL);
+		resume_thread(process, pending_signal);
+
+	return written;
 }
 
 /**
- *  Call a AMD64 ABI function with all INTEGER class arguments.
+ *  Write bytes to the address space of a target process, without regard to memory protection.
+ *
+ *  Writes are done in bulk with process_vm_writev, which handles writable mappings. Whatever that
+ *  refuses (typically read-only text) is written in one pwrite on /proc/pid/mem, and only if that
+ *  is not permitted either do we fall back to word-by-word PTRACE_POKEDATA.
  *
  *  @param[in] process
- *  	The process's PID. The target process must not be attached to another process.
+ *  	The process PID to write to.
  *
- *  @param[in] function
- *  	The address of the function to call.
- * 
- *  @param[in] numargs
- *  	Number of parameters to pass into the function.
+ *  @param[in] buf
+ *  	The buffer to write the bytes from.
+ *
+ *  @param[in] count
+ *  	Number of bytes to write.
+ *
+ *  @param[in] addr
+ *  	Address to write.
  *
  *  @return
- *  	Either the function return value or -1 for ptrace error (check errno if -1 is returned).
+ *  	Number of bytes written, which is less than count if part of the range could not be written.
+ *  	-1 if nothing could be written (check errno).
  *
  */
-uintptr_t call_function_in_target(int process, void* function, int numargs, ...)
+ssize_t process_write(int process, const void* buf, size_t count, uintptr_t addr)
 {
-	uintptr_t* args = (uintptr_t*) malloc(sizeof(uintptr_t) * numargs);
+	size_t written = 0;
 
-	int i;
-	va_list ap;
-	va_start(ap, numargs);
-	for(i = 0; i < numargs; i++)
+	if(count == 0)
+		return 0;
+
+	if(!policy_allows(process, "writing to"))
 	{
-		args[i] = va_arg(ap, uintptr_t);
+		errno = EPERM;
+		return -1;
 	}
-	va_end(ap);
 
-	uintptr_t ret = call_function_in_target_with_args(process, function, numargs, args);
-	free(args);
+	if(window_write(process, buf, count, addr))
+		return count;
 
-	return ret;
+	MemoryAccessor* accessor = find_memory_accessor(process);
+	if(accessor)
+		accessor_invalidate(accessor, addr, count);
+
+	// Fast path: one syscall, honors memory protection.
+	while(written < count)
+	{
+		struct iovec local = { (void*) buf + written, count - written };
+		struct iovec remote = { (void*) (addr + written), count - written };
+
+		ssize_t ret = process_vm_writev(process, &local, 1, &remote, 1, 0);
+		if(ret <= 0)
+			break;
+
+		written += ret;
+	}
+
+	if(written == count)
+		return written;
+
+	// Slower path: /proc/pid/mem ignores memory protection the same way ptrace does.
+	char name[PATH_MAX];
+	snprintf(name, sizeof(name), "/proc/%d/mem", process);
+
+	int fd = open(name, O_WRONLY);
+	if(fd != -1)
+	{
+		while(written < count)
+		{
+			ssize_t ret = pwrite64(fd, buf + written, count - written, addr + written);
+			if(ret <= 0)
+				break;
+
+			written += ret;
+		}
+
+		close(fd);
+
+		if(written == count)
+			return written;
+	}
+
+	// Last resort.
+	written += process_write_words(process, buf + written, count - written, addr + written);
+
+	if(written == 0)
+		return -1;
+
+	return written;
 }
-	
+
 /**
- *  Call a AMD64 ABI function with all INTEGER class arguments.
+ * A thread stopped by a session.
+ *
+ */
+typedef struct StoppedThread
+{
+	int tid;				/// Thread ID.
+	int pending_signal;			/// Signal to pass on when the thread is resumed, or 0.
+	int seized;				/// Whether we attached to it, rather than the caller (SESSION_ATTACHED).
+} StoppedThread;
+
+/**
+ *  A ptrace session with a target process. The target is attached and stopped exactly once when the
+ *  session is opened and resumed exactly once when it is closed, so any number of remote calls, reads
+ *  and writes made in between cost a single stop of the target.
+ */
+struct ProcessSession
+{
+	int process;				/// PID of the attached process.
+	int thread;				/// Thread remote calls are made on, the main thread unless chosen otherwise.
+	int pending_signal;			/// Signal to pass on to the process when it is resumed, or 0.
+	StoppedThread* threads;			/// Other threads stopped with the process (SESSION_ALL_THREADS).
+	int num_threads;			/// Number of entries in threads.
+	struct user_regs_struct regs;		/// Register state of the target at the time it was stopped.
+	uintptr_t breakpoint_addr;		/// Dummy return address our remote calls trap on.
+	uintptr_t syscall_addr;			/// Address of our system call stub.
+	int attached;				/// Whether the process was already ours to trace (SESSION_ATTACHED).
+	int patched_entry;			/// Whether the stubs are on the exe entry point we patched.
+	uintptr_t entry_point;			/// Address of the exe entry point.
+	char backup[3];				/// Instruction bytes overwritten by the stubs.
+	ScratchArena* scratch;			/// Scratch memory in the target released with the session, if any.
+	struct timespec stop_start;		/// When we started stopping the process.
+	uint64_t quiesce_time;			/// Nanoseconds it took until everything was stopped.
+	uint64_t call_timeout;			/// Nanoseconds a remote call may take before it is cancelled, 0 for no limit.
+	CallStatus last_call_status;		/// How the last remote call ended.
+	uint64_t last_call_time;		/// Nanoseconds the last remote call took.
+	uint64_t call_time;			/// Nanoseconds spent in remote calls over the whole session.
+	struct timespec call_start;		/// When the current or last remote call was started.
+	struct user_regs_struct call_regs;	/// Registers of a call started with session_begin_call.
+};
+
+#define SESSION_SCRATCH_SIZE (64 * 1024)
+
+// A system call instruction followed by a breakpoint, so we regain control as soon as the system call returns.
+#if __WORDSIZE == 64
+static const unsigned char syscall_stub[] = {0x0f, 0x05, 0xcc};	// syscall; int3
+#else
+static const unsigned char syscall_stub[] = {0xcd, 0x80, 0xcc};	// int $0x80; int3
+#endif
+
+#define SYSCALL_STUB_BREAKPOINT 2
+
+/**
+ * A page of int3 instructions we mapped into a process for remote calls to return to, so we don't
+ * have to patch its code for every session. It starts with our system call stub.
+ *
+ */
+typedef struct ReturnTrap
+{
+	int process;				/// PID of the process.
+	unsigned long long start_time;		/// Start time of the process, in case the PID gets reused.
+	uintptr_t address;			/// Address of the page in the process.
+	struct ReturnTrap* next;
+} ReturnTrap;
+
+#define RETURN_TRAP_SIZE 4096
+#define RETURN_TRAP_CALL_OFFSET 16		/// Where on the page remote calls return to.
+
+static ReturnTrap* return_traps = NULL;
+static pthread_mutex_t return_traps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ *  Looks up the return trap installed in a process.
  *
  *  @param[in] process
- *  	The process's PID. The target process must not be attached to another process.
+ *  	The process's PID.
  *
- *  @param[in] function
- *  	The address of the function to call.
- * 
- *  @param[in] numargs
- *  	Number of parameters to pass into the function.
+ *  @param[in] start_time
+ *  	The process's start time. A trap cached for an earlier process with the same PID is dropped.
  *
  *  @return
- *  	Either the function return value or -1 for ptrace error (check errno if -1 is returned).
+ *  	The address of the trap page, or 0 if no trap is installed.
  *
  */
-uintptr_t call_function_in_target_with_args(int process, void* function, int numargs, uintptr_t* args)
+static uintptr_t find_return_trap(int process, unsigned long long start_time)
 {
-	uintptr_t ret = -1;
-	int status;
-	struct user_regs_struct regs, call_regs;
+	uintptr_t address = 0;
 
-	const char breakpoint[] = {0xcc};	// int3, or the x86 breakpoint instruction.
-						// Linux will signal us when our target hits it.
-	
-	char backup[sizeof(breakpoint)];	// instruction we overwrite with the breakpoint.
+	pthread_mutex_lock(&return_traps_lock);
 
-	// we'll use the exe entry point  as the dummy return pointer for our function
-	// so we can detect when it's finished
-	uintptr_t breakpoint_addr = find_process_entry_point(process);
+	ReturnTrap** link;
+	for(link = &return_traps; *link; link = &(*link)->next)
+	{
+		if((*link)->process != process)
+			continue;
 
-	if(ptrace(PTRACE_ATTACH, process, NULL, NULL) == -1)
-		return -1;
+		if((*link)->start_time == start_time)
+		{
+			address = (*link)->address;
+		}
+		else
+		{
+			ReturnTrap* stale = *link;
+			*link = stale->next;
+			free(stale);
+		}
 
-	// Wait for process to stop. We need to have it stop before we do anything else.
-	waitpid(process, &status, 0);
+		break;
+	}
 
-	// Back up the current prcoessor state as stored in the registers.
-	if(ptrace(PTRACE_GETREGS, process, NULL, &regs) == -1)
-		goto detach;
+	pthread_mutex_unlock(&return_traps_lock);
 
-	// Back up the instructions at this location that we will overwrite with the breakpoint.
-	process_read(process, backup, sizeof(backup), breakpoint_addr);
+	return address;
+}
 
-	// Set our breakpoint
-	process_write(process, breakpoint, sizeof(breakpoint), breakpoint_addr);
+static void forget_return_trap(int process)
+{
+	pthread_mutex_lock(&return_traps_lock);
+
+	ReturnTrap** link;
+	for(link = &return_traps; *link; link = &(*link)->next)
+	{
+		if((*link)->process == process)
+		{
+			ReturnTrap* trap = *link;
+			*link = trap->next;
+			free(trap);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&return_traps_lock);
+}
+
+/**
+ *  Points a session's stubs at the return trap page at the given address.
+ *
+ */
+static void use_return_trap(ProcessSession* session, uintptr_t address)
+{
+	session->syscall_addr = address;
+	session->breakpoint_addr = address + RETURN_TRAP_CALL_OFFSET;
+}
+
+/**
+ *  Maps a return trap page into the process attached to a session and switches the session over
+ *  to it. The session must still be using the stubs on the patched entry point, which is restored.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] start_time
+ *  	The process's start time, for the cache.
+ *
+ */
+static void install_return_trap(ProcessSession* session, unsigned long long start_time)
+{
+#ifdef SYS_mmap2
+	long address = session_syscall(session, SYS_mmap2, 6,
+			0, RETURN_TRAP_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+	long address = session_syscall(session, SYS_mmap, 6,
+			0, RETURN_TRAP_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+
+	if(address < 0 && address > -4096)
+		return;
+
+	// fill the whole page with int3 and put the system call stub at the start. The page isn't
+	// writable, which /proc/pid/mem doesn't mind.
+	unsigned char traps[RETURN_TRAP_SIZE];
+	memset(traps, 0xcc, sizeof(traps));
+	memcpy(traps, syscall_stub, sizeof(syscall_stub));
+	if(process_write(session->process, traps, sizeof(traps), address) != sizeof(traps))
+		return;
+
+	// unpatch the entry point; the process text stays untouched from here on.
+	process_write(session->process, session->backup, sizeof(session->backup), session->entry_point);
+	session->patched_entry = 0;
+	use_return_trap(session, address);
+
+	ReturnTrap* trap = (ReturnTrap*) malloc(sizeof(ReturnTrap));
+	trap->process = session->process;
+	trap->start_time = start_time;
+	trap->address = address;
+
+	pthread_mutex_lock(&return_traps_lock);
+	trap->next = return_traps;
+	return_traps = trap;
+	pthread_mutex_unlock(&return_traps_lock);
+}
+
+static uint64_t elapsed_ns(const struct timespec* since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000000ULL + (now.tv_nsec - since->tv_nsec);
+}
+
+/**
+ *  Stop every thread of a process other than the session's thread, which must already be stopped.
+ *  All threads are interrupted before we wait for any of them, so they stop at about the same time.
+ *
+ *  @return
+ *  	0 on success, -1 on error.
+ *
+ */
+static int stop_other_threads(ProcessSession* session)
+{
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "/proc/%d/task", session->process);
+
+	// keep going until a pass finds no threads we haven't stopped yet, in case threads are being created.
+	int found_new = 1;
+	while(found_new)
+	{
+		found_new = 0;
+
+		DIR* tasks = opendir(buf);
+		if(!tasks)
+			return -1;
+
+		int first_new = session->num_threads;
+
+		struct dirent* entry;
+		while((entry = readdir(tasks)) != NULL)
+		{
+			char* endptr;
+			int tid = strtol(entry->d_name, &endptr, 10);
+			if(*endptr != '\0' || tid == session->thread)
+				continue;
+
+			int i;
+			for(i = 0; i < session->num_threads; i++)
+			{
+				if(session->threads[i].tid == tid)
+					break;
+			}
+
+			if(i < session->num_threads)
+				continue;
+
+			// threads of a process the caller traces are the caller's already, and only need interrupting.
+			// a thread that exits before we get to it isn't an error
+			int seized = !session->attached || ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1;
+			if(seized && interrupt_thread(tid) == -1)
+				continue;
+
+			session->threads = (StoppedThread*) realloc(session->threads,
+					sizeof(StoppedThread) * (session->num_threads + 1));
+			session->threads[session->num_threads].tid = tid;
+			session->threads[session->num_threads].pending_signal = 0;
+			session->threads[session->num_threads].seized = seized;
+			++session->num_threads;
+			found_new = 1;
+		}
+
+		closedir(tasks);
+
+		// now wait for this batch to stop
+		int i;
+		for(i = first_new; i < session->num_threads; i++)
+		{
+			if(wait_for_stop(session->threads[i].tid, &session->threads[i].pending_signal) == -1)
+			{
+				// thread went away
+				session->threads[i] = session->threads[--session->num_threads];
+				--i;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ *  How good a thread blocked in a system call is to borrow for remote calls. Threads waiting on a futex
+ *  or sleeping are usually idle workers; threads in epoll, poll or select are event loops, which will
+ *  notice being borrowed, but less than one that is running.
+ *
+ *  @return
+ *  	Higher is better.
+ *
+ */
+static int idle_syscall_rank(long number)
+{
+	switch(number)
+	{
+		case SYS_futex:
+		case SYS_nanosleep:
+		case SYS_clock_nanosleep:
+#ifdef SYS_pause
+		case SYS_pause:
+#endif
+			return 3;
+
+#ifdef SYS_epoll_wait
+		case SYS_epoll_wait:
+#endif
+#ifdef SYS_epoll_pwait
+		case SYS_epoll_pwait:
+#endif
+#ifdef SYS_epoll_pwait2
+		case SYS_epoll_pwait2:
+#endif
+#ifdef SYS_poll
+		case SYS_poll:
+#endif
+#ifdef SYS_ppoll
+		case SYS_ppoll:
+#endif
+#ifdef SYS_select
+		case SYS_select:
+#endif
+#ifdef SYS_pselect6
+		case SYS_pselect6:
+#endif
+			return 2;
+
+		default:
+			return 1;
+	}
+}
+
+/**
+ *  Pick a thread of a process that is blocked in a system call, preferring threads waiting on a futex or
+ *  sleeping over event loops, and among equals the one that has used the least CPU time. The main thread
+ *  is only picked if no other thread will do.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	The thread ID, or 0 if no thread is blocked in a system call.
+ *
+ */
+int find_idle_thread(int process)
+{
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "/proc/%d/task", process);
+
+	DIR* tasks = opendir(buf);
+	if(!tasks)
+		return 0;
+
+	int best = 0;
+	int best_rank = 0;
+	unsigned long long best_cpu = 0;
+
+	struct dirent* entry;
+	while((entry = readdir(tasks)) != NULL)
+	{
+		char* endptr;
+		int tid = strtol(entry->d_name, &endptr, 10);
+		if(*endptr != '\0' || tid <= 0)
+			continue;
+
+		// state and CPU time come after the command name, which can contain anything
+		char stat[1024];
+		snprintf(buf, sizeof(buf), "/proc/%d/task/%d/stat", process, tid);
+		FILE* file = fopen(buf, "r");
+		if(!file)
+			continue;
+
+		char* got = fgets(stat, sizeof(stat), file);
+		fclose(file);
+
+		char* fields = got ? strrchr(stat, ')') : NULL;
+		char state;
+		unsigned long long utime;
+		unsigned long long stime;
+		if(!fields || sscanf(fields + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+					&state, &utime, &stime) != 3)
+			continue;
+
+		// only an interruptible sleep can be interrupted right away
+		if(state != 'S')
+			continue;
+
+		long number;
+		snprintf(buf, sizeof(buf), "/proc/%d/task/%d/syscall", process, tid);
+		file = fopen(buf, "r");
+		if(!file)
+			continue;
+
+		int scanned = fscanf(file, "%ld", &number);
+		fclose(file);
+
+		if(scanned != 1 || number < 0)
+			continue;
+
+		int rank = idle_syscall_rank(number);
+		if(tid == process)
+			rank = 0;
+
+		unsigned long long cpu = utime + stime;
+		if(!best || rank > best_rank || (rank == best_rank && cpu < best_cpu))
+		{
+			best = tid;
+			best_rank = rank;
+			best_cpu = cpu;
+		}
+	}
+
+	closedir(tasks);
+
+	return best;
+}
+
+/**
+ *  Attach to a process and keep it stopped until the session is closed.
+ *
+ *  @param[in] process
+ *  	The process's PID. The target process must not be attached to another process.
+ *
+ *  @return
+ *  	A session handle, or NULL if the process could not be attached (check errno).
+ *
+ */
+ProcessSession* open_process_session(int process)
+{
+	return open_process_session_with_flags(process, 0);
+}
+
+/**
+ *  Attach to a process and keep it stopped until the session is closed.
+ *
+ *  Only the main thread is stopped unless SESSION_ALL_THREADS is given, in which case every thread
+ *  in the process is stopped as well. That is what operations that patch code should use.
+ *  With SESSION_NO_CALLS, the session only holds the process still; nothing is set up in it to make
+ *  remote calls with, and trying to make one fails.
+ *  With SESSION_ATTACHED, the caller is already tracing the process and has it stopped. The session
+ *  then neither attaches to it nor detaches from it, and leaves it stopped when closed. Other threads
+ *  the caller traces as well are interrupted rather than attached to, and kept traced when resumed.
+ *
+ *  @param[in] process
+ *  	The process's PID. The target process must not be attached to another process, unless
+ *  	SESSION_ATTACHED is given.
+ *
+ *  @param[in] flags
+ *  	Zero or more SESSION_ flags.
+ *
+ *  @return
+ *  	A session handle, or NULL if the process could not be attached (check errno).
+ *
+ */
+ProcessSession* open_process_session_with_flags(int process, int flags)
+{
+	return open_thread_session(process, 0, flags);
+}
+
+/**
+ *  Attach to a process and keep it stopped until the session is closed, making remote calls on a
+ *  particular thread. Only that thread is stopped unless SESSION_ALL_THREADS is given, so with
+ *  SESSION_IDLE_THREAD a busy main thread, an event loop say, keeps running while we borrow a thread
+ *  that was only waiting anyway.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] thread
+ *  	The thread to stop and make calls on. 0 for the main thread, or for the thread find_idle_thread
+ *  	picks if SESSION_IDLE_THREAD is given.
+ *
+ *  @param[in] flags
+ *  	Zero or more SESSION_ flags, as for open_process_session_with_flags.
+ *
+ *  @return
+ *  	A session handle, or NULL if the thread could not be attached (check errno).
+ *
+ */
+ProcessSession* open_thread_session(int process, int thread, int flags)
+{
+	if(!policy_allows(process, "attaching to"))
+		return NULL;
+
+	if(!thread && (flags & SESSION_IDLE_THREAD))
+		thread = find_idle_thread(process);
+
+	if(!thread)
+		thread = process;
+
+	ProcessSession* session = (ProcessSession*) malloc(sizeof(ProcessSession));
+	session->process = process;
+	session->thread = thread;
+	session->pending_signal = 0;
+	session->threads = NULL;
+	session->num_threads = 0;
+	session->scratch = NULL;
+	session->breakpoint_addr = 0;
+	session->syscall_addr = 0;
+	session->patched_entry = 0;
+	session->call_timeout = 0;
+	session->last_call_status = CALL_OK;
+	session->last_call_time = 0;
+	session->call_time = 0;
+
+	unsigned long long start_time = process_start_time(process);
+
+	// windows of a process that exec'd since we last had it stopped must not be written to in its place
+	refresh_shared_windows(process);
+	uintptr_t trap = 0;
+	if(!(flags & SESSION_NO_CALLS))
+		trap = find_return_trap(process, start_time);
+
+	// if we'll need to install a trap, look up what we need while the process is still running
+	session->entry_point = 0;
+	if(!trap && !(flags & SESSION_NO_CALLS))
+		session->entry_point = find_process_entry_point(process);
+
+	session->attached = flags & SESSION_ATTACHED;
+
+	clock_gettime(CLOCK_MONOTONIC, &session->stop_start);
+
+	if(!session->attached && interrupt_thread(thread) == -1)
+	{
+		free(session);
+		return NULL;
+	}
+
+	// Wait for the thread to stop. We need to have it stop before we do anything else.
+	if(!session->attached && wait_for_stop(thread, &session->pending_signal) == -1)
+	{
+		ptrace(PTRACE_DETACH, thread, NULL, NULL);
+		free(session);
+		return NULL;
+	}
+
+	if(flags & SESSION_ALL_THREADS)
+		stop_other_threads(session);
+
+	session->quiesce_time = elapsed_ns(&session->stop_start);
+
+	// Back up the current prcoessor state as stored in the registers.
+	if(ptrace(PTRACE_GETREGS, thread, NULL, &session->regs) == -1)
+	{
+		close_process_session(session);
+		return NULL;
+	}
+
+	// Nothing to set up if we're only here to look.
+	if(flags & SESSION_NO_CALLS)
+		return session;
+
+	// Our functions return to a page of breakpoints we installed, so we can detect when they have
+	// finished. Make sure it is still there; the process could have exec'd since.
+	if(trap)
+	{
+		unsigned char check[RETURN_TRAP_CALL_OFFSET + 1];
+		memset(check, 0, sizeof(check));
+		process_read(process, check, sizeof(check), trap);
+		if(memcmp(check, syscall_stub, sizeof(syscall_stub)) == 0 && check[RETURN_TRAP_CALL_OFFSET] == 0xcc)
+		{
+			use_return_trap(session, trap);
+			return session;
+		}
+
+		forget_return_trap(process);
+		session->entry_point = find_process_entry_point(process);
+	}
+
+	// No trap yet. Put our system call stub on the exe entry point for now, and use its breakpoint
+	// as the dummy return pointer: back up the instructions at this location that we will overwrite,
+	// then write the stub. We only need it long enough to map the trap page.
+	process_read(process, session->backup, sizeof(session->backup), session->entry_point);
+	process_write(process, syscall_stub, sizeof(syscall_stub), session->entry_point);
+	session->patched_entry = 1;
+	session->syscall_addr = session->entry_point;
+	session->breakpoint_addr = session->entry_point + SYSCALL_STUB_BREAKPOINT;
+
+	install_return_trap(session, start_time);
+
+	return session;
+}
+
+/**
+ *  Restore the state of a process and detach from it, letting it run again.
+ *
+ *  @param[in] session
+ *  	The session returned by open_process_session. It is freed by this call.
+ *
+ *  @return
+ *  	The number of nanoseconds the process was stopped for.
+ *
+ */
+uint64_t close_process_session(ProcessSession* session)
+{
+	if(session->scratch)
+		free_scratch_arena(session->scratch, session);
+
+	// Restore the old instructions here, if we couldn't install a trap page
+	if(session->patched_entry)
+		process_write(session->process, session->backup, sizeof(session->backup), session->entry_point);
+
+	// Restore backed up registers
+	ptrace(PTRACE_SETREGS, session->thread, NULL, &session->regs);
+
+	// Let the other threads go first; they're all ready, so this is just a syscall each. Those the caller
+	// traces stay traced.
+	int i;
+	for(i = 0; i < session->num_threads; i++)
+	{
+		StoppedThread* thread = &session->threads[i];
+		if(thread->seized)
+			resume_thread(thread->tid, thread->pending_signal);
+		else
+			ptrace(PTRACE_CONT, thread->tid, NULL, (void*) (uintptr_t) thread->pending_signal);
+	}
+
+	if(!session->attached)
+		resume_thread(session->thread, session->pending_signal);
+
+	uint64_t stop_time = elapsed_ns(&session->stop_start);
+
+	free(session->threads);
+	free(session);
+
+	return stop_time;
+}
+
+/**
+ *  Returns how long it took to bring a process to a stop when a session was opened.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @return
+ *  	Nanoseconds between asking the first thread to stop and the last thread stopping.
+ *
+ */
+uint64_t session_quiesce_time(ProcessSession* session)
+{
+	return session->quiesce_time;
+}
+
+/**
+ *  Returns the number of threads a session has stopped, including the session's thread.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ */
+int session_stopped_threads(ProcessSession* session)
+{
+	return session->num_threads + 1;
+}
+
+/**
+ *  Limits how long each remote call made in a session may take. A call that takes longer is cancelled:
+ *  the thread making it is interrupted and gets the registers back that it had when the session was
+ *  opened, the call returns an error, and session_last_call_status says CALL_TIMED_OUT. Whatever the call
+ *  was doing is abandoned half-done, so this is a last resort against calls that block forever, such as
+ *  on a lock held by a thread we stopped.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] timeout
+ *  	The limit in nanoseconds, or 0 for none, which is the default.
+ *
+ */
+void session_set_call_timeout(ProcessSession* session, uint64_t timeout)
+{
+	session->call_timeout = timeout;
+}
+
+/**
+ *  Returns how the last remote call (function call, system call or session_execute) made in a session ended.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ */
+CallStatus session_last_call_status(ProcessSession* session)
+{
+	return session->last_call_status;
+}
+
+/**
+ *  Returns how long the last remote call made in a session took, from the target being let go to the call
+ *  returning, faulting or being cancelled.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @return
+ *  	The time in nanoseconds.
+ *
+ */
+uint64_t session_last_call_time(ProcessSession* session)
+{
+	return session->last_call_time;
+}
+
+/**
+ *  Returns how long all the remote calls made in a session have taken together.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @return
+ *  	The time in nanoseconds.
+ *
+ */
+uint64_t session_call_time(ProcessSession* session)
+{
+	return session->call_time;
+}
+
+/**
+ *  Returns the signal the thread of a session is to be sent when it is resumed. Callers that opened
+ *  the session with SESSION_ATTACHED resume the thread themselves, and should pass it on.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @return
+ *  	The signal, or 0 if there is none.
+ *
+ */
+int session_pending_signal(ProcessSession* session)
+{
+	return session->pending_signal;
+}
+
+/**
+ *  Returns the PID of the process a session is attached to.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ */
+int session_process(ProcessSession* session)
+{
+	return session->process;
+}
+
+/**
+ *  Returns the thread a session makes its remote calls on. Its wait status is what session_finish_call
+ *  wants.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ */
+int session_thread(ProcessSession* session)
+{
+	return session->thread;
+}
+
+/**
+ *  Returns a scratch arena for a session, creating it if necessary. Its memory is unmapped from the
+ *  target when the session is closed.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ */
+ScratchArena* session_scratch(ProcessSession* session)
+{
+	if(!session->scratch)
+		session->scratch = new_scratch_arena(session->process, SESSION_SCRATCH_SIZE);
+
+	return session->scratch;
+}
+
+/**
+ *  Reads bytes from the address space of a process attached to a session.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[out] buf
+ *  	The buffer to read the bytes into.
+ *
+ *  @param[in] count
+ *  	Number of bytes to read.
+ *
+ *  @param[in] addr
+ *  	Address to read from.
+ *
+ */
+void session_read(ProcessSession* session, void* buf, size_t count, uintptr_t addr)
+{
+	process_read(session->process, buf, count, addr);
+}
+
+/**
+ *  Write bytes to the address space of a process attached to a session, without regard to memory protection.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] buf
+ *  	The buffer to write the bytes from.
+ *
+ *  @param[in] count
+ *  	Number of bytes to write.
+ *
+ *  @param[in] addr
+ *  	Address to write.
+ *
+ *  @return
+ *  	Number of bytes written, or -1 if nothing could be written.
+ *
+ */
+ssize_t session_write(ProcessSession* session, const void* buf, size_t count, uintptr_t addr)
+{
+	return process_write(session->process, buf, count, addr);
+}
+
+/**
+ *  Wait for the thread of a session to stop while it runs code for us, giving up once the call has
+ *  taken longer than the session allows.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[out] status
+ *  	The wait status.
+ *
+ *  @param[in] start
+ *  	When the call was started.
+ *
+ *  @return
+ *  	The thread ID once it has changed state, 0 if the deadline passed first, -1 on error.
+ *
+ */
+static int wait_for_call(ProcessSession* session, int* status, const struct timespec* start)
+{
+	if(!session->call_timeout)
+		return waitpid(session->thread, status, __WALL);
+
+	// waitpid can't time out, so poll it, backing off up to a millisecond so short calls stay fast
+	long delay = 10000;
+	while(1)
+	{
+		int ret = waitpid(session->thread, status, __WALL | WNOHANG);
+		if(ret != 0)
+			return ret;
+
+		if(elapsed_ns(start) >= session->call_timeout)
+			return 0;
+
+		struct timespec sleep_time = { 0, delay };
+		nanosleep(&sleep_time, NULL);
+		if(delay < 1000000)
+			delay *= 2;
+	}
+}
+
+/**
+ *  Take the thread of a session back from a remote call that is taking too long. The call is
+ *  abandoned where it is: the thread gets the registers it had when the session was opened, and if our
+ *  stubs were on the patched entry point, the original instructions go back and the session can make no
+ *  further calls.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ */
+static void cancel_call(ProcessSession* session)
+{
+	int thread = session->thread;
+	int pending_signal;
+
+	if(ptrace(PTRACE_INTERRUPT, thread, NULL, NULL) == -1 || wait_for_stop(thread, &pending_signal) == -1)
+		return;
+
+	if(pending_signal && pending_signal != SIGTRAP && !session->pending_signal)
+		session->pending_signal = pending_signal;
+
+	ptrace(PTRACE_SETREGS, thread, NULL, &session->regs);
+
+	if(session->patched_entry)
+	{
+		process_write(session->process, session->backup, sizeof(session->backup), session->entry_point);
+		session->patched_entry = 0;
+		session->breakpoint_addr = 0;
+		session->syscall_addr = 0;
+	}
+}
+
+#define CALL_RUNNING -2
+
+/**
+ *  Let the thread of a session go with the given registers, to run until it reaches a breakpoint.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in,out] call_regs
+ *  	The registers to start with.
+ *
+ *  @return
+ *  	0 if the thread is running, -1 on ptrace error.
+ *
+ */
+static int start_call(ProcessSession* session, struct user_regs_struct* call_regs)
+{
+	session->last_call_status = CALL_FAILED;
+	session->last_call_time = 0;
+
+	if((long) SYSCALL_PARAM(session->regs) >= 0)
+	{
+		// we appear to have interrupted a system call.
+		// prevent the kernel from attempting to reexecute the instruction that did the system call.
+		// (right away at least, after we restore the original registers, the syscall will be retried)
+
+		SYSCALL_PARAM(*call_regs) = -1;
+	}
+
+	// Execute!
+	if(ptrace(PTRACE_SETREGS, session->thread, NULL, call_regs) == -1)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &session->call_start);
+	ptrace(PTRACE_CONT, session->thread, NULL, NULL);
+
+	return 0;
+}
+
+static void end_call(ProcessSession* session, CallStatus status)
+{
+	session->last_call_status = status;
+	session->last_call_time = elapsed_ns(&session->call_start);
+	session->call_time += session->last_call_time;
+}
+
+/**
+ *  Deal with a change of state of the thread of a session while it runs code for us.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] status
+ *  	The wait status of the thread.
+ *
+ *  @param[out] call_regs
+ *  	Once the code is done, the registers the thread stopped with.
+ *
+ *  @return
+ *  	CALL_RUNNING if the code is still running. Otherwise 0 if the breakpoint was reached, the signal number
+ *  	if the thread faulted instead, -1 if it went away.
+ *
+ */
+static int call_stopped(ProcessSession* session, int status, struct user_regs_struct* call_regs)
+{
+	int thread = session->thread;
+
+	if(WIFEXITED(status) || WIFSIGNALED(status))
+	{
+		end_call(session, CALL_FAILED);
+		return -1;
+	}
+
+	if(!WIFSTOPPED(status))
+		return CALL_RUNNING;
+
+	// The code we called started a thread or process while the caller has asked to trace those.
+	// It is ours, not the target's, and the code may well be waiting for it, so let it go.
+	int event = status >> 16;
+	if(event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK || event == PTRACE_EVENT_CLONE)
+	{
+		unsigned long child;
+		int child_status;
+		if(ptrace(PTRACE_GETEVENTMSG, thread, NULL, &child) != -1
+				&& waitpid(child, &child_status, __WALL) != -1 && WIFSTOPPED(child_status))
+			ptrace(PTRACE_DETACH, child, NULL, NULL);
+	}
+
+	// Leftover interrupt, group-stop, or another event the tracer asked for; not something the code did.
+	if(event != 0)
+	{
+		ptrace(PTRACE_CONT, thread, NULL, NULL);
+		return CALL_RUNNING;
+	}
+
+	// We're stopped, but is it at our breakpoint?
+	if(WSTOPSIG(status) == SIGTRAP)
+	{
+		// yes, save the return value
+		end_call(session, CALL_OK);
+		ptrace(PTRACE_GETREGS, thread, NULL, call_regs);
+		return 0;
+	}
+
+	if(WSTOPSIG(status) == SIGSEGV || WSTOPSIG(status) == SIGILL
+		|| WSTOPSIG(status) == SIGFPE || WSTOPSIG(status) == SIGBUS)
+	{
+		end_call(session, CALL_FAULTED);
+		ptrace(PTRACE_GETREGS, thread, NULL, call_regs);
+		return WSTOPSIG(status);
+	}
+
+	// No, keep waiting for the right signal. The signal is meant for the process, not
+	// for our code, so pass it on once we're done.
+	if(!session->pending_signal)
+		session->pending_signal = WSTOPSIG(status);
+
+	ptrace(PTRACE_CONT, thread, NULL, NULL);
+	return CALL_RUNNING;
+}
+
+/**
+ *  Run a process attached to a session with the given registers until it reaches a breakpoint.
+ *  How it went and how long it took are recorded for session_last_call_status and session_last_call_time.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in,out] call_regs
+ *  	The registers to start with. On return, the registers the process stopped with.
+ *
+ *  @return
+ *  	0 if the breakpoint was reached, the signal number if the process faulted instead, -1 on ptrace error
+ *  	or if the call timed out.
+ *
+ */
+static int run_until_trap(ProcessSession* session, struct user_regs_struct* call_regs)
+{
+	if(start_call(session, call_regs) == -1)
+		return -1;
+
+	// Wait for process to reach our set breakpoint, which indicates our code has finished.
+	while(1)
+	{
+		int status;
+		int waited = wait_for_call(session, &status, &session->call_start);
+		if(waited == 0)
+		{
+			cancel_call(session);
+			end_call(session, CALL_TIMED_OUT);
+			return -1;
+		}
+
+		if(waited == -1)
+		{
+			end_call(session, CALL_FAILED);
+			return -1;
+		}
+
+		int ret = call_stopped(session, status, call_regs);
+		if(ret != CALL_RUNNING)
+			return ret;
+	}
+}
+
+/**
+ *  Call a AMD64 ABI function with all INTEGER class arguments.
+ *
+ *  @param[in] process
+ *  	The process's PID. The target process must not be attached to another process.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ * 
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @return
+ *  	Either the function return value or -1 for ptrace error (check errno if -1 is returned).
+ *
+ */
+uintptr_t call_function_in_target(int process, void* function, int numargs, ...)
+{
+	uintptr_t* args = (uintptr_t*) malloc(sizeof(uintptr_t) * numargs);
+
+	int i;
+	va_list ap;
+	va_start(ap, numargs);
+	for(i = 0; i < numargs; i++)
+	{
+		args[i] = va_arg(ap, uintptr_t);
+	}
+	va_end(ap);
+
+	uintptr_t ret = call_function_in_target_with_args(process, function, numargs, args);
+	free(args);
+
+	return ret;
+}
+	
+/**
+ *  Call a AMD64 ABI function with all INTEGER class arguments.
+ *
+ *  @param[in] process
+ *  	The process's PID. The target process must not be attached to another process.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ * 
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @return
+ *  	Either the function return value or -1 for ptrace error (check errno if -1 is returned).
+ *
+ */
+uintptr_t call_function_in_target_with_args(int process, void* function, int numargs, uintptr_t* args)
+{
+	if(!policy_allows(process, "calling functions in"))
+		return -1;
+
+	// If there's an agent in the process, have it make the call without stopping the process.
+	AgentConnection* agent = find_agent_connection(process);
+	if(agent && numargs <= AGENT_MAX_ARGS)
+		return agent_call_function_with_args(agent, function, numargs, args);
+
+	ProcessSession* session = open_process_session(process);
+	if(!session)
+		return -1;
+
+	uintptr_t ret = session_call_function_with_args(session, function, numargs, args);
+
+	close_process_session(session);
+
+	return ret;
+}
+
+/**
+ *  Call a AMD64 ABI function with all INTEGER class arguments in a process attached to a session.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ * 
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @return
+ *  	Either the function return value or -1 for ptrace error (check errno if -1 is returned).
+ *
+ */
+uintptr_t session_call_function(ProcessSession* session, void* function, int numargs, ...)
+{
+	uintptr_t* args = (uintptr_t*) malloc(sizeof(uintptr_t) * numargs);
+
+	int i;
+	va_list ap;
+	va_start(ap, numargs);
+	for(i = 0; i < numargs; i++)
+	{
+		args[i] = va_arg(ap, uintptr_t);
+	}
+	va_end(ap);
+
+	uintptr_t ret = session_call_function_with_args(session, function, numargs, args);
+	free(args);
+
+	return ret;
+}
+
+/**
+ *  Set up the stack of the thread of a session and work out the registers for a function call.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ * 
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @param[in] args
+ *  	Array of numargs arguments.
+ *
+ *  @param[out] regs
+ *  	The registers to start the call with.
+ *
+ *  @return
+ *  	0 on success, -1 if the session cannot make calls.
+ *
+ */
+static int prepare_call(ProcessSession* session, void* function, int numargs, uintptr_t* args,
+		struct user_regs_struct* regs)
+{
+	int process = session->process;
+	struct user_regs_struct call_regs;
+
+	if(!session->breakpoint_addr)
+	{
+		fprintf(stderr, "Error: session with process %d cannot make calls!\n", process);
+		return -1;
+	}
 
 	// Now we need to start setting up our call. We need to create a stack and register
 	// situation that will reflect the state just after a call instruction, with the
 	// return address as the real current rip.
 	
-	memcpy(&call_regs, &regs, sizeof(regs));
+	memcpy(&call_regs, &session->regs, sizeof(session->regs));
+
+	// align stack to 8
+	SP(call_regs) = (SP(call_regs) + 7) & ~(8 - 1);
+
+#if __WORDSIZE == 64
+	SP(call_regs) -= 128;	// Get past the 'red zone' allocated by amd64 abi
+				// This appears to break stack unwinding via DWARF, unfortunately, but oh well
+
+	// if after adding all the stack arguments, the stack pointer would not be 16 aligned, align it.
+	// this is required by the AMD64 ABI.
+	int stackargs = 0;
+	if(numargs > 6)
+		stackargs = numargs - 6;
+
+	if((SP(call_regs) + (stackargs * 8)) & (16 - 1))
+		SP(call_regs) += 8;
+#endif
+
+	// Loop through the arguments, assigning them to a register or pushing them onto the stack as appropriate.
+	// We do this backwards because we need to push stack arguments in reverse order
+	int i;
+	uintptr_t cur_arg;
+	for(i = (numargs - 1); i >= 0 ; --i)
+	{
+		cur_arg = args[i];
+		switch(i)
+		{
+			// These register arguments only apply to AMD64
+#if __WORDSIZE == 64
+			case 0:
+				call_regs.rdi = cur_arg;
+				break;
+
+			case 1:
+				call_regs.rsi = cur_arg;
+				break;
+
+			case 2:
+				call_regs.rdx = cur_arg;
+				break;
+			
+			case 3:
+				call_regs.rcx = cur_arg;
+				break;
+
+			case 4:
+				call_regs.r8 = cur_arg;
+				break;
+
+			case 5:
+				call_regs.r9 = cur_arg;
+				break;
+#endif
+			default:
+				// push this argument onto the stack
+				SP(call_regs) -= sizeof(cur_arg);
+				process_write(process, &cur_arg, sizeof(cur_arg), SP(call_regs));
+		}
+	}
+
+#if __WORDSIZE == 64
+	// Set the number of vector arguments to 0 for variable argument calls
+	// This should affect "normal" calls.
+	call_regs.rax = 0;
+#endif
+
+	// push return address onto the stack
+	SP(call_regs) -= sizeof(cur_arg);
+	process_write(process, &session->breakpoint_addr, sizeof(session->breakpoint_addr), SP(call_regs));
+
+	IP(call_regs) = (uintptr_t) function;
+
+	memcpy(regs, &call_regs, sizeof(call_regs));
+	return 0;
+}
+
+/**
+ *  Call a AMD64 ABI function with all INTEGER class arguments in a process attached to a session.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ * 
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @param[in] args
+ *  	Array of numargs arguments.
+ *
+ *  @return
+ *  	Either the function return value or -1 for ptrace error (check errno if -1 is returned).
+ *
+ */
+uintptr_t session_call_function_with_args(ProcessSession* session, void* function, int numargs, uintptr_t* args)
+{
+	int process = session->process;
+	struct user_regs_struct call_regs;
+
+	if(prepare_call(session, function, numargs, args, &call_regs) == -1)
+		return -1;
+
+	int fault = run_until_trap(session, &call_regs);
+	if(fault == -1)
+	{
+		if(session->last_call_status == CALL_TIMED_OUT)
+			fprintf(stderr, "Error: call to %p in process %d timed out after %.3f ms!\n",
+				function, process, session->last_call_time / 1000000.0);
+
+		return -1;
+	}
+
+	if(fault != 0)
+	{
+		// Our code screwed up the process. This is really really bad, but meh, most of
+		// the time I think we can just restore state and pretend nothing ever happened.
+		// Probably not too much memory got corrupted. The registers go back when the
+		// session is closed; put them back now too, in case the caller carries on.
+		
+		fprintf(stderr,
+			"Error: signal %d in attempted injection function call!\n",
+			fault);
+		ptrace(PTRACE_SETREGS, session->thread, NULL, &session->regs);
+		return -1;
+	}
+
+	return RETURN_REG(call_regs);
+}
+
+/**
+ *  Start a function call in a process attached to a session without waiting for it to finish, so calls in
+ *  many processes can run at once. The caller waits for the session's thread (see
+ *  session_thread) to change state by whatever means it likes and hands every wait status for it to
+ *  session_finish_call until that says the call is done. Nothing else may be done with the session meanwhile.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] function
+ *  	The address of the function to call.
+ * 
+ *  @param[in] numargs
+ *  	Number of parameters to pass into the function.
+ *
+ *  @param[in] args
+ *  	Array of numargs arguments.
+ *
+ *  @return
+ *  	0 if the call is running, -1 if it could not be started.
+ *
+ */
+int session_begin_call(ProcessSession* session, void* function, int numargs, uintptr_t* args)
+{
+	if(prepare_call(session, function, numargs, args, &session->call_regs) == -1)
+		return -1;
+
+	return start_call(session, &session->call_regs);
+}
+
+/**
+ *  Advance a call started with session_begin_call with a wait status of the session's thread.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] status
+ *  	The wait status, as returned by waitpid(session_thread(session), &status, __WALL).
+ *
+ *  @param[out] result
+ *  	Once the call is done, the function return value, or -1 if it failed (see session_last_call_status).
+ *
+ *  @return
+ *  	1 if the call is done, 0 if it is still running.
+ *
+ */
+int session_finish_call(ProcessSession* session, int status, uintptr_t* result)
+{
+	int fault = call_stopped(session, status, &session->call_regs);
+	if(fault == CALL_RUNNING)
+		return 0;
+
+	if(fault == 0)
+	{
+		*result = RETURN_REG(session->call_regs);
+		return 1;
+	}
+
+	if(fault != -1)
+	{
+		fprintf(stderr, "Error: signal %d in attempted injection function call!\n", fault);
+		ptrace(PTRACE_SETREGS, session->thread, NULL, &session->regs);
+	}
+
+	*result = -1;
+	return 1;
+}
+
+/**
+ *  Cancel a call started with session_begin_call that is taking too long, the way a call that runs into the
+ *  session's call timeout is cancelled. session_last_call_status says CALL_TIMED_OUT afterwards.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ */
+void session_cancel_call(ProcessSession* session)
+{
+	cancel_call(session);
+	end_call(session, CALL_TIMED_OUT);
+}
+
+/**
+ *  Returns how long the call currently running in a session has been running.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @return
+ *  	The time in nanoseconds.
+ *
+ */
+uint64_t session_call_running_time(ProcessSession* session)
+{
+	return elapsed_ns(&session->call_start);
+}
+
+/**
+ *  Makes a system call in a process attached to a session. No symbols need to be looked up for this,
+ *  so it works for any process, static and non-glibc ones included.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] number
+ *  	The system call number, as in sys/syscall.h.
+ *
+ *  @param[in] numargs
+ *  	The number of arguments the system call takes, up to 6.
+ *
+ *  @param[in] ...
+ *  	The arguments to the system call.
+ *
+ *  @return
+ *  	What the system call returned: -errno on failure.
+ *
+ */
+long session_syscall(ProcessSession* session, long number, int numargs, ...)
+{
+	uintptr_t args[6];
+	va_list arg_list;
+
+	if(numargs > 6)
+		return -EINVAL;
+
+	va_start(arg_list, numargs);
+
+	int i;
+	for(i = 0; i < numargs; i++)
+		args[i] = va_arg(arg_list, uintptr_t);
+
+	va_end(arg_list);
+
+	return session_syscall_with_args(session, number, numargs, args);
+}
+
+/**
+ *  Makes a system call in a process attached to a session.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] number
+ *  	The system call number, as in sys/syscall.h.
+ *
+ *  @param[in] numargs
+ *  	The number of arguments the system call takes, up to 6.
+ *
+ *  @param[in] args
+ *  	The arguments to the system call.
+ *
+ *  @return
+ *  	What the system call returned: -errno on failure. -ETIMEDOUT if the call was cancelled, -ESRCH if
+ *  	the process went away.
+ *
+ */
+long session_syscall_with_args(ProcessSession* session, long number, int numargs, uintptr_t* args)
+{
+	if(!session->syscall_addr)
+	{
+		fprintf(stderr, "Error: session with process %d cannot make calls!\n", session->process);
+		return -ENOSYS;
+	}
 
-	// align stack to 8
-	SP(call_regs) = (SP(call_regs) + 7) & ~(8 - 1);
+	if(numargs > 6)
+		return -EINVAL;
 
-#if __WORDSIZE == 64
-	SP(call_regs) -= 128;	// Get past the 'red zone' allocated by amd64 abi
-				// This appears to break stack unwinding via DWARF, unfortunately, but oh well
+	uintptr_t regs_args[6] = {0, 0, 0, 0, 0, 0};
+	memcpy(regs_args, args, sizeof(uintptr_t) * numargs);
 
-	// if after adding all the stack arguments, the stack pointer would not be 16 aligned, align it.
-	// this is required by the AMD64 ABI.
-	int stackargs = 0;
-	if(numargs > 6)
-		stackargs = numargs - 6;
+	struct user_regs_struct call_regs;
+	memcpy(&call_regs, &session->regs, sizeof(session->regs));
 
-	if((SP(call_regs) + (stackargs * 8)) & (16 - 1))
-		SP(call_regs) += 8;
+#if __WORDSIZE == 64
+	call_regs.rax = number;
+	call_regs.rdi = regs_args[0];
+	call_regs.rsi = regs_args[1];
+	call_regs.rdx = regs_args[2];
+	call_regs.r10 = regs_args[3];
+	call_regs.r8 = regs_args[4];
+	call_regs.r9 = regs_args[5];
+#else
+	call_regs.eax = number;
+	call_regs.ebx = regs_args[0];
+	call_regs.ecx = regs_args[1];
+	call_regs.edx = regs_args[2];
+	call_regs.esi = regs_args[3];
+	call_regs.edi = regs_args[4];
+	call_regs.ebp = regs_args[5];
 #endif
 
-	// Loop through the arguments, assigning them to a register or pushing them onto the stack as appropriate.
-	// We do this backwards because we need to push stack arguments in reverse order
-	int i;
-	uintptr_t cur_arg;
-	for(i = (numargs - 1); i >= 0 ; --i)
-	{
-		cur_arg = args[i];
-		switch(i)
-		{
-			// These register arguments only apply to AMD64
-#if __WORDSIZE == 64
-			case 0:
-				call_regs.rdi = cur_arg;
-				break;
+	IP(call_regs) = session->syscall_addr;
 
-			case 1:
-				call_regs.rsi = cur_arg;
-				break;
+	int fault = run_until_trap(session, &call_regs);
+	if(fault == -1)
+		return session->last_call_status == CALL_TIMED_OUT ? -ETIMEDOUT : -ESRCH;
 
-			case 2:
-				call_regs.rdx = cur_arg;
-				break;
-			
-			case 3:
-				call_regs.rcx = cur_arg;
-				break;
+	if(fault != 0)
+		return -EFAULT;
 
-			case 4:
-				call_regs.r8 = cur_arg;
-				break;
+	return (long) RETURN_REG(call_regs);
+}
 
-			case 5:
-				call_regs.r9 = cur_arg;
-				break;
-#endif
-			default:
-				// push this argument onto the stack
-				SP(call_regs) -= sizeof(cur_arg);
-				process_write(process, &cur_arg, sizeof(cur_arg), SP(call_regs));
-		}
+/**
+ *  Run code in a process attached to a session until it hits a breakpoint. The code starts with the
+ *  registers the process was stopped with, except for a 16 byte aligned stack pointer below the red
+ *  zone and a zeroed return register. It must end with an int3 instead of returning.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] address
+ *  	The address of the first instruction to execute.
+ *
+ *  @param[out] result
+ *  	If not NULL, the contents of the return register when the breakpoint was hit.
+ *
+ *  @return
+ *  	0 if the code ran until a breakpoint, the signal number if the code faulted, -1 on ptrace error or
+ *  	if the code timed out (see session_last_call_status).
+ *
+ */
+int session_execute(ProcessSession* session, uintptr_t address, uintptr_t* result)
+{
+	struct user_regs_struct call_regs;
+
+	if(!session->breakpoint_addr)
+	{
+		fprintf(stderr, "Error: session with process %d cannot make calls!\n", session->process);
+		return -1;
 	}
 
+	memcpy(&call_regs, &session->regs, sizeof(session->regs));
+
 #if __WORDSIZE == 64
-	// Set the number of vector arguments to 0 for variable argument calls
-	// This should affect "normal" calls.
-	call_regs.rax = 0;
+	SP(call_regs) -= 128;	// Get past the 'red zone' allocated by amd64 abi
 #endif
+	SP(call_regs) &= ~(16 - 1);
+	RETURN_REG(call_regs) = 0;
+	IP(call_regs) = address;
 
-	// push return address onto the stack
-	SP(call_regs) -= sizeof(cur_arg);
-	process_write(process, &breakpoint_addr, sizeof(breakpoint_addr), SP(call_regs));
+	int ret = run_until_trap(session, &call_regs);
 
-	IP(call_regs) = (uintptr_t) function;
-	if(SYSCALL_PARAM(regs) >= 0)
-	{
-		// we appear to have interrupted a system call.
-		// prevent the kernel from attempting to reexecute the instruction that did the system call.
-		// (right away at least, after we restore the original registers, the syscall will be retried)
+	if(ret != -1 && result)
+		*result = RETURN_REG(call_regs);
+
+	return ret;
+}
+
+/**
+ *  Loads a shared object file into the specified process.
+ *
+ *  @param[in] process
+ *  	The process's PID. The target process must not be attached to another process.
+ *
+ *  @param[in] filename
+ *  	The full path of the .so file.
+ *
+ *  @return
+ *  	Returns a handle to the dynamically loaded library, or NULL if there was any error.
+ *
+ */
+void* inject_so(int process, const char* filename)
+{
+	// finding dlopen can take a while, so do it before anything is stopped
+	LibraryCalls calls;
+	find_library_calls(process, &calls);
+
+	// loading code into a running process; keep every thread out of the way while we do it
+	ProcessSession* session = open_process_session_with_flags(process, SESSION_ALL_THREADS);
+	if(!session)
+		return NULL;
+
+	void* ret = session_inject_so(session, &calls, filename);
+
+	close_process_session(session);
+
+	return ret;
+}
+
+/**
+ *  Loads a shared object file into a process attached to a session.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] calls
+ *  	The process's library functions, found with find_library_calls before the session was opened.
+ *
+ *  @param[in] filename
+ *  	The full path of the .so file.
+ *
+ *  @return
+ *  	Returns a handle to the dynamically loaded library, or NULL if there was any error.
+ *
+ */
+void* session_inject_so(ProcessSession* session, const LibraryCalls* calls, const char* filename)
+{
+	if(!calls->dlopen)
+		return NULL;
+
+	// Get the full path of the file
+	char resolved_path[PATH_MAX];
+	char* path = realpath(filename, resolved_path);
+
+	if(!path)
+		return NULL;
+
+	// Copy the filename of the .so into the target process
+	uintptr_t fileNameString = scratch_push(session_scratch(session), session, path, strlen(path) + 1);
+	if(!fileNameString)
+		return NULL;
+
+	// do dlopen
+	uintptr_t ret = session_call_function(session, calls->dlopen,
+			2, fileNameString, RTLD_NOW | calls->mode_flags);
+	if(session->last_call_status != CALL_OK)
+		return NULL;
+
+	return (void*) ret;
+}
 
-		SYSCALL_PARAM(call_regs) = -1;
+#define LEAVE_LIBRARY_TRIES 20		/// Times a thread is let run to get it out of a library before we give up.
+
+/**
+ *  Whether an address lies in one of the mappings of a file.
+ *
+ */
+static int in_regions(uintptr_t address, MemoryRegion* regions, int count, const char* path)
+{
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		if(address >= regions[i].start && address < regions[i].end && strcmp(regions[i].path, path) == 0)
+			return 1;
 	}
 
-	// Execute!
-	ptrace(PTRACE_SETREGS, process, NULL, &call_regs);
-	ptrace(PTRACE_CONT, process, NULL, NULL);
+	return 0;
+}
 
-	// Wait for process to reach our set breakpoint, which indicates our function call has returned.
-	while(1)
+/**
+ *  Make sure no thread a session stopped is executing a library, so it can be unloaded. Threads stopped
+ *  inside it are let run for a moment and stopped again, a few times at most. Threads the session did not
+ *  stop and return addresses further up the stacks aren't looked at.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] path
+ *  	The path the library was loaded from.
+ *
+ *  @return
+ *  	1 if no stopped thread is in the library, 0 if some still are or the mappings could not be read.
+ *
+ */
+static int session_leave_library(ProcessSession* session, const char* path)
+{
+	char resolved_path[PATH_MAX];
+	if(!realpath(path, resolved_path))
+		strcpy(resolved_path, path);
+
+	MemoryRegion* regions;
+	int count = find_memory_regions(session->process, &regions);
+	if(count < 0)
+		return 0;
+
+	// the session's thread gets its registers back when the session is closed, so it can't be moved on
+	if(in_regions(IP(session->regs), regions, count, resolved_path))
+	{
+		free(regions);
+		return 0;
+	}
+
+	int tries;
+	int clear = 0;
+	for(tries = 0; tries <= LEAVE_LIBRARY_TRIES && !clear; tries++)
 	{
-		waitpid(process, &status, 0);
+		clear = 1;
 
-		if(WIFSTOPPED(status))
+		int i;
+		for(i = 0; i < session->num_threads; i++)
 		{
-			// We're stopped, but is it at our breakpoint?
-			if(WSTOPSIG(status) == SIGTRAP)
+			StoppedThread* thread = &session->threads[i];
+			struct user_regs_struct regs;
+			if(ptrace(PTRACE_GETREGS, thread->tid, NULL, &regs) == -1
+					|| !in_regions(IP(regs), regions, count, resolved_path))
+				continue;
+
+			// a thread holding on to a signal would have to take it to run
+			clear = 0;
+			if(tries == LEAVE_LIBRARY_TRIES || thread->pending_signal
+					|| ptrace(PTRACE_CONT, thread->tid, NULL, NULL) == -1)
+				continue;
+
+			usleep(1000);
+
+			int signal;
+			if(ptrace(PTRACE_INTERRUPT, thread->tid, NULL, NULL) == -1 || wait_for_stop(thread->tid, &signal) == -1)
 			{
-				// yes, continue with restoring original state
-				break;
+				// thread went away
+				session->threads[i] = session->threads[--session->num_threads];
+				--i;
+				continue;
 			}
-			else
-			{
-				if(WSTOPSIG(status) == SIGSEGV || WSTOPSIG(status) == SIGILL || WSTOPSIG(status) == SIGFPE)
-				{
-					// Our code screwed up the process. This is really really bad, but meh, most of
-					// the time I think we can just restore state and pretend nothing ever happened.
-					// Probably not too much memory got corrupted.
-					
-					fprintf(stderr,
-						"Error: signal %d in attempted injection function call!\n",
-						WSTOPSIG(status));
-					kill(process, WSTOPSIG(status));		// resend the signal
-					ptrace(PTRACE_DETACH, process, NULL, NULL);
-					exit(0);
-					break;
-				}
 
-				// No, keep waiting for the right signal.
-				ptrace(PTRACE_CONT, process, NULL, NULL);
-			}
+			thread->pending_signal = signal;
 		}
 	}
 
-	// Save return value
-	ptrace(PTRACE_GETREGS, process, NULL, &call_regs);
-	ret = RETURN_REG(call_regs);
+	free(regions);
+	return clear;
+}
 
-	// Restore the old instructions here
-	process_write(process, backup, sizeof(backup), breakpoint_addr);
+/**
+ *  Replaces a library loaded into the specified process with another build of it, stopping the process once.
+ *
+ *  @param[in] process
+ *  	The process's PID. The target process must not be attached to another process.
+ *
+ *  @param[in] handle
+ *  	The handle of the library to replace.
+ *
+ *  @param[in] filename
+ *  	The path of the .so file to replace it with.
+ *
+ *  @return
+ *  	Returns a handle to the new library, or NULL if there was any error.
+ *
+ */
+void* reload_so(int process, void* handle, const char* filename)
+{
+	LibraryCalls calls;
+	find_library_calls(process, &calls);
 
-	// Restore backed up registers
-	ptrace(PTRACE_SETREGS, process, NULL, &regs);
+	ProcessSession* session = open_process_session_with_flags(process, SESSION_ALL_THREADS);
+	if(!session)
+		return NULL;
 
-detach:
+	void* ret = session_reload_so(session, &calls, handle, filename);
 
-	ptrace(PTRACE_DETACH, process, NULL, NULL);
+	close_process_session(session);
 
 	return ret;
 }
 
 /**
- *  Loads a shared object file into the specified process.
+ *  Replaces a library loaded into a process attached to a session with another build of it.
  *
- *  @param[in] process
- *  	The process's PID. The target process must not be attached to another process.
+ *  Libraries install their hooks (GOT entries, trampolines) from their constructor and remove them from their
+ *  destructor. To move the hooks from one build to the next without the process ever running uninstrumented,
+ *  everything happens within the one session, which should have every thread stopped:
+ *
+ *  1. If the old library exports RELOAD_EXPORT_SYMBOL (void* lcitk_reload_export(void)), it is called. It must
+ *     remove the library's hooks and return its state; from then on its destructor must leave both alone.
+ *     Otherwise the old library is unloaded first, so its destructor removes the hooks.
+ *  2. The new library is loaded and its constructor installs its hooks over the original functions.
+ *  3. If the new library exports RELOAD_IMPORT_SYMBOL (void lcitk_reload_import(void* state)), it is called
+ *     with the state returned in step 1, or NULL if there was none.
+ *  4. The old library is unloaded, if that did not already happen.
+ *
+ *  If the new library cannot be loaded after the old one handed over its state, the state is given back to the
+ *  old library through its own RELOAD_IMPORT_SYMBOL, which must then put its hooks back. If the old library
+ *  was already unloaded, it is loaded again from its path, possibly under another handle.
+ *
+ *  The old library is only unloaded once no stopped thread is executing it; threads stopped inside it are let
+ *  run for a moment first. If one doesn't leave, a library without RELOAD_EXPORT_SYMBOL isn't replaced at all
+ *  and one with it is left loaded.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] calls
+ *  	The process's library functions, found with find_library_calls before the session was opened.
+ *
+ *  @param[in] handle
+ *  	The handle of the library to replace.
  *
  *  @param[in] filename
- *  	The full path of the .so file.
+ *  	The path of the .so file to replace it with. dlopen identifies libraries by path, so this must not be
+ *  	the path the old library was loaded from.
  *
  *  @return
- *  	Returns a handle to the dynamically loaded library, or NULL if there was any error.
+ *  	Returns a handle to the new library, or NULL if there was any error.
  *
  */
-void* inject_so(int process, const char* filename)
+void* session_reload_so(ProcessSession* session, const LibraryCalls* calls, void* handle, const char* filename)
 {
-	// Get the full path of the file
+	int process = session->process;
+
 	char resolved_path[PATH_MAX];
 	char* path = realpath(filename, resolved_path);
-
 	if(!path)
 		return NULL;
 
-	// Allocate room in the target process for the filename of the .so
-	uintptr_t fileNameString =
-		call_function_in_target(process, find_libc_function(process, "mmap"),
-			6, 0, strlen(path) + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+	if(find_library_handle(process, path))
+	{
+		fprintf(stderr, "Error: %s is already loaded in process %d; the new build needs a path of its own.\n",
+				path, process);
+		return NULL;
+	}
+
+	char old_path[PATH_MAX];
+	if(!find_library_path(process, handle, old_path))
+	{
+		fprintf(stderr, "Error: %p is not the handle of a library loaded in process %d.\n", handle, process);
+		return NULL;
+	}
 
-	// Write the filename of the .so into the target process
-	process_write(process, path, strlen(path) + 1, fileNameString);
+	void* target_dlopen = calls->dlopen;
+	void* target_dlclose = calls->dlclose;
+	void* target_dlsym = calls->dlsym;
+	int mode_flags = calls->mode_flags;
+	if(!target_dlopen || !target_dlclose || !target_dlsym)
+		return NULL;
 
-	// do dlopen
-	uintptr_t ret = call_function_in_target(process, find_libc_function(process, "__libc_dlopen_mode"),
-			2, fileNameString, RTLD_NOW | __RTLD_DLOPEN);
-	
-	// Free the filename of the .so
-	call_function_in_target(process, find_libc_function(process, "munmap"), 2, fileNameString, strlen(path) + 1);
+	ScratchArena* scratch = session_scratch(session);
+	uintptr_t path_string = scratch_push(scratch, session, path, strlen(path) + 1);
+	uintptr_t old_path_string = scratch_push(scratch, session, old_path, strlen(old_path) + 1);
+	uintptr_t export_string = scratch_push(scratch, session, RELOAD_EXPORT_SYMBOL, sizeof(RELOAD_EXPORT_SYMBOL));
+	uintptr_t import_string = scratch_push(scratch, session, RELOAD_IMPORT_SYMBOL, sizeof(RELOAD_IMPORT_SYMBOL));
+	if(!path_string || !old_path_string || !export_string || !import_string)
+		return NULL;
+
+	uintptr_t export_state = session_call_function(session, target_dlsym, 2, (uintptr_t) handle, export_string);
+	if(session->last_call_status != CALL_OK)
+		return NULL;
+
+	uintptr_t state = 0;
+	if(export_state)
+		state = session_call_function(session, (void*) export_state, 0);
+	else if(session_leave_library(session, old_path))
+		session_call_function(session, target_dlclose, 1, (uintptr_t) handle);
+	else
+	{
+		fprintf(stderr, "Error: a thread of process %d is executing %s, which cannot be unloaded.\n",
+				process, old_path);
+		return NULL;
+	}
+
+	// if the library didn't get to let go of its hooks, loading another build on top would make a mess
+	if(session->last_call_status != CALL_OK)
+		return NULL;
+
+	uintptr_t ret = session_call_function(session, target_dlopen, 2, path_string, RTLD_NOW | mode_flags);
+	if(session->last_call_status != CALL_OK || !ret)
+	{
+		fprintf(stderr, "Error: could not load %s into process %d.\n", path, process);
+
+		if(export_state)
+		{
+			uintptr_t import_state = session_call_function(session, target_dlsym, 2,
+					(uintptr_t) handle, import_string);
+			if(session->last_call_status == CALL_OK && import_state)
+				session_call_function(session, (void*) import_state, 1, state);
+
+			if(session->last_call_status != CALL_OK || !import_state)
+				fprintf(stderr, "Error: the old library cannot take its state back; its hooks are gone.\n");
+		}
+		else
+		{
+			// the old library is gone already; loading it again has its constructor put the hooks back
+			uintptr_t old_handle = session_call_function(session, target_dlopen, 2, old_path_string,
+					RTLD_NOW | mode_flags);
+			if(session->last_call_status != CALL_OK || !old_handle)
+				fprintf(stderr, "Error: could not load %s back; its hooks are gone.\n", old_path);
+			else if(old_handle != (uintptr_t) handle)
+				fprintf(stderr, "Error: %s was loaded back with the new handle %p.\n", old_path, (void*) old_handle);
+		}
+
+		return NULL;
+	}
+
+	uintptr_t import_state = session_call_function(session, target_dlsym, 2, ret, import_string);
+	if(session->last_call_status == CALL_OK && import_state)
+		session_call_function(session, (void*) import_state, 1, state);
+
+	if(session->last_call_status != CALL_OK)
+		fprintf(stderr, "Error: %s did not finish taking over the state of %s.\n", path, old_path);
+
+	// a thread that can't be got out of the old library keeps it loaded, which costs nothing but memory
+	if(export_state)
+	{
+		if(session_leave_library(session, old_path))
+			session_call_function(session, target_dlclose, 1, (uintptr_t) handle);
+		else
+			fprintf(stderr, "Error: a thread of process %d is executing %s; leaving it loaded.\n",
+					process, old_path);
+	}
 
 	return (void*) ret;
 }
@@ -429,9 +2484,42 @@ void* inject_so(int process, const char* filename)
  */
 int uninject_so(int process, void* handle)
 {
-	// do dlclose
-	return call_function_in_target(process, find_libc_function(process, "__libc_dlclose"),
-			1, (uintptr_t) handle);
+	LibraryCalls calls;
+	find_library_calls(process, &calls);
+
+	ProcessSession* session = open_process_session_with_flags(process, SESSION_ALL_THREADS);
+	if(!session)
+		return -1;
+
+	int ret = session_uninject_so(session, &calls, handle);
+
+	close_process_session(session);
+
+	return ret;
 }
 
+/**
+ *  Unloads a shared object file from a process attached to a session.
+ *
+ *  @param[in] session
+ *  	The session handle.
+ *
+ *  @param[in] calls
+ *  	The process's library functions, found with find_library_calls before the session was opened.
+ *
+ *  @param[in] handle
+ *  	The handle returned by inject_so.
+ *
+ *  @return
+ *  	0 on success, non-zero on error.
+ *
+ */
+int session_uninject_so(ProcessSession* session, const LibraryCalls* calls, void* handle)
+{
+	if(!calls->dlclose)
+		return -1;
+
+	// do dlclose
+	return session_call_function(session, calls->dlclose, 1, (uintptr_t) handle);
+}
 
@@ -5,12 +5,88 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include "objdump.h"
 
+struct ProcessSession;
+typedef struct ProcessSession ProcessSession;
+
+struct ScratchArena;
+
+/**
+ * One region of a vectored read from another process.
+ *
+ */
+typedef struct RemoteIOVec
+{
+	uintptr_t addr;			/// Address in the target process to read from.
+	size_t len;			/// Number of bytes to read.
+	void* buf;			/// Local buffer receiving the bytes.
+	ssize_t result;			/// Number of bytes actually read, -1 if none.
+} RemoteIOVec;
+
+#define POLICY_OBSERVE_ONLY 1		/// Never stop, write to or run code in a process; only read its memory.
+
+void set_process_policy(int policy);
+int process_policy();
 void process_read(int process, void* buf, size_t count, uintptr_t addr);
-void process_write(int process, const void* buf, size_t count, uintptr_t addr);
+int process_readv(int process, RemoteIOVec* vecs, int count);
+ssize_t process_write(int process, const void* buf, size_t count, uintptr_t addr);
 uintptr_t call_function_in_target(int process, void* function, int numargs, ...);
 uintptr_t call_function_in_target_with_args(int process, void* function, int numargs, uintptr_t* args);
 void* inject_so(int process, const char* filename);
 int uninject_so(int process, void* handle);
+void* reload_so(int process, void* handle, const char* filename);
+
+#define SESSION_ALL_THREADS 1		/// Stop every thread of the process, not just the main thread.
+#define SESSION_NO_CALLS 2		/// Only hold the process still; remote calls are not possible.
+#define SESSION_ATTACHED 4		/// The caller already traces the process and has it stopped.
+#define SESSION_IDLE_THREAD 8		/// Make calls on a thread blocked in a system call, not the main thread.
+
+#define RELOAD_EXPORT_SYMBOL "lcitk_reload_export"	/// void* (void): unhook and hand over state on reload.
+#define RELOAD_IMPORT_SYMBOL "lcitk_reload_import"	/// void (void* state): adopt state handed over on reload.
+
+/**
+ * How a remote call ended.
+ *
+ */
+typedef enum CallStatus
+{
+	CALL_OK,			/// The call returned.
+	CALL_FAILED,			/// The call could not be made, or the process went away.
+	CALL_FAULTED,			/// The called code crashed; the process state was restored.
+	CALL_TIMED_OUT			/// The call took too long and was cancelled.
+} CallStatus;
+
+ProcessSession* open_process_session(int process);
+ProcessSession* open_process_session_with_flags(int process, int flags);
+ProcessSession* open_thread_session(int process, int thread, int flags);
+int find_idle_thread(int process);
+uint64_t close_process_session(ProcessSession* session);
+uint64_t session_quiesce_time(ProcessSession* session);
+int session_stopped_threads(ProcessSession* session);
+int session_pending_signal(ProcessSession* session);
+void session_set_call_timeout(ProcessSession* session, uint64_t timeout);
+CallStatus session_last_call_status(ProcessSession* session);
+uint64_t session_last_call_time(ProcessSession* session);
+uint64_t session_call_time(ProcessSession* session);
+int session_process(ProcessSession* session);
+int session_thread(ProcessSession* session);
+struct ScratchArena* session_scratch(ProcessSession* session);
+void session_read(ProcessSession* session, void* buf, size_t count, uintptr_t addr);
+ssize_t session_write(ProcessSession* session, const void* buf, size_t count, uintptr_t addr);
+uintptr_t session_call_function(ProcessSession* session, void* function, int numargs, ...);
+uintptr_t session_call_function_with_args(ProcessSession* session, void* function, int numargs, uintptr_t* args);
+int session_begin_call(ProcessSession* session, void* function, int numargs, uintptr_t* args);
+int session_finish_call(ProcessSession* session, int status, uintptr_t* result);
+void session_cancel_call(ProcessSession* session);
+uint64_t session_call_running_time(ProcessSession* session);
+long session_syscall(ProcessSession* session, long number, int numargs, ...);
+long session_syscall_with_args(ProcessSession* session, long number, int numargs, uintptr_t* args);
+int session_execute(ProcessSession* session, uintptr_t address, uintptr_t* result);
+void* session_inject_so(ProcessSession* session, const LibraryCalls* calls, const char* filename);
+int session_uninject_so(ProcessSession* session, const LibraryCalls* calls, void* handle);
+void* session_reload_so(ProcessSession* session, const LibraryCalls* calls, void* handle,
+		const char* filename);
 
 #endif
@@ -0,0 +1,433 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "scan.h"
+#include "process.h"
+#include "objdump.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Scans read the target's memory in big chunks, one process_vm_readv each, and search them while they
+// are still in cache. Chunks are handed out to a pool of threads, so searching one chunk overlaps with
+// reading the next.
+
+#define SCAN_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * A range of the target to search. Matches may start anywhere in [start, start + size); the read
+ * extends past that by the pattern length so matches straddling two chunks are found once.
+ *
+ */
+typedef struct ScanChunk
+{
+	uintptr_t start;
+	size_t size;
+	size_t read_size;		/// Bytes to read, the overlap included.
+} ScanChunk;
+
+/**
+ * Matches found by one thread.
+ *
+ */
+typedef struct ScanResults
+{
+	uintptr_t* matches;
+	int count;
+	int capacity;
+	size_t bytes_scanned;
+} ScanResults;
+
+/**
+ * A scan, shared by its threads.
+ *
+ */
+typedef struct Scan
+{
+	int process;
+	int mem_fd;			/// /proc/pid/mem, for chunks process_vm_readv won't read.
+	const unsigned char* pattern;
+	size_t length;
+	size_t alignment;
+	ScanChunk* chunks;
+	int num_chunks;
+	int next_chunk;			/// Index of the next chunk to hand out.
+} Scan;
+
+static void add_match(ScanResults* results, uintptr_t address)
+{
+	if(results->count == results->capacity)
+	{
+		results->capacity = results->capacity ? results->capacity * 2 : 256;
+		results->matches = (uintptr_t*) realloc(results->matches, sizeof(uintptr_t) * results->capacity);
+	}
+
+	results->matches[results->count++] = address;
+}
+
+/**
+ *  Finds every aligned occurrence of a pattern as long as its alignment (4 or 8 bytes), which is what
+ *  looking for a pointer or integer value comes down to.
+ *
+ */
+static void search_aligned(Scan* scan, const unsigned char* buf, size_t size, uintptr_t base, ScanResults* results)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// Compare as 32-bit lanes; an 8-byte value matches where both halves do. Four vectors are
+	// checked at a time and most iterations see no candidate at all.
+	__m128i needle;
+	int lane_mask;
+	if(scan->length == 8)
+	{
+		uint64_t value;
+		memcpy(&value, scan->pattern, sizeof(value));
+		needle = _mm_set1_epi64x(value);
+		lane_mask = 0xff;
+	}
+	else
+	{
+		uint32_t value;
+		memcpy(&value, scan->pattern, sizeof(value));
+		needle = _mm_set1_epi32(value);
+		lane_mask = 0xf;
+	}
+
+	for(; i + 64 <= size; i += 64)
+	{
+		__m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf + i)), needle);
+		__m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf + i + 16)), needle);
+		__m128i c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf + i + 32)), needle);
+		__m128i d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(buf + i + 48)), needle);
+
+		if(!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))))
+			continue;
+
+		__m128i vectors[4] = { a, b, c, d };
+		int v;
+		for(v = 0; v < 4; v++)
+		{
+			int mask = _mm_movemask_epi8(vectors[v]);
+			int lane;
+			for(lane = 0; lane < 16; lane += scan->length)
+			{
+				if(((mask >> lane) & lane_mask) == lane_mask)
+					add_match(results, base + i + v * 16 + lane);
+			}
+		}
+	}
+#endif
+
+	for(; i + scan->length <= size; i += scan->length)
+	{
+		if(memcmp(buf + i, scan->pattern, scan->length) == 0)
+			add_match(results, base + i);
+	}
+}
+
+/**
+ *  Finds every occurrence of a pattern that starts in the first size bytes of buf and fits in buf_size.
+ *
+ */
+static void search_bytes(Scan* scan, const unsigned char* buf, size_t size, size_t buf_size, uintptr_t base,
+		ScanResults* results)
+{
+	size_t length = scan->length;
+	if(buf_size < length)
+		return;
+
+	// last position a match can start at
+	size_t end = buf_size - length + 1;
+	if(end > size)
+		end = size;
+
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// Look for the first and last byte of the pattern 16 positions at a time and only compare the
+	// rest where both are found.
+	if(length > 1)
+	{
+		__m128i first = _mm_set1_epi8(scan->pattern[0]);
+		__m128i last = _mm_set1_epi8(scan->pattern[length - 1]);
+
+		for(; i + 16 <= end && i + length - 1 + 16 <= buf_size; i += 16)
+		{
+			__m128i block_first = _mm_loadu_si128((const __m128i*)(buf + i));
+			__m128i block_last = _mm_loadu_si128((const __m128i*)(buf + i + length - 1));
+			int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+						_mm_cmpeq_epi8(last, block_last)));
+
+			while(mask)
+			{
+				int bit = __builtin_ctz(mask);
+				mask &= mask - 1;
+
+				uintptr_t address = base + i + bit;
+				if((address % scan->alignment) == 0 && memcmp(buf + i + bit + 1, scan->pattern + 1, length - 2) == 0)
+					add_match(results, address);
+			}
+		}
+	}
+#endif
+
+	while(i < end)
+	{
+		const unsigned char* found = (const unsigned char*) memmem(buf + i, buf_size - i, scan->pattern, length);
+		if(!found || (size_t)(found - buf) >= end)
+			break;
+
+		i = found - buf;
+		if(((base + i) % scan->alignment) == 0)
+			add_match(results, base + i);
+
+		++i;
+	}
+}
+
+static void* scan_worker(void* arg)
+{
+	Scan* scan = (Scan*) arg;
+	ScanResults* results = (ScanResults*) calloc(1, sizeof(ScanResults));
+	unsigned char* buf = (unsigned char*) malloc(SCAN_CHUNK_SIZE + scan->length);
+
+	while(1)
+	{
+		int i = __atomic_fetch_add(&scan->next_chunk, 1, __ATOMIC_RELAXED);
+		if(i >= scan->num_chunks)
+			break;
+
+		ScanChunk* chunk = &scan->chunks[i];
+
+		RemoteIOVec vec = { chunk->start, chunk->read_size, buf, 0 };
+		process_readv(scan->process, &vec, 1);
+
+		// Some mappings can only be read through /proc/pid/mem.
+		ssize_t got = vec.result;
+		if(got <= 0 && scan->mem_fd != -1)
+			got = pread(scan->mem_fd, buf, chunk->read_size, chunk->start);
+
+		if(got <= 0)
+			continue;
+
+		size_t size = (size_t) got < chunk->size ? (size_t) got : chunk->size;
+		results->bytes_scanned += size;
+
+		if(scan->alignment == scan->length && (scan->length == 4 || scan->length == 8))
+			search_aligned(scan, buf, size, chunk->start, results);
+		else
+			search_bytes(scan, buf, chunk->size, got, chunk->start, results);
+	}
+
+	free(buf);
+	return results;
+}
+
+static int compare_addresses(const void* a, const void* b)
+{
+	uintptr_t x = *(const uintptr_t*) a;
+	uintptr_t y = *(const uintptr_t*) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ *  Finds every occurrence of a byte pattern in the readable memory of a process. The process is not
+ *  stopped, so memory that changes during the scan may or may not be matched.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] pattern
+ *  	The bytes to look for.
+ *
+ *  @param[in] length
+ *  	Number of bytes in the pattern.
+ *
+ *  @param[in] alignment
+ *  	Only matches at addresses that are a multiple of this are reported. 1 for all matches.
+ *
+ *  @param[in] num_threads
+ *  	Number of threads to search with, 0 for one per CPU.
+ *
+ *  @param[out] matches
+ *  	Set to a malloc'd array of the addresses of the matches, in ascending order. This must be freed by the caller.
+ *
+ *  @param[out] bytes_scanned
+ *  	If not NULL, set to the number of bytes of memory searched.
+ *
+ *  @return
+ *  	The number of matches, or -1 on error.
+ *
+ */
+int scan_process(int process, const void* pattern, size_t length, size_t alignment, int num_threads,
+		uintptr_t** matches, size_t* bytes_scanned)
+{
+	*matches = NULL;
+	if(bytes_scanned)
+		*bytes_scanned = 0;
+
+	if(length == 0 || length > SCAN_CHUNK_SIZE)
+		return -1;
+
+	if(alignment == 0)
+		alignment = 1;
+
+	MemoryRegion* regions;
+	int num_regions = find_memory_regions(process, &regions);
+	if(num_regions < 0)
+		return -1;
+
+	Scan scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.process = process;
+	scan.pattern = (const unsigned char*) pattern;
+	scan.length = length;
+	scan.alignment = alignment;
+
+	// cut every readable mapping into chunks
+	int capacity = 256;
+	scan.chunks = (ScanChunk*) malloc(sizeof(ScanChunk) * capacity);
+
+	int i;
+	for(i = 0; i < num_regions; i++)
+	{
+		MemoryRegion* region = &regions[i];
+
+		if(region->permissions[0] != 'r')
+			continue;
+
+		// these can't be read from another process, or aren't worth it
+		if(strcmp(region->path, "[vvar]") == 0 || strcmp(region->path, "[vvar_vclock]") == 0
+				|| strcmp(region->path, "[vsyscall]") == 0)
+			continue;
+
+		uintptr_t start;
+		for(start = region->start; start < region->end; start += SCAN_CHUNK_SIZE)
+		{
+			if(scan.num_chunks == capacity)
+			{
+				capacity *= 2;
+				scan.chunks = (ScanChunk*) realloc(scan.chunks, sizeof(ScanChunk) * capacity);
+			}
+
+			ScanChunk* chunk = &scan.chunks[scan.num_chunks++];
+			chunk->start = start;
+			chunk->size = region->end - start < SCAN_CHUNK_SIZE ? region->end - start : SCAN_CHUNK_SIZE;
+			chunk->read_size = chunk->size;
+			if(start + chunk->size < region->end)
+			{
+				chunk->read_size += length - 1;
+				if(start + chunk->read_size > region->end)
+					chunk->read_size = region->end - start;
+			}
+		}
+	}
+
+	free(regions);
+
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "/proc/%d/mem", process);
+	scan.mem_fd = open(buf, O_RDONLY);
+
+	if(num_threads <= 0)
+		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(num_threads > scan.num_chunks)
+		num_threads = scan.num_chunks;
+
+	if(num_threads < 1)
+		num_threads = 1;
+
+	// search
+	pthread_t* threads = (pthread_t*) malloc(sizeof(pthread_t) * num_threads);
+	ScanResults** results = (ScanResults**) malloc(sizeof(ScanResults*) * num_threads);
+	int started = 0;
+	for(i = 1; i < num_threads; i++)
+	{
+		if(pthread_create(&threads[started], NULL, scan_worker, &scan) != 0)
+			break;
+
+		++started;
+	}
+
+	// this thread does its share too
+	ScanResults* own_results = (ScanResults*) scan_worker(&scan);
+
+	for(i = 0; i < started; i++)
+		pthread_join(threads[i], (void**) &results[i]);
+
+	results[started] = own_results;
+
+	// gather up the matches
+	int count = 0;
+	for(i = 0; i <= started; i++)
+		count += results[i]->count;
+
+	*matches = (uintptr_t*) malloc(sizeof(uintptr_t) * (count ? count : 1));
+
+	int pos = 0;
+	for(i = 0; i <= started; i++)
+	{
+		if(results[i]->count)
+			memcpy(*matches + pos, results[i]->matches, sizeof(uintptr_t) * results[i]->count);
+
+		pos += results[i]->count;
+
+		if(bytes_scanned)
+			*bytes_scanned += results[i]->bytes_scanned;
+
+		free(results[i]->matches);
+		free(results[i]);
+	}
+
+	qsort(*matches, count, sizeof(uintptr_t), compare_addresses);
+
+	free(results);
+	free(threads);
+
+	if(scan.mem_fd != -1)
+		close(scan.mem_fd);
+
+	free(scan.chunks);
+
+	return count;
+}
+
+/**
+ *  Finds every place in the readable memory of a process that holds a pointer to the given value,
+ *  for instance to find out what refers to an object.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] value
+ *  	The pointer value to look for. Only naturally aligned occurrences are found.
+ *
+ *  @param[in] num_threads
+ *  	Number of threads to search with, 0 for one per CPU.
+ *
+ *  @param[out] matches
+ *  	Set to a malloc'd array of the addresses holding the value, in ascending order. This must be freed
+ *  	by the caller.
+ *
+ *  @param[out] bytes_scanned
+ *  	If not NULL, set to the number of bytes of memory searched.
+ *
+ *  @return
+ *  	The number of matches, or -1 on error.
+ *
+ */
+int scan_for_pointer(int process, uintptr_t value, int num_threads, uintptr_t** matches, size_t* bytes_scanned)
+{
+	return scan_process(process, &value, sizeof(value), sizeof(value), num_threads, matches, bytes_scanned);
+}
@@ -0,0 +1,11 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+int scan_process(int process, const void* pattern, size_t length, size_t alignment, int num_threads,
+		uintptr_t** matches, size_t* bytes_scanned);
+int scan_for_pointer(int process, uintptr_t value, int num_threads, uintptr_t** matches, size_t* bytes_scanned);
+
+#endif
@@ -0,0 +1,858 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "snapshot.h"
+#include "process.h"
+#include "objdump.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A snapshot is a base copy of the writable memory of a process followed by any number of deltas.
+// Instead of copying the whole address space for every delta, the kernel's soft-dirty bits tell us
+// which pages were written to since the previous one: writing "4" to /proc/pid/clear_refs clears them,
+// and bit 55 of each page's entry in /proc/pid/pagemap is set again on the next write. Kernels built
+// without soft-dirty tracking get every populated page compared against its last capture instead.
+//
+// Everything is appended to a memory-mapped file as page records, so pages are read from the target
+// straight into the file, and the file can be opened again later with open_snapshot.
+
+#define SNAPSHOT_MAGIC 0x50534c4c	// "LLSP"
+#define SNAPSHOT_VERSION 1
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_SOFT_DIRTY (1ULL << 55)
+
+#define PAGE_ZERO 1			/// Page was not populated; it reads as zeros and has no data.
+#define PAGE_MISSING 2			/// Page could not be read; it has no data.
+
+#define SNAPSHOT_BATCH_PAGES 1024
+#define SNAPSHOT_INITIAL_SIZE (1024 * 1024)
+
+/**
+ * Start of a snapshot file.
+ *
+ */
+typedef struct SnapshotHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	int32_t process;		/// PID of the process the snapshot is of.
+	uint32_t page_size;
+	uint32_t generations;		/// Number of complete generations, the base being generation 0.
+	uint32_t reserved;
+	uint64_t used;			/// Bytes of the file in use, header included.
+	char region_name[256];		/// Only mappings with this in their path are captured, all if empty.
+} SnapshotHeader;
+
+/**
+ * A captured page in a snapshot file. Unless it is flagged otherwise, the page's data follows.
+ *
+ */
+typedef struct PageRecord
+{
+	uint64_t addr;
+	uint32_t generation;
+	uint32_t flags;
+} PageRecord;
+
+/**
+ * One capture of a page.
+ *
+ */
+typedef struct PageVersion
+{
+	uint32_t generation;
+	uint32_t flags;
+	uint64_t data;			/// Offset of the page data in the file, if there is any.
+} PageVersion;
+
+/**
+ * Every capture of a page, oldest first.
+ *
+ */
+typedef struct PageHistory
+{
+	uintptr_t addr;			/// Address of the page, 0 if the slot is empty.
+	int num_versions;
+	int capacity;
+	PageVersion* versions;
+} PageHistory;
+
+/**
+ *  A base snapshot of a process's memory and the deltas taken since.
+ */
+struct Snapshot
+{
+	int process;			/// PID of the process.
+	int page_size;			/// Page size of the machine the snapshot was taken on.
+	int fd;				/// The snapshot file.
+	char* map;			/// The snapshot file, mapped.
+	size_t map_size;		/// Size of the file and its mapping.
+	int pagemap_fd;			/// /proc/pid/pagemap, or -1 if not opened yet.
+	int clear_refs_fd;		/// /proc/pid/clear_refs, or -1 if not opened yet.
+	int soft_dirty;			/// Whether the kernel tracks soft-dirty pages.
+	PageHistory* pages;		/// Open-addressed hash table of page histories.
+	size_t pages_capacity;		/// Number of slots in pages, always a power of two.
+	size_t num_pages;		/// Number of slots in use.
+};
+
+/**
+ * A page waiting to be copied into the snapshot.
+ *
+ */
+typedef struct PendingPage
+{
+	uintptr_t addr;
+	uint32_t flags;
+} PendingPage;
+
+static SnapshotHeader* snapshot_header(Snapshot* snapshot)
+{
+	return (SnapshotHeader*) snapshot->map;
+}
+
+static PageHistory* find_page_slot(PageHistory* pages, size_t capacity, uintptr_t addr)
+{
+	size_t i = ((addr >> 12) * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+	while(pages[i].addr && pages[i].addr != addr)
+		i = (i + 1) & (capacity - 1);
+
+	return &pages[i];
+}
+
+static PageHistory* find_page(Snapshot* snapshot, uintptr_t addr)
+{
+	if(!snapshot->pages_capacity)
+		return NULL;
+
+	PageHistory* page = find_page_slot(snapshot->pages, snapshot->pages_capacity, addr);
+	return page->addr ? page : NULL;
+}
+
+static void add_page_version(Snapshot* snapshot, uintptr_t addr, uint32_t generation, uint32_t flags, uint64_t data)
+{
+	if((snapshot->num_pages + 1) * 2 > snapshot->pages_capacity)
+	{
+		size_t capacity = snapshot->pages_capacity ? snapshot->pages_capacity * 2 : 4096;
+		PageHistory* pages = (PageHistory*) calloc(capacity, sizeof(PageHistory));
+
+		size_t i;
+		for(i = 0; i < snapshot->pages_capacity; i++)
+		{
+			if(snapshot->pages[i].addr)
+				*find_page_slot(pages, capacity, snapshot->pages[i].addr) = snapshot->pages[i];
+		}
+
+		free(snapshot->pages);
+		snapshot->pages = pages;
+		snapshot->pages_capacity = capacity;
+	}
+
+	PageHistory* page = find_page_slot(snapshot->pages, snapshot->pages_capacity, addr);
+	if(!page->addr)
+	{
+		page->addr = addr;
+		++snapshot->num_pages;
+	}
+
+	if(page->num_versions == page->capacity)
+	{
+		page->capacity = page->capacity ? page->capacity * 2 : 2;
+		page->versions = (PageVersion*) realloc(page->versions, sizeof(PageVersion) * page->capacity);
+	}
+
+	PageVersion* version = &page->versions[page->num_versions++];
+	version->generation = generation;
+	version->flags = flags;
+	version->data = data;
+}
+
+/**
+ *  Makes sure the snapshot file has room for more records, growing it if necessary. This can move the mapping.
+ *
+ *  @return
+ *  	0 on failure, 1 on success.
+ *
+ */
+static int reserve_snapshot_space(Snapshot* snapshot, size_t size)
+{
+	uint64_t needed = snapshot_header(snapshot)->used + size;
+	if(needed <= snapshot->map_size)
+		return 1;
+
+	size_t new_size = snapshot->map_size * 2;
+	if(new_size < needed)
+		new_size = (needed + SNAPSHOT_INITIAL_SIZE - 1) & ~((size_t) SNAPSHOT_INITIAL_SIZE - 1);
+
+	if(ftruncate(snapshot->fd, new_size) == -1)
+		return 0;
+
+	char* map = (char*) mremap(snapshot->map, snapshot->map_size, new_size, MREMAP_MAYMOVE);
+	if(map == MAP_FAILED)
+		return 0;
+
+	snapshot->map = map;
+	snapshot->map_size = new_size;
+	return 1;
+}
+
+/**
+ *  Copies a batch of pages from the process into the snapshot file as records of a generation,
+ *  with a single process_readv straight into the file.
+ *
+ *  @return
+ *  	0 on failure, 1 on success.
+ *
+ */
+static int copy_pages(Snapshot* snapshot, uint32_t generation, PendingPage* pending, int count)
+{
+	size_t record_size = sizeof(PageRecord) + snapshot->page_size;
+	if(!reserve_snapshot_space(snapshot, count * record_size))
+		return 0;
+
+	SnapshotHeader* header = snapshot_header(snapshot);
+	RemoteIOVec* vecs = (RemoteIOVec*) malloc(sizeof(RemoteIOVec) * count);
+	int* vec_page = (int*) malloc(sizeof(int) * count);
+	uint64_t* data_offsets = (uint64_t*) malloc(sizeof(uint64_t) * count);
+	int num_vecs = 0;
+
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		PageRecord* record = (PageRecord*)(snapshot->map + header->used);
+		record->addr = pending[i].addr;
+		record->generation = generation;
+		record->flags = pending[i].flags;
+		header->used += sizeof(PageRecord);
+		data_offsets[i] = 0;
+
+		if(pending[i].flags & PAGE_ZERO)
+			continue;
+
+		data_offsets[i] = header->used;
+		header->used += snapshot->page_size;
+
+		// Records are interleaved with their data in the file, so each page gets its own iovec.
+		vecs[num_vecs].addr = pending[i].addr;
+		vecs[num_vecs].len = snapshot->page_size;
+		vecs[num_vecs].buf = snapshot->map + data_offsets[i];
+		vec_page[num_vecs] = i;
+		++num_vecs;
+	}
+
+	if(num_vecs)
+		process_readv(snapshot->process, vecs, num_vecs);
+
+	for(i = 0; i < num_vecs; i++)
+	{
+		if(vecs[i].result != vecs[i].len)
+		{
+			int page = vec_page[i];
+			PageRecord* record = (PageRecord*)(snapshot->map + data_offsets[page] - sizeof(PageRecord));
+			record->flags |= PAGE_MISSING;
+			pending[page].flags |= PAGE_MISSING;
+		}
+	}
+
+	for(i = 0; i < count; i++)
+		add_page_version(snapshot, pending[i].addr, generation, pending[i].flags, data_offsets[i]);
+
+	free(data_offsets);
+	free(vec_page);
+	free(vecs);
+
+	return 1;
+}
+
+/**
+ *  Copies a batch of pages from the process into the snapshot file, leaving out those that are the same
+ *  as their latest capture. This is for kernels without soft-dirty tracking, where every populated page
+ *  has to be read to find out whether it changed; at least only the changes take up space.
+ *
+ *  @return
+ *  	0 on failure, 1 on success.
+ *
+ */
+static int copy_changed_pages(Snapshot* snapshot, uint32_t generation, PendingPage* pending, int count)
+{
+	char* pages = (char*) malloc((size_t) count * snapshot->page_size);
+	RemoteIOVec* vecs = (RemoteIOVec*) malloc(sizeof(RemoteIOVec) * count);
+
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		vecs[i].addr = pending[i].addr;
+		vecs[i].len = (pending[i].flags & PAGE_ZERO) ? 0 : snapshot->page_size;
+		vecs[i].buf = pages + (size_t) i * snapshot->page_size;
+	}
+
+	process_readv(snapshot->process, vecs, count);
+
+	int changed = 0;
+	for(i = 0; i < count; i++)
+	{
+		if(!(pending[i].flags & PAGE_ZERO) && vecs[i].result != vecs[i].len)
+			pending[i].flags |= PAGE_MISSING;
+
+		PageHistory* page = find_page(snapshot, pending[i].addr);
+		if(page && !(pending[i].flags & (PAGE_ZERO | PAGE_MISSING)))
+		{
+			PageVersion* latest = &page->versions[page->num_versions - 1];
+			if(!(latest->flags & (PAGE_ZERO | PAGE_MISSING))
+					&& memcmp(snapshot->map + latest->data, vecs[i].buf, snapshot->page_size) == 0)
+				continue;
+		}
+
+		pending[changed] = pending[i];
+		vecs[changed] = vecs[i];
+		++changed;
+	}
+
+	int ok = reserve_snapshot_space(snapshot, changed * (sizeof(PageRecord) + snapshot->page_size));
+
+	SnapshotHeader* header = snapshot_header(snapshot);
+	for(i = 0; ok && i < changed; i++)
+	{
+		PageRecord* record = (PageRecord*)(snapshot->map + header->used);
+		record->addr = pending[i].addr;
+		record->generation = generation;
+		record->flags = pending[i].flags;
+		header->used += sizeof(PageRecord);
+
+		uint64_t data = 0;
+		if(!(pending[i].flags & (PAGE_ZERO | PAGE_MISSING)))
+		{
+			data = header->used;
+			memcpy(snapshot->map + data, vecs[i].buf, snapshot->page_size);
+			header->used += snapshot->page_size;
+		}
+		else if(pending[i].flags & PAGE_MISSING)
+		{
+			// keep the layout of records the same as copy_pages makes them
+			header->used += snapshot->page_size;
+		}
+
+		add_page_version(snapshot, pending[i].addr, generation, pending[i].flags, data);
+	}
+
+	free(vecs);
+	free(pages);
+
+	return ok;
+}
+
+/**
+ *  Checks whether the kernel keeps soft-dirty bits, by writing to a page of our own and looking at it.
+ *
+ *  @return
+ *  	1 if it does, 0 if not.
+ *
+ */
+static int soft_dirty_supported()
+{
+	static int supported = -1;
+	if(supported != -1)
+		return supported;
+
+	supported = 0;
+
+	int page_size = sysconf(_SC_PAGE_SIZE);
+	volatile char* page = (volatile char*) mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(page == MAP_FAILED)
+		return supported;
+
+	page[0] = 1;
+
+	int fd = open("/proc/self/pagemap", O_RDONLY);
+	if(fd != -1)
+	{
+		uint64_t entry;
+		if(pread(fd, &entry, sizeof(entry), ((uintptr_t) page / page_size) * sizeof(entry)) == sizeof(entry))
+			supported = (entry & PAGEMAP_SOFT_DIRTY) != 0;
+
+		close(fd);
+	}
+
+	munmap((void*) page, page_size);
+	return supported;
+}
+
+/**
+ *  Captures a new generation: every page of the base, or the pages written to since the last generation
+ *  for a delta. The process is kept stopped while its pages are inspected and copied so that the
+ *  generation is consistent.
+ *
+ *  @return
+ *  	The number of the new generation, or -1 on failure.
+ *
+ */
+static int take_generation(Snapshot* snapshot)
+{
+	char buf[PATH_MAX];
+	SnapshotHeader* header = snapshot_header(snapshot);
+	uint32_t generation = header->generations;
+
+	if(snapshot->pagemap_fd == -1)
+	{
+		snprintf(buf, sizeof(buf), "/proc/%d/pagemap", snapshot->process);
+		snapshot->pagemap_fd = open(buf, O_RDONLY);
+	}
+
+	if(snapshot->clear_refs_fd == -1)
+	{
+		snprintf(buf, sizeof(buf), "/proc/%d/clear_refs", snapshot->process);
+		snapshot->clear_refs_fd = open(buf, O_WRONLY);
+	}
+
+	if(snapshot->pagemap_fd == -1 || snapshot->clear_refs_fd == -1)
+	{
+		fprintf(stderr, "Error: cannot track pages of process %d!\n", snapshot->process);
+		return -1;
+	}
+
+	ProcessSession* session = open_process_session_with_flags(snapshot->process, SESSION_ALL_THREADS | SESSION_NO_CALLS);
+	if(!session)
+		return -1;
+
+	MemoryRegion* regions;
+	int num_regions = find_memory_regions(snapshot->process, &regions);
+	if(num_regions < 0)
+	{
+		close_process_session(session);
+		return -1;
+	}
+
+	// First find out which pages to copy, then clear the soft-dirty bits, then copy. The process can't
+	// run in between, so no write is missed.
+	int num_pending = 0;
+	int pending_capacity = SNAPSHOT_BATCH_PAGES;
+	PendingPage* pending = (PendingPage*) malloc(sizeof(PendingPage) * pending_capacity);
+	uint64_t* entries = (uint64_t*) malloc(sizeof(uint64_t) * SNAPSHOT_BATCH_PAGES);
+
+	int i;
+	for(i = 0; i < num_regions; i++)
+	{
+		MemoryRegion* region = &regions[i];
+
+		if(region->permissions[0] != 'r' || region->permissions[1] != 'w')
+			continue;
+
+		if(header->region_name[0] && strstr(region->path, header->region_name) == NULL)
+			continue;
+
+		uintptr_t addr = region->start;
+		while(addr < region->end)
+		{
+			size_t num_entries = (region->end - addr) / snapshot->page_size;
+			if(num_entries > SNAPSHOT_BATCH_PAGES)
+				num_entries = SNAPSHOT_BATCH_PAGES;
+
+			off_t pagemap_offset = (addr / snapshot->page_size) * sizeof(uint64_t);
+			ssize_t got = pread(snapshot->pagemap_fd, entries, num_entries * sizeof(uint64_t), pagemap_offset);
+			if(got <= 0)
+				break;
+
+			num_entries = got / sizeof(uint64_t);
+
+			size_t j;
+			for(j = 0; j < num_entries; j++, addr += snapshot->page_size)
+			{
+				int populated = (entries[j] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) != 0;
+				uint32_t flags = populated ? 0 : PAGE_ZERO;
+
+				PageHistory* page = find_page(snapshot, addr);
+				if(page)
+				{
+					PageVersion* latest = &page->versions[page->num_versions - 1];
+
+					if(populated && snapshot->soft_dirty && !(entries[j] & PAGEMAP_SOFT_DIRTY)
+							&& !(latest->flags & PAGE_MISSING))
+						continue;
+
+					// pages can also be dropped, by MADV_DONTNEED for instance
+					if(!populated && (latest->flags & PAGE_ZERO))
+						continue;
+				}
+
+				if(num_pending == pending_capacity)
+				{
+					pending_capacity *= 2;
+					pending = (PendingPage*) realloc(pending, sizeof(PendingPage) * pending_capacity);
+				}
+
+				pending[num_pending].addr = addr;
+				pending[num_pending].flags = flags;
+				++num_pending;
+			}
+		}
+	}
+
+	free(entries);
+	free(regions);
+
+	int ok = 1;
+	if(snapshot->soft_dirty && pwrite(snapshot->clear_refs_fd, "4", 1, 0) != 1)
+	{
+		fprintf(stderr, "Error: cannot clear soft-dirty bits of process %d!\n", snapshot->process);
+		ok = 0;
+	}
+
+	for(i = 0; ok && i < num_pending; i += SNAPSHOT_BATCH_PAGES)
+	{
+		int count = num_pending - i;
+		if(count > SNAPSHOT_BATCH_PAGES)
+			count = SNAPSHOT_BATCH_PAGES;
+
+		if(snapshot->soft_dirty || generation == 0)
+			ok = copy_pages(snapshot, generation, pending + i, count);
+		else
+			ok = copy_changed_pages(snapshot, generation, pending + i, count);
+	}
+
+	close_process_session(session);
+
+	free(pending);
+
+	if(!ok)
+		return -1;
+
+	// the generation only counts once all of it is in the file
+	header = snapshot_header(snapshot);
+	header->generations = generation + 1;
+
+	return generation;
+}
+
+static Snapshot* alloc_snapshot(int fd)
+{
+	Snapshot* snapshot = (Snapshot*) malloc(sizeof(Snapshot));
+	memset(snapshot, 0, sizeof(Snapshot));
+	snapshot->fd = fd;
+	snapshot->pagemap_fd = -1;
+	snapshot->clear_refs_fd = -1;
+	snapshot->soft_dirty = soft_dirty_supported();
+	return snapshot;
+}
+
+/**
+ *  Takes a base snapshot of the writable memory of a process. Use snapshot_update to add deltas to it.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] region_name
+ *  	Only mappings with this in their path (for instance "[heap]") are captured. NULL for all writable mappings.
+ *
+ *  @param[in] path
+ *  	Path of the file to keep the snapshot in. It is created, or truncated if it exists.
+ *
+ *  @return
+ *  	A handle to the snapshot, or NULL on failure.
+ *
+ */
+Snapshot* new_snapshot(int process, const char* region_name, const char* path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd == -1)
+	{
+		fprintf(stderr, "Error: cannot create snapshot file %s!\n", path);
+		return NULL;
+	}
+
+	if(ftruncate(fd, SNAPSHOT_INITIAL_SIZE) == -1)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	Snapshot* snapshot = alloc_snapshot(fd);
+	snapshot->process = process;
+	snapshot->page_size = sysconf(_SC_PAGE_SIZE);
+	snapshot->map_size = SNAPSHOT_INITIAL_SIZE;
+	snapshot->map = (char*) mmap(NULL, snapshot->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(snapshot->map == MAP_FAILED)
+	{
+		close(fd);
+		free(snapshot);
+		return NULL;
+	}
+
+	SnapshotHeader* header = snapshot_header(snapshot);
+	header->magic = SNAPSHOT_MAGIC;
+	header->version = SNAPSHOT_VERSION;
+	header->process = process;
+	header->page_size = snapshot->page_size;
+	header->generations = 0;
+	header->used = sizeof(SnapshotHeader);
+	if(region_name)
+		strncpy(header->region_name, region_name, sizeof(header->region_name) - 1);
+
+	if(take_generation(snapshot) == -1)
+	{
+		free_snapshot(snapshot);
+		return NULL;
+	}
+
+	return snapshot;
+}
+
+/**
+ *  Opens a snapshot file written earlier. If the process is still around, more deltas can be added to it.
+ *
+ *  @param[in] path
+ *  	Path of the snapshot file.
+ *
+ *  @return
+ *  	A handle to the snapshot, or NULL on failure.
+ *
+ */
+Snapshot* open_snapshot(const char* path)
+{
+	int fd = open(path, O_RDWR);
+	if(fd == -1)
+		return NULL;
+
+	struct stat st;
+	if(fstat(fd, &st) == -1 || st.st_size < sizeof(SnapshotHeader))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	Snapshot* snapshot = alloc_snapshot(fd);
+	snapshot->map_size = st.st_size;
+	snapshot->map = (char*) mmap(NULL, snapshot->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(snapshot->map == MAP_FAILED)
+	{
+		close(fd);
+		free(snapshot);
+		return NULL;
+	}
+
+	SnapshotHeader* header = snapshot_header(snapshot);
+	if(header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION || header->used > snapshot->map_size)
+	{
+		fprintf(stderr, "Error: %s is not a snapshot file!\n", path);
+		free_snapshot(snapshot);
+		return NULL;
+	}
+
+	snapshot->process = header->process;
+	snapshot->page_size = header->page_size;
+
+	// Rebuild the index. Records of a generation that was never finished are dropped.
+	uint64_t pos = sizeof(SnapshotHeader);
+	while(pos + sizeof(PageRecord) <= header->used)
+	{
+		PageRecord* record = (PageRecord*)(snapshot->map + pos);
+		if(record->generation >= header->generations)
+			break;
+
+		uint64_t data = 0;
+		pos += sizeof(PageRecord);
+		if(!(record->flags & PAGE_ZERO))
+		{
+			data = pos;
+			pos += snapshot->page_size;
+		}
+
+		add_page_version(snapshot, record->addr, record->generation, record->flags, data);
+	}
+
+	header->used = pos;
+
+	return snapshot;
+}
+
+/**
+ *  Closes a snapshot. The snapshot file is left in place.
+ *
+ *  @param[in] snapshot
+ *  	The snapshot handle.
+ *
+ */
+void free_snapshot(Snapshot* snapshot)
+{
+	size_t i;
+	for(i = 0; i < snapshot->pages_capacity; i++)
+		free(snapshot->pages[i].versions);
+
+	free(snapshot->pages);
+
+	if(snapshot->pagemap_fd != -1)
+		close(snapshot->pagemap_fd);
+
+	if(snapshot->clear_refs_fd != -1)
+		close(snapshot->clear_refs_fd);
+
+	// only the part of the file that's in use is worth keeping
+	uint64_t used = snapshot_header(snapshot)->used;
+	munmap(snapshot->map, snapshot->map_size);
+	if(ftruncate(snapshot->fd, used) == -1)
+		fprintf(stderr, "Error: cannot trim snapshot file!\n");
+
+	close(snapshot->fd);
+	free(snapshot);
+}
+
+/**
+ *  Adds a delta to a snapshot, copying only the pages of the process that were written to since the
+ *  last generation was taken.
+ *
+ *  @param[in] snapshot
+ *  	The snapshot handle.
+ *
+ *  @return
+ *  	The number of the new generation, or -1 on failure.
+ *
+ */
+int snapshot_update(Snapshot* snapshot)
+{
+	return take_generation(snapshot);
+}
+
+/**
+ *  Returns the number of generations in a snapshot: the base plus the deltas.
+ *
+ *  @param[in] snapshot
+ *  	The snapshot handle.
+ *
+ */
+int snapshot_generations(Snapshot* snapshot)
+{
+	return snapshot_header(snapshot)->generations;
+}
+
+/**
+ *  Reads memory of the process as it was at a given generation.
+ *
+ *  @param[in] snapshot
+ *  	The snapshot handle.
+ *
+ *  @param[in] generation
+ *  	The generation, 0 being the base.
+ *
+ *  @param[out] buf
+ *  	The buffer to read into. Parts that were not captured are zeroed.
+ *
+ *  @param[in] count
+ *  	Number of bytes to read.
+ *
+ *  @param[in] addr
+ *  	The address in the process to read from.
+ *
+ *  @return
+ *  	1 if every byte was captured, 0 otherwise.
+ *
+ */
+int snapshot_read(Snapshot* snapshot, int generation, void* buf, size_t count, uintptr_t addr)
+{
+	int complete = 1;
+	char* out = (char*) buf;
+
+	while(count > 0)
+	{
+		uintptr_t page_addr = addr & ~((uintptr_t) snapshot->page_size - 1);
+		size_t page_offset = addr - page_addr;
+		size_t len = snapshot->page_size - page_offset;
+		if(len > count)
+			len = count;
+
+		// find the latest capture no newer than the generation asked for
+		PageVersion* version = NULL;
+		PageHistory* page = find_page(snapshot, page_addr);
+		if(page)
+		{
+			int i;
+			for(i = page->num_versions - 1; i >= 0; i--)
+			{
+				if(page->versions[i].generation <= generation)
+				{
+					version = &page->versions[i];
+					break;
+				}
+			}
+		}
+
+		if(version && !(version->flags & (PAGE_ZERO | PAGE_MISSING)))
+		{
+			memcpy(out, snapshot->map + version->data + page_offset, len);
+		}
+		else
+		{
+			memset(out, 0, len);
+			if(!version || (version->flags & PAGE_MISSING))
+				complete = 0;
+		}
+
+		out += len;
+		addr += len;
+		count -= len;
+	}
+
+	return complete;
+}
+
+static int compare_addresses(const void* a, const void* b)
+{
+	uintptr_t x = *(const uintptr_t*) a;
+	uintptr_t y = *(const uintptr_t*) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ *  Lists the pages captured in a generation, which for a delta are the pages that changed since the
+ *  generation before it.
+ *
+ *  @param[in] snapshot
+ *  	The snapshot handle.
+ *
+ *  @param[in] generation
+ *  	The generation, 0 being the base.
+ *
+ *  @param[out] pages
+ *  	Set to a malloc'd array of the addresses of the pages, in ascending order. This must be freed by the caller.
+ *
+ *  @return
+ *  	The number of pages.
+ *
+ */
+int snapshot_changed_pages(Snapshot* snapshot, int generation, uintptr_t** pages)
+{
+	int count = 0;
+	*pages = (uintptr_t*) malloc(sizeof(uintptr_t) * (snapshot->num_pages ? snapshot->num_pages : 1));
+
+	size_t i;
+	for(i = 0; i < snapshot->pages_capacity; i++)
+	{
+		PageHistory* page = &snapshot->pages[i];
+		if(!page->addr)
+			continue;
+
+		int j;
+		for(j = page->num_versions - 1; j >= 0; j--)
+		{
+			if(page->versions[j].generation == generation)
+			{
+				(*pages)[count++] = page->addr;
+				break;
+			}
+
+			if(page->versions[j].generation < generation)
+				break;
+		}
+	}
+
+	qsort(*pages, count, sizeof(uintptr_t), compare_addresses);
+
+	return count;
+}
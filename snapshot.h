@@ -0,0 +1,18 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct Snapshot;
+typedef struct Snapshot Snapshot;
+
+Snapshot* new_snapshot(int process, const char* region_name, const char* path);
+Snapshot* open_snapshot(const char* path);
+void free_snapshot(Snapshot* snapshot);
+int snapshot_update(Snapshot* snapshot);
+int snapshot_generations(Snapshot* snapshot);
+int snapshot_read(Snapshot* snapshot, int generation, void* buf, size_t count, uintptr_t addr);
+int snapshot_changed_pages(Snapshot* snapshot, int generation, uintptr_t** pages);
+
+#endif
@@ -443,7 +443,7 @@ const char* find_symbol_for_address(SymtabCache* cache, int process, void* addre
 	Symbol* symbol = (Symbol*) search((AANode*) symbols, iAddress);
 	if(symbol)
 	{
-		*symbol_address = (void*) symbol->address;
+		*symbol_address = (void*) (mapping->image_start + symbol->address);
 		return symbol->name;
 	}
 
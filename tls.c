@@ -0,0 +1,488 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "tls.h"
+#include "objdump.h"
+#include "process.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+
+// A thread-local variable lives at a fixed offset in its module's TLS block, and every thread has its own
+// block. To find a thread's copy we need the thread pointer (fs_base on x86_64, which is also the address
+// of the thread's struct pthread) and where the module's block sits relative to it. Both are kept by glibc
+// in structures whose layout is private, but libc exports the offsets of the fields libthread_db needs as
+// _thread_db_* descriptors, so we read those instead of hard-coding a layout. With them, the thread
+// pointers of every thread come from the lists of thread stacks glibc keeps in _rtld_global, without
+// stopping anything. Threads glibc doesn't know about, from a raw clone, are stopped once each to read
+// fs_base, which doesn't change for the life of the thread.
+
+#define TLS_MAX_THREADS 65536			/// Bound on walks of the thread lists, which may change under us.
+#define NO_TLS_OFFSET 0				/// l_tls_offset of a module without static TLS yet.
+#define FORCED_DYNAMIC_TLS_OFFSET ((uintptr_t) -1)	/// l_tls_offset of a module that will never have static TLS.
+#define TLS_DTV_UNALLOCATED ((uintptr_t) -1)	/// dtv entry of a module whose block the thread hasn't allocated.
+
+/**
+ * A libthread_db field descriptor, as libc exports them.
+ *
+ */
+typedef struct DbField
+{
+	uint32_t bits;			/// Size of the field in bits.
+	uint32_t count;			/// Number of elements if the field is an array.
+	uint32_t offset;		/// Offset of the field in its structure.
+} DbField;
+
+/**
+ * A thread pointer we had to stop a thread to find.
+ *
+ */
+typedef struct KnownThread
+{
+	int tid;
+	uintptr_t thread_pointer;
+} KnownThread;
+
+/**
+ *  Reads one thread-local variable of a process.
+ */
+struct TlsReader
+{
+	int process;				/// The process.
+	size_t size;				/// Size of the variable in bytes.
+	uintptr_t symbol_offset;		/// Offset of the variable in its module's TLS block.
+	uintptr_t modid;			/// The module's TLS module ID, its index in the dtv.
+	uintptr_t tls_offset;			/// Distance from the thread pointer down to the module's static TLS block.
+	int have_lists;				/// Nonzero if glibc's thread lists can be walked.
+	uintptr_t list_heads[2];		/// Addresses of _dl_stack_used and _dl_stack_user.
+	DbField pthread_list;			/// struct pthread's link in those lists.
+	DbField pthread_tid;			/// struct pthread's tid.
+	DbField pthread_dtvp;			/// struct pthread's dtv pointer.
+	DbField dtv;				/// The dtv array, for the size of its entries.
+	DbField dtv_pointer;			/// The TLS block pointer of a dtv entry.
+	KnownThread* known;			/// Thread pointers found by stopping threads.
+	int num_known;
+};
+
+static int read_word(int process, uintptr_t addr, uintptr_t* value)
+{
+	RemoteIOVec vec = { addr, sizeof(*value), value, 0 };
+	return process_readv(process, &vec, 1) == 1;
+}
+
+static int read_db_field(int process, const char* name, DbField* field)
+{
+	void* addr = find_libc_function(process, name);
+	if(!addr)
+		return 0;
+
+	RemoteIOVec vec = { (uintptr_t) addr, sizeof(*field), field, 0 };
+	return process_readv(process, &vec, 1) == 1;
+}
+
+/**
+ *  Finds the list heads of glibc's threads, the used stacks of threads it created and the stacks of
+ *  threads it didn't allocate, which include the main thread.
+ *
+ */
+static int find_thread_lists(TlsReader* reader)
+{
+	int process = reader->process;
+	DbField used;
+	DbField user;
+	if(!read_db_field(process, "_thread_db_pthread_list", &reader->pthread_list)
+			|| !read_db_field(process, "_thread_db_pthread_tid", &reader->pthread_tid)
+			|| !read_db_field(process, "_thread_db_rtld_global__dl_stack_used", &used)
+			|| !read_db_field(process, "_thread_db_rtld_global__dl_stack_user", &user))
+		return 0;
+
+	// libc keeps a pointer to the dynamic linker's _rtld_global; older ones only have the symbol in ld.so
+	uintptr_t rtld_global = 0;
+	void* pointer = find_libc_function(process, "__nptl_rtld_global");
+	if(pointer)
+		read_word(process, (uintptr_t) pointer, &rtld_global);
+	else
+		rtld_global = (uintptr_t) find_function(process, "/ld-linux", "_rtld_global", NULL);
+
+	if(!rtld_global)
+		return 0;
+
+	reader->list_heads[0] = rtld_global + used.offset;
+	reader->list_heads[1] = rtld_global + user.offset;
+	return 1;
+}
+
+/**
+ *  Start reading a thread-local variable of a process.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] image_name
+ *  	The name of the image defining the variable. Any image with image_name as a substring is matched.
+ *
+ *  @param[in] symbol
+ *  	The name of the variable.
+ *
+ *  @param[in] size
+ *  	The size of the variable in bytes.
+ *
+ *  @return
+ *  	A handle to the reader, or NULL if the variable could not be found.
+ *
+ */
+TlsReader* open_tls_reader(int process, const char* image_name, const char* symbol, size_t size)
+{
+	char image[PATH_MAX];
+	uintptr_t symbol_offset;
+	if(!find_symbol_offset(process, image_name, symbol, image, &symbol_offset))
+	{
+		fprintf(stderr, "Error: cannot find %s in %s in process %d!\n", symbol, image_name, process);
+		return NULL;
+	}
+
+	uintptr_t map = (uintptr_t) find_library_handle(process, image);
+	if(!map)
+	{
+		fprintf(stderr, "Error: cannot find the link_map of %s in process %d!\n", image, process);
+		return NULL;
+	}
+
+	TlsReader* reader = (TlsReader*) calloc(1, sizeof(TlsReader));
+	reader->process = process;
+	reader->size = size;
+	reader->symbol_offset = symbol_offset;
+
+	DbField modid;
+	DbField tls_offset;
+	if(!read_db_field(process, "_thread_db_link_map_l_tls_modid", &modid)
+			|| !read_db_field(process, "_thread_db_link_map_l_tls_offset", &tls_offset)
+			|| !read_db_field(process, "_thread_db_pthread_dtvp", &reader->pthread_dtvp)
+			|| !read_db_field(process, "_thread_db_dtv_dtv", &reader->dtv)
+			|| !read_db_field(process, "_thread_db_dtv_t_pointer_val", &reader->dtv_pointer)
+			|| !read_word(process, map + modid.offset, &reader->modid)
+			|| !read_word(process, map + tls_offset.offset, &reader->tls_offset))
+	{
+		fprintf(stderr, "Error: cannot read the TLS layout of process %d!\n", process);
+		free(reader);
+		return NULL;
+	}
+
+	if(reader->modid == 0)
+	{
+		fprintf(stderr, "Error: %s has no thread-local storage!\n", image);
+		free(reader);
+		return NULL;
+	}
+
+	reader->have_lists = find_thread_lists(reader);
+	return reader;
+}
+
+/**
+ *  Stop reading a thread-local variable and free the reader.
+ *
+ *  @param[in] reader
+ *  	The reader returned by open_tls_reader.
+ *
+ */
+void close_tls_reader(TlsReader* reader)
+{
+	free(reader->known);
+	free(reader);
+}
+
+static int list_threads(int process, int** tids)
+{
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "/proc/%d/task", process);
+	DIR* tasks = opendir(buf);
+	if(!tasks)
+		return -1;
+
+	int count = 0;
+	int capacity = 16;
+	*tids = (int*) malloc(capacity * sizeof(int));
+
+	struct dirent* entry;
+	while((entry = readdir(tasks)) != NULL)
+	{
+		int tid = atoi(entry->d_name);
+		if(tid <= 0)
+			continue;
+
+		if(count == capacity)
+		{
+			capacity *= 2;
+			*tids = (int*) realloc(*tids, capacity * sizeof(int));
+		}
+
+		(*tids)[count++] = tid;
+	}
+
+	closedir(tasks);
+	return count;
+}
+
+/**
+ *  Walks glibc's thread lists while the process runs, filling in the thread pointers of the threads it
+ *  finds. A thread being created or exiting can leave a list briefly inconsistent; threads seen wrongly
+ *  keep no thread pointer and are handled like threads glibc doesn't know.
+ *
+ */
+static void walk_thread_lists(TlsReader* reader, ThreadLocal* threads, int num_threads)
+{
+	uint32_t first = reader->pthread_list.offset < reader->pthread_tid.offset
+			? reader->pthread_list.offset : reader->pthread_tid.offset;
+	uint32_t last = reader->pthread_list.offset + sizeof(uintptr_t) > reader->pthread_tid.offset + sizeof(int)
+			? reader->pthread_list.offset + sizeof(uintptr_t) : reader->pthread_tid.offset + sizeof(int);
+	char* span = (char*) malloc(last - first);
+
+	int found = 0;
+	int steps = 0;
+	int i;
+	for(i = 0; i < 2; i++)
+	{
+		uintptr_t head = reader->list_heads[i];
+		uintptr_t node;
+		if(!read_word(reader->process, head, &node))
+			continue;
+
+		while(node && node != head && steps++ < TLS_MAX_THREADS && found < num_threads)
+		{
+			uintptr_t pthread = node - reader->pthread_list.offset;
+			RemoteIOVec vec = { pthread + first, last - first, span, 0 };
+			if(process_readv(reader->process, &vec, 1) != 1)
+				break;
+
+			int tid;
+			memcpy(&node, span + reader->pthread_list.offset - first, sizeof(node));
+			memcpy(&tid, span + reader->pthread_tid.offset - first, sizeof(tid));
+
+			int j;
+			for(j = 0; j < num_threads; j++)
+			{
+				if(threads[j].tid == tid && !threads[j].thread_pointer)
+				{
+					threads[j].thread_pointer = pthread;
+					++found;
+					break;
+				}
+			}
+		}
+	}
+
+	free(span);
+}
+
+/**
+ *  Reads fs_base of a thread, which means stopping it.
+ *
+ */
+static uintptr_t stop_for_thread_pointer(int process, int tid)
+{
+#ifdef __x86_64__
+	ProcessSession* session = open_thread_session(process, tid, SESSION_NO_CALLS);
+	if(!session)
+		return 0;
+
+	uintptr_t thread_pointer = 0;
+	struct user_regs_struct regs;
+	if(ptrace(PTRACE_GETREGS, tid, NULL, &regs) != -1)
+		thread_pointer = regs.fs_base;
+
+	close_process_session(session);
+	return thread_pointer;
+#else
+	// on i386 the thread pointer is a segment base, not a register
+	return 0;
+#endif
+}
+
+/**
+ *  Fills in thread pointers of threads that aren't on glibc's lists, stopping them if we have not before,
+ *  and forgets threads that have exited.
+ *
+ */
+static void find_other_thread_pointers(TlsReader* reader, ThreadLocal* threads, int num_threads)
+{
+	KnownThread* known = (KnownThread*) malloc((num_threads + 1) * sizeof(KnownThread));
+	int num_known = 0;
+
+	int i;
+	for(i = 0; i < num_threads; i++)
+	{
+		if(threads[i].thread_pointer)
+			continue;
+
+		int j;
+		for(j = 0; j < reader->num_known; j++)
+		{
+			if(reader->known[j].tid == threads[i].tid)
+			{
+				threads[i].thread_pointer = reader->known[j].thread_pointer;
+				break;
+			}
+		}
+
+		if(!threads[i].thread_pointer)
+			threads[i].thread_pointer = stop_for_thread_pointer(reader->process, threads[i].tid);
+
+		if(threads[i].thread_pointer)
+		{
+			known[num_known].tid = threads[i].tid;
+			known[num_known].thread_pointer = threads[i].thread_pointer;
+			++num_known;
+		}
+	}
+
+	free(reader->known);
+	reader->known = known;
+	reader->num_known = num_known;
+}
+
+/**
+ *  Finds the variable in the threads' dynamically allocated TLS blocks, through their dtvs.
+ *
+ */
+static void find_dynamic_addresses(TlsReader* reader, ThreadLocal* threads, int num_threads)
+{
+	uintptr_t* dtvs = (uintptr_t*) calloc(num_threads, sizeof(uintptr_t));
+	uintptr_t* slots = (uintptr_t*) calloc(num_threads * 2, sizeof(uintptr_t));
+	RemoteIOVec* vecs = (RemoteIOVec*) calloc(num_threads * 2, sizeof(RemoteIOVec));
+	size_t entry_size = reader->dtv.bits / 8;
+
+	int count = 0;
+	int i;
+	for(i = 0; i < num_threads; i++)
+	{
+		if(!threads[i].thread_pointer)
+			continue;
+
+		vecs[count].addr = threads[i].thread_pointer + reader->pthread_dtvp.offset;
+		vecs[count].len = sizeof(uintptr_t);
+		vecs[count].buf = &dtvs[i];
+		++count;
+	}
+
+	process_readv(reader->process, vecs, count);
+
+	// the entry before the first holds the number of entries, and the module's entry its block
+	count = 0;
+	for(i = 0; i < num_threads; i++)
+	{
+		if(!dtvs[i])
+			continue;
+
+		vecs[count].addr = dtvs[i] - entry_size;
+		vecs[count].len = sizeof(uintptr_t);
+		vecs[count].buf = &slots[i * 2];
+		vecs[count + 1].addr = dtvs[i] + reader->modid * entry_size + reader->dtv_pointer.offset;
+		vecs[count + 1].len = sizeof(uintptr_t);
+		vecs[count + 1].buf = &slots[i * 2 + 1];
+		count += 2;
+	}
+
+	process_readv(reader->process, vecs, count);
+
+	for(i = 0; i < num_threads; i++)
+	{
+		uintptr_t block = slots[i * 2 + 1];
+		if(dtvs[i] && reader->modid <= slots[i * 2] && block && block != TLS_DTV_UNALLOCATED)
+			threads[i].address = block + reader->symbol_offset;
+	}
+
+	free(vecs);
+	free(slots);
+	free(dtvs);
+}
+
+/**
+ *  Reads every thread's copy of the variable. The process keeps running; each value is read as it was at
+ *  one moment, but different threads' values at slightly different ones.
+ *
+ *  @param[in] reader
+ *  	The reader returned by open_tls_reader.
+ *
+ *  @param[out] threads
+ *  	Filled in with each thread and where its copy is.
+ *
+ *  @param[out] values
+ *  	The value of the variable for threads[i] is copied to values + i * size, if threads[i].read is set.
+ *
+ *  @param[in] max_threads
+ *  	Number of entries in threads, and of values.
+ *
+ *  @return
+ *  	The number of threads filled in, or -1 if the threads of the process could not be listed.
+ *
+ */
+int tls_read(TlsReader* reader, ThreadLocal* threads, void* values, int max_threads)
+{
+	int* tids;
+	int num_threads = list_threads(reader->process, &tids);
+	if(num_threads < 0)
+		return -1;
+
+	if(num_threads > max_threads)
+		num_threads = max_threads;
+
+	int i;
+	for(i = 0; i < num_threads; i++)
+	{
+		threads[i].tid = tids[i];
+		threads[i].thread_pointer = 0;
+		threads[i].address = 0;
+		threads[i].read = 0;
+	}
+
+	free(tids);
+
+	if(reader->have_lists)
+		walk_thread_lists(reader, threads, num_threads);
+
+	find_other_thread_pointers(reader, threads, num_threads);
+
+	// x86 puts static TLS blocks below the thread pointer, at an offset fixed when the module was loaded
+	if(reader->tls_offset != NO_TLS_OFFSET && reader->tls_offset != FORCED_DYNAMIC_TLS_OFFSET)
+	{
+		for(i = 0; i < num_threads; i++)
+		{
+			if(threads[i].thread_pointer)
+				threads[i].address = threads[i].thread_pointer - reader->tls_offset + reader->symbol_offset;
+		}
+	}
+	else
+	{
+		find_dynamic_addresses(reader, threads, num_threads);
+	}
+
+	RemoteIOVec* vecs = (RemoteIOVec*) calloc(num_threads, sizeof(RemoteIOVec));
+	int count = 0;
+	for(i = 0; i < num_threads; i++)
+	{
+		if(!threads[i].address)
+			continue;
+
+		vecs[count].addr = threads[i].address;
+		vecs[count].len = reader->size;
+		vecs[count].buf = (char*) values + i * reader->size;
+		++count;
+	}
+
+	process_readv(reader->process, vecs, count);
+
+	for(i = 0; i < count; i++)
+	{
+		if(vecs[i].result == (ssize_t) reader->size)
+			threads[((char*) vecs[i].buf - (char*) values) / reader->size].read = 1;
+	}
+
+	free(vecs);
+	return num_threads;
+}
@@ -0,0 +1,26 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct TlsReader;
+typedef struct TlsReader TlsReader;
+
+/**
+ * Where one thread's copy of a thread-local variable is.
+ *
+ */
+typedef struct ThreadLocal
+{
+	int tid;			/// The thread.
+	uintptr_t thread_pointer;	/// The thread's fs_base: where its struct pthread and static TLS are.
+	uintptr_t address;		/// Address of the thread's copy of the variable, 0 if it has none yet.
+	int read;			/// Nonzero if the value was read.
+} ThreadLocal;
+
+TlsReader* open_tls_reader(int process, const char* image_name, const char* symbol, size_t size);
+void close_tls_reader(TlsReader* reader);
+int tls_read(TlsReader* reader, ThreadLocal* threads, void* values, int max_threads);
+
+#endif
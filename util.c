@@ -18,6 +18,8 @@
 #include <stdarg.h>
 #include <pwd.h>
 #include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 /**
@@ -139,35 +141,137 @@ char* get_command_output_with_input(const char* path, const void* input, size_t
 }
 
 /**
- *  Finds a process based on the name of its executable and/or the user it is running under.
+ *  Reads a numeric field from /proc/pid/stat.
  *
- *  @param[in] user
- *  	User name of the process to find. "-" for all users. If no user matches the name specified, the current
- *  	user will be used.
+ *  @param[in] process
+ *  	The process's PID.
  *
- *  @param[in] name
- *  	The name of the executable image of the process.
+ *  @param[in] field
+ *  	The field number as documented in proc(5), starting at 3 (the state is not numeric).
+ *
+ *  @param[out] value
+ *  	The value of the field.
  *
  *  @return
- *  	The pid of the process if found, 0 if not found.
+ *  	1 on success, 0 if the process does not exist.
  *
  */
-int find_process(const char* user, const char* name)
+static int read_stat_field(int process, int field, unsigned long long* value)
+{
+	char buf[1024];
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", process);
+
+	int fd = open(buf, O_RDONLY);
+	if(fd == -1)
+		return 0;
+
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if(len <= 0)
+		return 0;
+
+	buf[len] = '\0';
+
+	// the command name can contain anything, so start after its closing parenthesis.
+	char* fields = strrchr(buf, ')');
+	if(!fields)
+		return 0;
+
+	// the first field after the parenthesis is field 3.
+	int cur_field = 2;
+	char* saveptr;
+	char* token;
+	for(token = strtok_r(fields + 1, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr))
+	{
+		if(++cur_field == field)
+		{
+			*value = strtoull(token, NULL, 10);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ *  Checks whether a process is in a cgroup or one of its descendants.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @param[in] cgroup
+ *  	Path of the cgroup, as it appears in /proc/pid/cgroup.
+ *
+ *  @return
+ *  	1 if it is, 0 if not.
+ *
+ */
+static int process_in_cgroup(int process, const char* cgroup)
+{
+	char buf[PATH_MAX + 64];
+	snprintf(buf, sizeof(buf), "/proc/%d/cgroup", process);
+
+	FILE* f = fopen(buf, "r");
+	if(!f)
+		return 0;
+
+	size_t cgroup_len = strlen(cgroup);
+	while(cgroup_len > 1 && cgroup[cgroup_len - 1] == '/')
+		--cgroup_len;
+
+	int found = 0;
+	while(!found && fgets(buf, sizeof(buf), f))
+	{
+		// lines are hierarchy-ID:controller-list:cgroup-path
+		char* path = strchr(buf, ':');
+		if(path)
+			path = strchr(path + 1, ':');
+		if(!path)
+			continue;
+
+		++path;
+		path[strcspn(path, "\n")] = '\0';
+
+		if(strncmp(path, cgroup, cgroup_len) == 0
+				&& (path[cgroup_len] == '\0' || path[cgroup_len] == '/' || cgroup_len == 1))
+			found = 1;
+	}
+
+	fclose(f);
+	return found;
+}
+
+/**
+ *  Finds every process matching a filter. The calling process itself is never matched.
+ *
+ *  @param[in] filter
+ *  	What to match on. Every criterion given must match.
+ *
+ *  @param[out] processes
+ *  	Array to receive the PIDs of the matching processes, in /proc order.
+ *
+ *  @param[in] max_processes
+ *  	Size of the processes array. Searching stops once it is full.
+ *
+ *  @return
+ *  	The number of processes found.
+ *
+ */
+int find_processes(const ProcessFilter* filter, int* processes, int max_processes)
 {
 	int bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
+	if(bufsize < PATH_MAX)
+		bufsize = PATH_MAX;
 	char* buf = (char*) malloc(bufsize);
 
 	// figure out what the matching uid should be, either a number or -1 if *
-	uid_t uid;
-	if(user[0] == '-' && user[1] == '\0')
-	{
-		uid = -1;
-	}
-	else
+	uid_t uid = -1;
+	if(filter->user && !(filter->user[0] == '-' && filter->user[1] == '\0'))
 	{
 		struct passwd pwd;
 		struct passwd* result;
-		getpwnam_r(user, &pwd, buf, bufsize, &result);
+		getpwnam_r(filter->user, &pwd, buf, bufsize, &result);
 		if(!result)
 		{
 			uid = getuid();
@@ -183,8 +287,9 @@ int find_process(const char* user, const char* name)
 	// loop through everything in /proc
 	int cur_process;
 	int found = 0;
+	int self = getpid();
 	DIR* procfs = opendir("/proc");
-	while(1)
+	while(found < max_processes)
 	{
 		struct dirent* result;
 		readdir_r(procfs, &entry, &result);
@@ -194,7 +299,7 @@ int find_process(const char* user, const char* name)
 		// get pid in number form and check if this is actually a pid entry
 		char* endptr;
 		cur_process = strtol(result->d_name, &endptr, 10);
-		if(*endptr != '\0')
+		if(*endptr != '\0' || cur_process == self)
 			continue;
 
 		// check for matching uid
@@ -202,30 +307,42 @@ int find_process(const char* user, const char* name)
 		{
 			snprintf(buf, bufsize, "/proc/%d", cur_process);
 			struct stat file_stat;
-			stat(buf, &file_stat);
-			if(file_stat.st_uid != uid)
+			if(stat(buf, &file_stat) != 0 || file_stat.st_uid != uid)
 				continue;
 		}
 
-		// retrieve the path of the executable
-		snprintf(buf, bufsize, "/proc/%d/exe", cur_process);
-		char image_path_buf[PATH_MAX];
-		char* image_path = realpath(buf, image_path_buf);
-		if(!image_path)
-			continue;
+		// check for matching parent
+		if(filter->ppid)
+		{
+			unsigned long long ppid;
+			if(!read_stat_field(cur_process, 4, &ppid) || ppid != filter->ppid)
+				continue;
+		}
 
-		// get the last component of the path
-		char* last_sep = strrchr(image_path, '/');
-		if(last_sep == NULL)
-			last_sep = image_path;
-		else
-			++last_sep;
+		if(filter->cgroup && !process_in_cgroup(cur_process, filter->cgroup))
+			continue;
 
-		if(strcmp(last_sep,  name) == 0)
+		if(filter->name)
 		{
-			found = cur_process;
-			break;
+			// retrieve the path of the executable
+			snprintf(buf, bufsize, "/proc/%d/exe", cur_process);
+			char image_path_buf[PATH_MAX];
+			char* image_path = realpath(buf, image_path_buf);
+			if(!image_path)
+				continue;
+
+			// get the last component of the path
+			char* last_sep = strrchr(image_path, '/');
+			if(last_sep == NULL)
+				last_sep = image_path;
+			else
+				++last_sep;
+
+			if(strcmp(last_sep, filter->name) != 0)
+				continue;
 		}
+
+		processes[found++] = cur_process;
 	}
 
 	closedir(procfs);
@@ -235,6 +352,31 @@ int find_process(const char* user, const char* name)
 	return found;
 }
 
+/**
+ *  Finds a process based on the name of its executable and/or the user it is running under.
+ *
+ *  @param[in] user
+ *  	User name of the process to find. "-" for all users. If no user matches the name specified, the current
+ *  	user will be used.
+ *
+ *  @param[in] name
+ *  	The name of the executable image of the process.
+ *
+ *  @return
+ *  	The pid of the process if found, 0 if not found.
+ *
+ */
+int find_process(const char* user, const char* name)
+{
+	ProcessFilter filter = { user, name, NULL, 0 };
+	int process;
+
+	if(find_processes(&filter, &process, 1) == 0)
+		return 0;
+
+	return process;
+}
+
 /**
  *  Finds a process based on a string specifier
  *
@@ -293,3 +435,94 @@ int resolve_process(const char* specifier)
 	return process;
 }
 
+
+/**
+ *  Finds every process matching a string specifier.
+ *
+ *  @param[in] specifier
+ *  	Either a specifier as accepted by resolve_process, in which case all processes with that name match,
+ *  	"cgroup=<path>" to match the processes in a cgroup and its descendants, or "ppid=<pid>" to match
+ *  	the children of a process.
+ *
+ *  @param[out] processes
+ *  	Array to receive the PIDs of the matching processes.
+ *
+ *  @param[in] max_processes
+ *  	Size of the processes array.
+ *
+ *  @return
+ *  	The number of processes found.
+ *
+ */
+int resolve_processes(const char* specifier, int* processes, int max_processes)
+{
+	ProcessFilter filter = { "-", NULL, NULL, 0 };
+
+	if(strncmp(specifier, "cgroup=", sizeof("cgroup=") - 1) == 0)
+	{
+		filter.cgroup = specifier + sizeof("cgroup=") - 1;
+		return find_processes(&filter, processes, max_processes);
+	}
+
+	if(strncmp(specifier, "ppid=", sizeof("ppid=") - 1) == 0)
+	{
+		filter.ppid = atoi(specifier + sizeof("ppid=") - 1);
+		if(filter.ppid <= 0)
+			return 0;
+
+		return find_processes(&filter, processes, max_processes);
+	}
+
+	// a plain PID only matches itself
+	char* endptr;
+	strtol(specifier, &endptr, 10);
+	if(*endptr == '\0')
+	{
+		if(max_processes < 1)
+			return 0;
+
+		processes[0] = resolve_process(specifier);
+		return processes[0] ? 1 : 0;
+	}
+
+	// same user rules as resolve_process
+	char* buffer = strdup(specifier);
+	char* sep = strchr(buffer, '/');
+	if(sep)
+	{
+		*sep = '\0';
+		filter.user = buffer;
+		filter.name = sep + 1;
+	}
+	else
+	{
+		filter.user = (getuid() == 0) ? "-" : "";
+		filter.name = buffer;
+	}
+
+	int found = find_processes(&filter, processes, max_processes);
+
+	free(buffer);
+
+	return found;
+}
+
+/**
+ *  Returns when a process was started, which together with the PID identifies a process even after
+ *  its PID has been reused.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ *  @return
+ *  	The start time in clock ticks since boot, or 0 if the process does not exist.
+ *
+ */
+unsigned long long process_start_time(int process)
+{
+	unsigned long long start_time;
+	if(!read_stat_field(process, 22, &start_time))
+		return 0;
+
+	return start_time;
+}
@@ -3,9 +3,24 @@
 
 #include <stdio.h>
 
+/**
+ * Criteria for find_processes. Leave a field NULL (or 0) to not filter on it.
+ *
+ */
+typedef struct ProcessFilter
+{
+	const char* user;		/// User name as for find_process, "-" for all users.
+	const char* name;		/// Name of the executable image.
+	const char* cgroup;		/// cgroup path; processes in descendant cgroups match too.
+	int ppid;			/// PID of the parent process.
+} ProcessFilter;
+
 char* get_command_output(const char* path, char* arg, ...);
 char* get_command_output_with_input(const char* path, const void* input, size_t input_size, char* argv[]);
 int find_process(const char* user, const char* name);
+int find_processes(const ProcessFilter* filter, int* processes, int max_processes);
 int resolve_process(const char* specifier);
+int resolve_processes(const char* specifier, int* processes, int max_processes);
+unsigned long long process_start_time(int process);
 
 #endif
@@ -0,0 +1,365 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+
+#include "window.h"
+#include "process.h"
+#include "arena.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// A shared window is a memfd mapped both into a target and into us, so bytes written on one side are
+// simply there on the other. The memfd is created by the target, through a remote system call, and we
+// open it through /proc/<target>/fd: being able to trace the target already entitles us to that, whereas
+// the target opening one of our descriptors would depend on its credentials. Once a window is open,
+// process_read and process_write of addresses inside it are a memcpy.
+//
+// A process that exits or execs takes its end of a window with it, while ours stays mapped. Checking
+// for that costs system calls, so it isn't done on every access: refresh_shared_windows checks the
+// windows of a process, which opening a session does, and drops those that are gone for good.
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+#define WINDOW_NAME "lcitk-window"
+
+/**
+ * Memory shared with a target process.
+ *
+ */
+struct SharedWindow
+{
+	int process;				/// The process the window is mapped into.
+	unsigned long long start_time;		/// Start time of the process, in case the PID gets reused.
+	void* local;				/// Address of the window in our address space.
+	uintptr_t remote;			/// Address of the window in the target.
+	size_t size;				/// Size of the window in bytes.
+	SharedWindow* next;
+};
+
+static SharedWindow* windows = NULL;
+static int num_windows = 0;
+static pthread_mutex_t windows_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long remote_mmap(ProcessSession* session, size_t size, int prot, int fd)
+{
+#ifdef SYS_mmap2
+	return session_syscall(session, SYS_mmap2, 6, 0, size, prot, MAP_SHARED, fd, 0);
+#else
+	return session_syscall(session, SYS_mmap, 6, 0, size, prot, MAP_SHARED, fd, 0);
+#endif
+}
+
+/**
+ *  Whether a window is still mapped in its process: the process is the one it was opened in, and it hasn't
+ *  exec'd since, which would have unmapped the window along with everything else.
+ *
+ */
+static int window_mapped(SharedWindow* window)
+{
+	if(process_start_time(window->process) != window->start_time)
+		return 0;
+
+	char path[PATH_MAX];
+	char target[PATH_MAX];
+	snprintf(path, sizeof(path), "/proc/%d/map_files/%" PRIxPTR "-%" PRIxPTR, window->process,
+			window->remote, window->remote + window->size);
+
+	ssize_t len = readlink(path, target, sizeof(target) - 1);
+	if(len < 0)
+		return 0;
+
+	target[len] = '\0';
+	return strstr(target, "/memfd:" WINDOW_NAME) == target;
+}
+
+/**
+ *  Remove a window from the registry, if it is still in it. The caller must hold windows_lock.
+ *
+ */
+static void unlink_window(SharedWindow* window)
+{
+	SharedWindow** cur;
+	for(cur = &windows; *cur; cur = &(*cur)->next)
+	{
+		if(*cur == window)
+		{
+			*cur = window->next;
+			__atomic_store_n(&num_windows, num_windows - 1, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+}
+
+/**
+ *  Create memory shared between us and a process. The window stays mapped in the process after the
+ *  session is closed, until close_shared_window.
+ *
+ *  @param[in] session
+ *  	A session attached to the process.
+ *
+ *  @param[in] size
+ *  	The size of the window in bytes. It is rounded up to whole pages.
+ *
+ *  @return
+ *  	A handle to the window, or NULL on error.
+ *
+ */
+SharedWindow* open_shared_window(ProcessSession* session, size_t size)
+{
+	int process = session_process(session);
+	int page_size = sysconf(_SC_PAGE_SIZE);
+	size = (size + page_size - 1) & ~(page_size - 1);
+
+	static const char name[] = WINDOW_NAME;
+	uintptr_t name_string = scratch_push(session_scratch(session), session, name, sizeof(name));
+	if(!name_string)
+		return NULL;
+
+	long remote_fd = session_syscall(session, SYS_memfd_create, 2, name_string, MFD_CLOEXEC);
+	if(remote_fd < 0)
+	{
+		fprintf(stderr, "Error: cannot create memfd in process %d: %s\n", process, strerror(-remote_fd));
+		return NULL;
+	}
+
+	// never executable: code we could write to from outside at any time has no place in the target
+	long remote = session_syscall(session, SYS_ftruncate, 2, remote_fd, size);
+	if(remote == 0)
+		remote = remote_mmap(session, size, PROT_READ | PROT_WRITE, remote_fd);
+
+	char buf[PATH_MAX];
+	snprintf(buf, sizeof(buf), "/proc/%d/fd/%ld", process, remote_fd);
+	int fd = -1;
+	if(!(remote < 0 && remote > -4096))
+		fd = open(buf, O_RDWR | O_CLOEXEC);
+
+	// the mapping keeps the memfd alive in the target, so its descriptor can go
+	session_syscall(session, SYS_close, 1, remote_fd);
+
+	void* local = MAP_FAILED;
+	if(fd != -1)
+	{
+		local = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+
+	if(local == MAP_FAILED)
+	{
+		// the remote side failing leaves errno alone, so report what it returned instead
+		if(remote < 0 && remote > -4096)
+		{
+			fprintf(stderr, "Error: cannot map memfd in process %d: %s\n", process, strerror(-remote));
+			return NULL;
+		}
+
+		fprintf(stderr, "Error: cannot map memfd of process %d: %s\n", process, strerror(errno));
+		session_syscall(session, SYS_munmap, 2, remote, size);
+
+		return NULL;
+	}
+
+	SharedWindow* window = (SharedWindow*) malloc(sizeof(SharedWindow));
+	window->process = process;
+	window->start_time = process_start_time(process);
+	window->local = local;
+	window->remote = remote;
+	window->size = size;
+
+	pthread_mutex_lock(&windows_lock);
+	window->next = windows;
+	windows = window;
+	__atomic_store_n(&num_windows, num_windows + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&windows_lock);
+
+	return window;
+}
+
+/**
+ *  Unmap a window from both its process and us, and free it.
+ *
+ *  @param[in] window
+ *  	The window to close.
+ *
+ *  @param[in] session
+ *  	A session attached to the window's process, or NULL to open one.
+ *
+ */
+void close_shared_window(SharedWindow* window, ProcessSession* session)
+{
+	pthread_mutex_lock(&windows_lock);
+	unlink_window(window);
+	pthread_mutex_unlock(&windows_lock);
+
+	munmap(window->local, window->size);
+
+	// a process that exited or exec'd has nothing left to unmap, and whatever is at the address now isn't ours
+	if(window_mapped(window))
+	{
+		ProcessSession* own_session = NULL;
+		if(!session)
+			session = own_session = open_process_session(window->process);
+
+		if(session)
+			session_syscall(session, SYS_munmap, 2, window->remote, window->size);
+
+		if(own_session)
+			close_process_session(own_session);
+	}
+
+	free(window);
+}
+
+/**
+ *  Returns the address of a window in our address space.
+ *
+ */
+void* window_local(SharedWindow* window)
+{
+	return window->local;
+}
+
+/**
+ *  Returns the address of a window in its process.
+ *
+ */
+uintptr_t window_remote(SharedWindow* window)
+{
+	return window->remote;
+}
+
+/**
+ *  Returns the size of a window in bytes.
+ *
+ */
+size_t window_size(SharedWindow* window)
+{
+	return window->size;
+}
+
+/**
+ *  Check that the windows open in a process are still mapped there, and stop using those that aren't
+ *  because the process exited or exec'd. They stay open for their owners to close. Until this is called,
+ *  a window is assumed to be mapped, so it is to be called whenever the process may have done either.
+ *
+ *  @param[in] process
+ *  	The process's PID.
+ *
+ */
+void refresh_shared_windows(int process)
+{
+	if(__atomic_load_n(&num_windows, __ATOMIC_ACQUIRE) == 0)
+		return;
+
+	pthread_mutex_lock(&windows_lock);
+	SharedWindow* window = windows;
+	while(window)
+	{
+		SharedWindow* next = window->next;
+		if(window->process == process && !window_mapped(window))
+			unlink_window(window);
+
+		window = next;
+	}
+	pthread_mutex_unlock(&windows_lock);
+}
+
+/**
+ *  Find where a range of a process's memory is in our address space, if it lies in a window.
+ *
+ *  @return
+ *  	The local address, or NULL if the range isn't all in one window.
+ *
+ */
+static void* find_window_range(int process, size_t count, uintptr_t addr)
+{
+	// skip the lock in the common case of there being no windows at all
+	if(__atomic_load_n(&num_windows, __ATOMIC_ACQUIRE) == 0)
+		return NULL;
+
+	void* ret = NULL;
+
+	pthread_mutex_lock(&windows_lock);
+	SharedWindow* window;
+	for(window = windows; window; window = window->next)
+	{
+		if(window->process == process && addr >= window->remote
+				&& count <= window->size && addr - window->remote <= window->size - count)
+		{
+			ret = (char*) window->local + (addr - window->remote);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&windows_lock);
+
+	return ret;
+}
+
+/**
+ *  Reads bytes from a process if they lie within a window, without any system calls.
+ *
+ *  @param[in] process
+ *  	The process PID to read from.
+ *
+ *  @param[out] buf
+ *  	The buffer to read the bytes into.
+ *
+ *  @param[in] count
+ *  	Number of bytes to read.
+ *
+ *  @param[in] addr
+ *  	Address to read from.
+ *
+ *  @return
+ *  	1 if the bytes were read, 0 if they are not all in one window.
+ *
+ */
+int window_read(int process, void* buf, size_t count, uintptr_t addr)
+{
+	void* local = find_window_range(process, count, addr);
+	if(!local)
+		return 0;
+
+	memcpy(buf, local, count);
+	return 1;
+}
+
+/**
+ *  Writes bytes to a process if they lie within a window, without any system calls.
+ *
+ *  @param[in] process
+ *  	The process PID to write to.
+ *
+ *  @param[in] buf
+ *  	The bytes to write.
+ *
+ *  @param[in] count
+ *  	Number of bytes to write.
+ *
+ *  @param[in] addr
+ *  	Address to write to.
+ *
+ *  @return
+ *  	1 if the bytes were written, 0 if the range is not all in one window.
+ *
+ */
+int window_write(int process, const void* buf, size_t count, uintptr_t addr)
+{
+	void* local = find_window_range(process, count, addr);
+	if(!local)
+		return 0;
+
+	memcpy(local, buf, count);
+	return 1;
+}
@@ -0,0 +1,20 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "process.h"
+
+struct SharedWindow;
+typedef struct SharedWindow SharedWindow;
+
+SharedWindow* open_shared_window(ProcessSession* session, size_t size);
+void close_shared_window(SharedWindow* window, ProcessSession* session);
+void* window_local(SharedWindow* window);
+uintptr_t window_remote(SharedWindow* window);
+size_t window_size(SharedWindow* window);
+void refresh_shared_windows(int process);
+int window_read(int process, void* buf, size_t count, uintptr_t addr);
+int window_write(int process, const void* buf, size_t count, uintptr_t addr);
+
+#endif